@@ -0,0 +1,239 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __IBVT_CAPTURE_H_
+#define __IBVT_CAPTURE_H_
+
+#include <pthread.h>
+#include <vector>
+
+#include "common.h"
+
+/*
+ * Frame capture into a pcap-ng file.
+ *
+ * put() is the only call on the data path: it stamps the frame with the
+ * TSC, copies up to CAP_SNAPLEN bytes into a single-producer ring and
+ * publishes the slot with a release store. It never blocks - when the ring
+ * is full the frame is counted as dropped. A writer thread drains the ring,
+ * converts TSC to wall clock time and writes enhanced packet blocks.
+ *
+ * Set IBV_PCAP=<file> to capture raw QP traffic of the raw_qp.h tests.
+ */
+
+#define CAP_SNAPLEN 128
+#define CAP_SLOTS (1 << 14)
+
+enum {
+	CAP_RX = 1,
+	CAP_TX = 2,
+};
+
+struct ibvt_cap_slot {
+	uint64_t tsc;
+	uint32_t len;
+	uint16_t caplen;
+	uint16_t dir;
+	uint8_t data[CAP_SNAPLEN];
+};
+
+struct ibvt_capture {
+	std::vector<struct ibvt_cap_slot> ring;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t drops;
+	uint64_t written;
+	int stop;
+	FILE *f;
+	pthread_t thread;
+	double base_usec;
+	uint64_t base_tsc;
+	double tsc_per_usec;
+
+	ibvt_capture(const char *path) :
+		ring(CAP_SLOTS), head(0), tail(0), drops(0), written(0),
+		stop(0), f(NULL)
+	{
+		f = fopen(path, "w");
+		if (!f) {
+			VERBS_NOTICE("can't open capture file %s\n", path);
+			return;
+		}
+		calibrate();
+		write_header();
+		if (pthread_create(&thread, NULL, writer, this)) {
+			fclose(f);
+			f = NULL;
+		}
+	}
+
+	~ibvt_capture() {
+		if (!f)
+			return;
+		__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+		pthread_join(thread, NULL);
+		fclose(f);
+		if (drops)
+			VERBS_NOTICE("capture dropped %" PRIu64 " frames\n", drops);
+	}
+
+	void put(int dir, const void *data, uint32_t len) {
+		uint64_t h = head;
+
+		if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == CAP_SLOTS) {
+			drops++;
+			return;
+		}
+
+		struct ibvt_cap_slot &s = ring[h & (CAP_SLOTS - 1)];
+
+		s.tsc = sys_rdtsc();
+		s.len = len;
+		s.caplen = len < CAP_SNAPLEN ? len : CAP_SNAPLEN;
+		s.dir = dir;
+		memcpy(s.data, data, s.caplen);
+		__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+	}
+
+	/* blocks until everything put so far is written out */
+	void flush() {
+		uint64_t h = head;
+
+		while (__atomic_load_n(&tail, __ATOMIC_ACQUIRE) != h)
+			usleep(100);
+		fflush(f);
+	}
+
+	void calibrate() {
+		double t0, t1;
+		uint64_t c0, c1;
+
+		t0 = sys_gettime();
+		c0 = sys_rdtsc();
+		usleep(10000);
+		t1 = sys_gettime();
+		c1 = sys_rdtsc();
+
+		base_usec = t1;
+		base_tsc = c1;
+		tsc_per_usec = (double)(c1 - c0) / (t1 - t0);
+	}
+
+	void write_u32(uint32_t v) { fwrite(&v, 4, 1, f); }
+	void write_u16(uint16_t v) { fwrite(&v, 2, 1, f); }
+
+	void write_header() {
+		/* section header block */
+		write_u32(0x0a0d0d0a);
+		write_u32(28);
+		write_u32(0x1a2b3c4d);
+		write_u16(1);
+		write_u16(0);
+		write_u32(0xffffffff);
+		write_u32(0xffffffff);
+		write_u32(28);
+
+		/* interface description block, nanosecond timestamps */
+		write_u32(1);
+		write_u32(32);
+		write_u16(1);	/* LINKTYPE_ETHERNET */
+		write_u16(0);
+		write_u32(CAP_SNAPLEN);
+		write_u16(9);	/* if_tsresol */
+		write_u16(1);
+		write_u32(9);
+		write_u32(0);	/* opt_endofopt */
+		write_u32(32);
+	}
+
+	void write_epb(struct ibvt_cap_slot &s) {
+		uint32_t pad = (4 - (s.caplen & 3)) & 3;
+		uint32_t len = 32 + s.caplen + pad + 12;
+		uint64_t ns = (base_usec + (double)(int64_t)(s.tsc - base_tsc) /
+			       tsc_per_usec) * 1000;
+		uint32_t zero = 0;
+
+		write_u32(6);
+		write_u32(len);
+		write_u32(0);
+		write_u32(ns >> 32);
+		write_u32(ns);
+		write_u32(s.caplen);
+		write_u32(s.len);
+		fwrite(s.data, s.caplen, 1, f);
+		fwrite(&zero, pad, 1, f);
+		write_u16(2);	/* epb_flags, inbound/outbound */
+		write_u16(4);
+		write_u32(s.dir);
+		write_u32(0);
+		write_u32(len);
+	}
+
+	void run() {
+		for (;;) {
+			uint64_t t = tail;
+			uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+			if (t == h) {
+				if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+					break;
+				usleep(100);
+				continue;
+			}
+			written += h - t;
+			for (; t != h; t++)
+				write_epb(ring[t & (CAP_SLOTS - 1)]);
+			__atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+		}
+		fflush(f);
+	}
+
+	static void *writer(void *arg) {
+		((struct ibvt_capture *)arg)->run();
+		return NULL;
+	}
+};
+
+/* process wide capture enabled by IBV_PCAP, NULL when off */
+inline struct ibvt_capture *ibvt_capture_env() {
+	static struct ibvt_capture *cap = NULL;
+	static int once = 0;
+
+	if (!once) {
+		once = 1;
+		if (getenv("IBV_PCAP")) {
+			static struct ibvt_capture c(getenv("IBV_PCAP"));
+
+			if (c.f)
+				cap = &c;
+		}
+	}
+	return cap;
+}
+
+#endif
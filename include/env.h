@@ -129,6 +129,7 @@
 #define ibv_peer_buf		       ibv_exp_peer_buf
 #define ibv_peer_buf_alloc_attr	       ibv_exp_peer_buf_alloc_attr
 #define IBV_SEND_SIGNALED	       IBV_EXP_SEND_SIGNALED
+#define IBV_SEND_INLINE		       IBV_EXP_SEND_INLINE
 
 #define ibv_create_cq_ex_(ctx, attr, n, ch) \
 		ibv_exp_create_cq(ctx, n, NULL, ch, 0, attr)
@@ -157,16 +158,21 @@
 #define IBV_WR_SEND			IBV_EXP_WR_SEND
 #define IBV_WR_RDMA_READ		IBV_EXP_WR_RDMA_READ
 #define IBV_WR_RDMA_WRITE		IBV_EXP_WR_RDMA_WRITE
+#define IBV_WR_ATOMIC_FETCH_AND_ADD	IBV_EXP_WR_ATOMIC_FETCH_AND_ADD
+#define IBV_WR_ATOMIC_CMP_AND_SWP	IBV_EXP_WR_ATOMIC_CMP_AND_SWP
+#define IBV_WR_RDMA_WRITE_WITH_IMM	IBV_EXP_WR_RDMA_WRITE_WITH_IMM
 #define ibv_wr_opcode			ibv_exp_wr_opcode
 #define ibv_send_flags			ibv_exp_send_flags
 #define _wr_opcode			exp_opcode
 #define _wr_send_flags			exp_send_flags
+#define _wr_imm_data			ex.imm_data
 #define ibv_post_send			ibv_exp_post_send
 #define ibv_send_wr			ibv_exp_send_wr
 
 #define ibv_wc				ibv_exp_wc
 #define ibv_poll_cq(a,b,c)		ibv_exp_poll_cq(a,b,c,sizeof(*(c)))
 #define ibv_wc_opcode			ibv_exp_wc_opcode
+#define IBV_WC_RECV_RDMA_WITH_IMM	IBV_EXP_WC_RECV_RDMA_WITH_IMM
 #define _wc_opcode			exp_opcode
 #define wc_flags			exp_wc_flags
 
@@ -186,6 +192,7 @@
 
 #define _wr_opcode			opcode
 #define _wr_send_flags			send_flags
+#define _wr_imm_data			imm_data
 #define _wc_opcode			opcode
 
 #endif
@@ -357,6 +364,9 @@ struct ibvt_ctx : public ibvt_obj {
 	struct ibv_device_attr_ex dev_attr;
 	uint8_t port_num;
 	uint16_t lid;
+	bool roce;
+	int gid_index;
+	union ibv_gid gid;
 	char *pdev_name;
 
 	void init_debugfs() {
@@ -377,25 +387,40 @@ struct ibvt_ctx : public ibvt_obj {
 		}
 	}
 
-	void check_debugfs(const char* var, int val) {
+	/* -1 when the counter is not exposed */
+	long read_debugfs(const char* var) {
 		char path[PATH_MAX];
 		char buff[PATH_MAX];
 		int fd;
+		ssize_t n;
 
 		if (!pdev_name)
-			return;
+			return -1;
 
-		sprintf(path, "/sys/kernel/debug/mlx5/%s/%s", pdev_name, var);
+		if (snprintf(path, sizeof(path), "/sys/kernel/debug/mlx5/%s/%s",
+			     pdev_name, var) >= (int)sizeof(path))
+			return -1;
 		fd = open(path, O_RDONLY);
 
 		if (fd < 0)
-			return;
-		read(fd, buff, sizeof(buff));
+			return -1;
+		n = read(fd, buff, sizeof(buff) - 1);
 		close(fd);
+		if (n < 0)
+			return -1;
+		buff[n] = 0;
 
 		VERBS_TRACE("%3d.%p: debugfs\t%s %s = %s\n", __LINE__,
 			    this, env.lvl_str, var, buff);
-		ASSERT_EQ(val, atoi(buff)) << var;
+		return atol(buff);
+	}
+
+	void check_debugfs(const char* var, int val) {
+		long v = read_debugfs(var);
+
+		if (v < 0)
+			return;
+		ASSERT_EQ(val, v) << var;
 	}
 
 	ibvt_ctx(ibvt_env &e, ibvt_ctx *o = NULL) :
@@ -403,6 +428,8 @@ struct ibvt_ctx : public ibvt_obj {
 		ctx(NULL),
 		other(o),
 		port_num(0),
+		roce(false),
+		gid_index(getenv("IBV_GID_INDEX") ? atoi(getenv("IBV_GID_INDEX")) : 0),
 		pdev_name(NULL) {}
 
 	virtual bool check_port(struct ibv_device *dev, struct ibv_port_attr &port_attr ) {
@@ -421,6 +448,11 @@ struct ibvt_ctx : public ibvt_obj {
 			return;
 
 		dev_list = ibv_get_device_list(&num_devices);
+		if (!dev_list) {
+			VERBS_NOTICE("no RDMA devices\n");
+			env.skip = 1;
+			return;
+		}
 		for (int dev = 0; dev < num_devices; dev++) {
 			if (other && other->dev == dev_list[dev])
 				continue;
@@ -434,6 +466,9 @@ struct ibvt_ctx : public ibvt_obj {
 
 				port_num = port;
 				lid = port_attr.lid;
+				roce = port_attr.link_layer == IBV_LINK_LAYER_ETHERNET;
+				if (roce)
+					DO(ibv_query_gid(ctx, port, gid_index, &gid));
 				break;
 			}
 			if (port_num) {
@@ -454,6 +489,21 @@ struct ibvt_ctx : public ibvt_obj {
 	virtual ~ibvt_ctx() {
 		FREE(ibv_close_device, ctx);
 	}
+
+	/* Address of this port, RoCE ports (soft-RoCE too) need a GRH */
+	void ah_attr(struct ibv_ah_attr &ah, ibvt_ctx &local) {
+		ah.is_global = 0;
+		ah.dlid = lid;
+		ah.sl = 0;
+		ah.src_path_bits = 0;
+		ah.port_num = port_num;
+		if (!roce)
+			return;
+		ah.is_global = 1;
+		ah.grh.dgid = gid;
+		ah.grh.sgid_index = local.gid_index;
+		ah.grh.hop_limit = 1;
+	}
 };
 
 struct ibvt_pd : public ibvt_obj {
@@ -501,6 +551,10 @@ struct ibvt_cq : public ibvt_obj {
 
 	virtual void arm() {}
 
+	virtual int poll_wc(struct ibv_wc *wc, int n) {
+		return ibv_poll_cq(cq, n, wc);
+	}
+
 	virtual void poll(int n) {
 		struct ibv_wc wc[n];
 		long result = 0, retries = POLL_RETRIES;
@@ -509,7 +563,7 @@ struct ibvt_cq : public ibvt_obj {
 
 		errno = 0;
 		while (!result && --retries) {
-			result = ibv_poll_cq(cq, n, wc);
+			result = poll_wc(wc, n);
 			ASSERT_GE(result,0);
 		}
 		ASSERT_GT(retries,0) << "errno: " << errno;
@@ -531,7 +585,7 @@ struct ibvt_cq : public ibvt_obj {
 		VERBS_TRACE("%d.%p polling...\n", __LINE__, this);
 
 		while (!result && --retries) {
-			result = ibv_poll_cq(cq, n, wc);
+			result = poll_wc(wc, n);
 			ASSERT_GE(result,0);
 		}
 		ASSERT_EQ(result,0) << "errno: " << errno;
@@ -605,13 +659,22 @@ struct ibvt_mr : public ibvt_obj {
 		return MAP_PRIVATE|MAP_ANON;
 	}
 
+	/* file to map, a new descriptor that is closed once mapped */
+	virtual int mmap_fd() {
+		return -1;
+	}
+
 	virtual void init() {
 		int flags = mmap_flags();
+		int fd;
 		if (mr)
 			return;
 		EXEC(pd.init());
-		buff = (char*)mmap((void*)addr, size, PROT_READ|PROT_WRITE, flags, -1, 0);
-		ASSERT_NE(buff, MAP_FAILED);
+		fd = mmap_fd();
+		buff = (char*)mmap((void*)addr, size, PROT_READ|PROT_WRITE, flags, fd, 0);
+		if (fd >= 0)
+			close(fd);
+		ASSERT_NE(buff, MAP_FAILED) << "errno: " << errno;
 		memset(buff, 0, size);
 		SET(mr, ibv_reg_mr(pd.pd, buff, size, access_flags));
 		VERBS_TRACE("\t\t\t\tibv_reg_mr(pd, %p, %zx, %lx) = %x\n", buff, size, access_flags, mr->lkey);
@@ -653,6 +716,71 @@ struct ibvt_mr : public ibvt_obj {
 	virtual struct ibv_sge sge() { return sge(0, size); }
 };
 
+struct ibvt_mr_shared : public ibvt_mr {
+	ibvt_mr_shared(ibvt_env &e, ibvt_pd &p, size_t s, intptr_t a = 0,
+		       long af = IBV_ACCESS_LOCAL_WRITE |
+				 IBV_ACCESS_REMOTE_READ |
+				 IBV_ACCESS_REMOTE_WRITE) :
+		ibvt_mr(e, p, s, a, af) {}
+
+	virtual int mmap_flags() {
+		return MAP_SHARED|MAP_ANON;
+	}
+};
+
+/*
+ * MR over a file that is unlinked as soon as it is created, in
+ * IBV_MR_DIR or /dev/shm. Space is allocated up front so a full file
+ * system fails the mmap instead of raising SIGBUS on first touch.
+ */
+struct ibvt_mr_file : public ibvt_mr {
+	ibvt_mr_file(ibvt_env &e, ibvt_pd &p, size_t s, intptr_t a = 0,
+		     long af = IBV_ACCESS_LOCAL_WRITE |
+			       IBV_ACCESS_REMOTE_READ |
+			       IBV_ACCESS_REMOTE_WRITE) :
+		ibvt_mr(e, p, s, a, af) {}
+
+	virtual int mmap_flags() {
+		return MAP_SHARED;
+	}
+
+	virtual int open_file() {
+		char path[PATH_MAX];
+		int fd;
+
+		snprintf(path, sizeof(path), "%s/ibvt_mr.XXXXXX",
+			 getenv("IBV_MR_DIR") ? getenv("IBV_MR_DIR") : "/dev/shm");
+		fd = mkstemp(path);
+		if (fd >= 0)
+			unlink(path);
+		return fd;
+	}
+
+	virtual int mmap_fd() {
+		int fd = open_file();
+
+		if (fd >= 0 && posix_fallocate(fd, 0, size)) {
+			close(fd);
+			fd = -1;
+		}
+		return fd;
+	}
+};
+
+#ifdef HAVE_MEMFD_CREATE
+struct ibvt_mr_memfd : public ibvt_mr_file {
+	ibvt_mr_memfd(ibvt_env &e, ibvt_pd &p, size_t s, intptr_t a = 0,
+		      long af = IBV_ACCESS_LOCAL_WRITE |
+				IBV_ACCESS_REMOTE_READ |
+				IBV_ACCESS_REMOTE_WRITE) :
+		ibvt_mr_file(e, p, s, a, af) {}
+
+	virtual int open_file() {
+		return memfd_create("ibvt_mr", 0);
+	}
+};
+#endif
+
 struct ibvt_mr_hdr : public ibvt_mr {
 	size_t hdr_size;
 
@@ -690,6 +818,29 @@ struct ibvt_mr_ud : public ibvt_mr_hdr {
 		ibvt_mr_hdr(e, p, s, 40) {}
 };
 
+/* n 8 byte words for atomics, each stride bytes apart */
+struct ibvt_mr_atomic : public ibvt_mr {
+	size_t stride;
+
+	ibvt_mr_atomic(ibvt_env &e, ibvt_pd &p, size_t n, size_t st = 8) :
+		ibvt_mr(e, p, n * ((st + 7) & ~7UL), 0,
+			IBV_ACCESS_LOCAL_WRITE |
+			IBV_ACCESS_REMOTE_READ |
+			IBV_ACCESS_REMOTE_WRITE |
+			IBV_ACCESS_REMOTE_ATOMIC),
+		stride((st + 7) & ~7UL) {}
+
+	uint64_t &word(size_t i) {
+		return *(uint64_t *)(buff + i * stride);
+	}
+
+	using ibvt_mr::sge;
+
+	struct ibv_sge sge(size_t i) {
+		return ibvt_mr::sge(i * stride, sizeof(uint64_t));
+	}
+};
+
 struct ibvt_srq : public ibvt_obj {
 	struct ibv_srq *srq;
 
@@ -755,8 +906,10 @@ struct ibvt_qp : public ibvt_obj {
 	struct ibv_qp *qp;
 	ibvt_pd &pd;
 	ibvt_cq &cq;
+	/* SGEs per send and receive WR, up to max_sge of the device */
+	int max_sge;
 
-	ibvt_qp(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) : ibvt_obj(e), qp(NULL), pd(p), cq(c) {}
+	ibvt_qp(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) : ibvt_obj(e), qp(NULL), pd(p), cq(c), max_sge(1) {}
 
 	virtual ~ibvt_qp() {
 		FREE(ibv_destroy_qp, qp);
@@ -766,8 +919,8 @@ struct ibvt_qp : public ibvt_obj {
 		memset(&attr, 0, sizeof(attr));
 		attr.cap.max_send_wr = 0x1000;
 		attr.cap.max_recv_wr = 0x1000;
-		attr.cap.max_send_sge = 1;
-		attr.cap.max_recv_sge = 1;
+		attr.cap.max_send_sge = max_sge;
+		attr.cap.max_recv_sge = max_sge;
 		attr.send_cq = cq.cq;
 		attr.recv_cq = cq.cq;
 		attr.pd = pd.pd;
@@ -832,18 +985,25 @@ struct ibvt_qp : public ibvt_obj {
 			   ibv_sge dst_sge,
 			   enum ibv_wr_opcode opcode,
 			   enum ibv_send_flags flags = IBV_SEND_SIGNALED) {
-		struct ibv_send_wr wr;
-		struct ibv_send_wr *bad_wr = NULL;
 		struct ibv_sge sg[2];
 
-
 		sg[0] = src_sge1;
 		sg[1] = src_sge2;
+		EXEC(rdma_sgl(sg, 2, dst_sge, opcode, flags));
+	}
+
+	/* Gather lists of n entries, no more than max_sge */
+	virtual void rdma_sgl(ibv_sge *sgl, int n, ibv_sge dst_sge,
+			      enum ibv_wr_opcode opcode,
+			      int flags = IBV_SEND_SIGNALED) {
+		struct ibv_send_wr wr;
+		struct ibv_send_wr *bad_wr = NULL;
+
 		memset(&wr, 0, sizeof(wr));
 		wr.next = NULL;
 		wr.wr_id = 0;
-		wr.sg_list = sg;
-		wr.num_sge = 2;
+		wr.sg_list = sgl;
+		wr.num_sge = n;
 		wr._wr_opcode = opcode;
 		wr._wr_send_flags = flags;
 
@@ -853,6 +1013,34 @@ struct ibvt_qp : public ibvt_obj {
 		DO(ibv_post_send(qp, &wr, &bad_wr));
 	}
 
+	virtual void post_send_sgl(ibv_sge *sgl, int n,
+				   enum ibv_wr_opcode opcode,
+				   int flags = IBV_SEND_SIGNALED) {
+		struct ibv_send_wr wr;
+		struct ibv_send_wr *bad_wr = NULL;
+
+		memset(&wr, 0, sizeof(wr));
+		wr.next = NULL;
+		wr.wr_id = 0;
+		wr.sg_list = sgl;
+		wr.num_sge = n;
+		wr._wr_opcode = opcode;
+		wr._wr_send_flags = flags;
+		DO(ibv_post_send(qp, &wr, &bad_wr));
+	}
+
+	virtual void recv_sgl(ibv_sge *sgl, int n) {
+		struct ibv_recv_wr wr;
+		struct ibv_recv_wr *bad_wr = NULL;
+
+		memset(&wr, 0, sizeof(wr));
+		wr.next = NULL;
+		wr.wr_id = 0;
+		wr.sg_list = sgl;
+		wr.num_sge = n;
+		DO(ibv_post_recv(qp, &wr, &bad_wr));
+	}
+
 	virtual void send(ibv_sge sge) {
 		post_send(sge, IBV_WR_SEND);
 	}
@@ -862,8 +1050,11 @@ struct ibvt_qp : public ibvt_obj {
 
 struct ibvt_qp_rc : public ibvt_qp {
 	ibvt_qp *remote;
+	/* RDMA reads and atomics in flight, both ways */
+	int rd_atomic;
 
-	ibvt_qp_rc(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) : ibvt_qp(e, p, c) {}
+	ibvt_qp_rc(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) :
+		ibvt_qp(e, p, c), rd_atomic(1) {}
 
 	virtual void init_attr(struct ibv_qp_init_attr_ex &attr) {
 		ibvt_qp::init_attr(attr);
@@ -880,7 +1071,8 @@ struct ibvt_qp_rc : public ibvt_qp {
 		attr.qp_state = IBV_QPS_INIT;
 		attr.port_num = pd.ctx.port_num;
 		attr.pkey_index = 0;
-		attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+		attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE |
+				       IBV_ACCESS_REMOTE_ATOMIC;
 		flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
 		DO(ibv_modify_qp(qp, &attr, flags));
 
@@ -889,13 +1081,9 @@ struct ibvt_qp_rc : public ibvt_qp {
 		attr.path_mtu = IBV_MTU_512;
 		attr.dest_qp_num = remote->qp->qp_num;
 		attr.rq_psn = 0;
-		attr.max_dest_rd_atomic = 1;
+		attr.max_dest_rd_atomic = rd_atomic;
 		attr.min_rnr_timer = 12;
-		attr.ah_attr.is_global = 0;
-		attr.ah_attr.dlid = remote->pd.ctx.lid;
-		attr.ah_attr.sl = 0;
-		attr.ah_attr.src_path_bits = 0;
-		attr.ah_attr.port_num = remote->pd.ctx.port_num;
+		remote->pd.ctx.ah_attr(attr.ah_attr, pd.ctx);
 		flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
 			IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
 		DO(ibv_modify_qp(qp, &attr, flags));
@@ -906,12 +1094,55 @@ struct ibvt_qp_rc : public ibvt_qp {
 		attr.retry_cnt = 7;
 		attr.rnr_retry = 7;
 		attr.sq_psn = 0;
-		attr.max_rd_atomic = 1;
+		attr.max_rd_atomic = rd_atomic;
 		flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
 			IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
 
 		DO(ibv_modify_qp(qp, &attr, flags));
 	}
+
+	/*
+	 * The 8 byte word at dst_sge is updated remotely, its old value
+	 * lands in src_sge. dst_sge must be 8 byte aligned and registered
+	 * with IBV_ACCESS_REMOTE_ATOMIC, see ibvt_mr_atomic.
+	 */
+	virtual void atomic(ibv_sge src_sge, ibv_sge dst_sge,
+			    enum ibv_wr_opcode opcode, uint64_t compare_add,
+			    uint64_t swap = 0, uint64_t wr_id = 0,
+			    int flags = IBV_SEND_SIGNALED) {
+		struct ibv_send_wr wr;
+		struct ibv_send_wr *bad_wr = NULL;
+
+		ASSERT_EQ(0U, dst_sge.addr & 7) << "unaligned atomic target";
+		src_sge.length = sizeof(uint64_t);
+
+		memset(&wr, 0, sizeof(wr));
+		wr.next = NULL;
+		wr.wr_id = wr_id;
+		wr.sg_list = &src_sge;
+		wr.num_sge = 1;
+		wr._wr_opcode = opcode;
+		wr._wr_send_flags = flags;
+
+		wr.wr.atomic.remote_addr = dst_sge.addr;
+		wr.wr.atomic.rkey = dst_sge.lkey;
+		wr.wr.atomic.compare_add = compare_add;
+		wr.wr.atomic.swap = swap;
+
+		DO(ibv_post_send(qp, &wr, &bad_wr));
+	}
+
+	virtual void fetch_add(ibv_sge src_sge, ibv_sge dst_sge, uint64_t add,
+			       uint64_t wr_id = 0) {
+		EXEC(atomic(src_sge, dst_sge, IBV_WR_ATOMIC_FETCH_AND_ADD,
+			    add, 0, wr_id));
+	}
+
+	virtual void cmp_swp(ibv_sge src_sge, ibv_sge dst_sge, uint64_t compare,
+			     uint64_t swap, uint64_t wr_id = 0) {
+		EXEC(atomic(src_sge, dst_sge, IBV_WR_ATOMIC_CMP_AND_SWP,
+			    compare, swap, wr_id));
+	}
 };
 
 struct ibvt_qp_ud : public ibvt_qp_rc {
@@ -967,11 +1198,7 @@ struct ibvt_qp_ud : public ibvt_qp_rc {
 		flags = IBV_QP_STATE;
 		DO(ibv_modify_qp(qp, &attr, flags));
 
-		attr.ah_attr.is_global = 0;
-		attr.ah_attr.dlid = remote->pd.ctx.lid;
-		attr.ah_attr.sl = 0;
-		attr.ah_attr.src_path_bits = 0;
-		attr.ah_attr.port_num = remote->pd.ctx.port_num;
+		remote->pd.ctx.ah_attr(attr.ah_attr, pd.ctx);
 		SET(ah, ibv_create_ah(pd.pd, &attr.ah_attr));
 
 		memset(&attr, 0, sizeof(attr));
@@ -1054,15 +1281,11 @@ struct ibvt_qp_dc : public ibvt_qp_ud {
 		memset(&attr, 0, sizeof(attr));
 		attr.qp_state = IBV_QPS_RTR;
 		attr.path_mtu = IBV_MTU_512;
-		attr.ah_attr.is_global = 0;
 		flags = IBV_EXP_QP_STATE | IBV_EXP_QP_PATH_MTU |
 			IBV_EXP_QP_AV;
 
 
-		attr.ah_attr.dlid = dremote->pd.ctx.lid;
-		attr.ah_attr.sl = 0;
-		attr.ah_attr.src_path_bits = 0;
-		attr.ah_attr.port_num = dremote->pd.ctx.port_num;
+		dremote->pd.ctx.ah_attr(attr.ah_attr, pd.ctx);
 		SET(ah, ibv_create_ah(pd.pd, &attr.ah_attr));
 		DO(ibv_exp_modify_qp(qp, &attr, flags));
 
@@ -1136,5 +1359,66 @@ struct ibvt_qp_srq : public QP {
 
 };
 
+#define IBVT_INLINE 0x100
+
+static inline uint32_t ibvt_inline(void)
+{
+	return getenv("IBV_INLINE") ? strtoul(getenv("IBV_INLINE"), NULL, 0) :
+		IBVT_INLINE;
+}
+
+/*
+ * Sends that fit max_inline go with IBV_SEND_INLINE: the payload is
+ * copied into the WQE at post time, so the HCA does not DMA read it and
+ * needs no lkey for it. max_inline is what the QP got, which may be more
+ * than it asked for.
+ */
+template <typename QP>
+struct ibvt_qp_inline : public QP {
+	uint32_t max_inline;
+	bool use_inline;
+
+	ibvt_qp_inline(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) :
+		QP(e, p, c), max_inline(ibvt_inline()), use_inline(true) {}
+
+	virtual void init_attr(struct ibv_qp_init_attr_ex &attr) {
+		QP::init_attr(attr);
+		attr.cap.max_inline_data = max_inline;
+	}
+
+	virtual void init() {
+		/* DO() names env, a member of the dependent base */
+		ibvt_env &env = this->env;
+		struct ibv_qp_attr attr;
+		struct ibv_qp_init_attr init_attr;
+
+		INIT(QP::init());
+		DO(ibv_query_qp(this->qp, &attr, IBV_QP_CAP, &init_attr));
+		max_inline = init_attr.cap.max_inline_data;
+	}
+
+	/* UD sends skip the GRH room at the head of the buffer */
+	bool fits(ibv_sge &sge) {
+		size_t hdr = this->qp->qp_type == IBV_QPT_UD ? 40 : 0;
+
+		return use_inline && sge.length <= max_inline + hdr;
+	}
+
+	virtual void post_send(ibv_sge sge, enum ibv_wr_opcode opcode,
+			       int flags = IBV_SEND_SIGNALED) {
+		if (fits(sge))
+			flags |= IBV_SEND_INLINE;
+		QP::post_send(sge, opcode, flags);
+	}
+
+	virtual void rdma(ibv_sge src_sge, ibv_sge dst_sge,
+			  enum ibv_wr_opcode opcode,
+			  enum ibv_send_flags flags = IBV_SEND_SIGNALED) {
+		if (opcode == IBV_WR_RDMA_WRITE && fits(src_sge))
+			flags = (enum ibv_send_flags)(flags | IBV_SEND_INLINE);
+		QP::rdma(src_sge, dst_sge, opcode, flags);
+	}
+};
+
 #endif
 
@@ -0,0 +1,401 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __IBVT_FLOW_H_
+#define __IBVT_FLOW_H_
+
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include "env.h"
+
+/*
+ * Flow steering rule with the spec layout fixed at compile time.
+ *
+ * The spec sequence is given as a type list, e.g.
+ *
+ *	ibvt_flow<flow_eth, flow_ipv4, flow_udp, flow_tag> rule;
+ *
+ * Total size, spec offsets and num_of_specs are computed by the compiler
+ * and the whole rule lives in one inline buffer, so a rule is a plain
+ * value: it can be kept on the stack, modified and passed to
+ * ibv_create_flow() any number of times without touching the heap.
+ */
+
+template <typename S, int T>
+struct flow_spec {
+	typedef S spec_t;
+	static const int type = T;
+};
+
+typedef flow_spec<struct ibv_flow_spec_eth, IBV_FLOW_SPEC_ETH> flow_eth;
+typedef flow_spec<struct ibv_flow_spec_ipv4, IBV_FLOW_SPEC_IPV4> flow_ipv4;
+typedef flow_spec<struct ibv_flow_spec_tcp_udp, IBV_FLOW_SPEC_UDP> flow_udp;
+
+#ifdef HAVE_VXLAN
+typedef flow_spec<struct ibv_flow_spec_tunnel, IBV_FLOW_SPEC_VXLAN_TUNNEL> flow_tunnel;
+typedef flow_spec<struct ibv_flow_spec_action_tag, IBV_FLOW_SPEC_ACTION_TAG> flow_tag;
+
+template <typename F>
+struct flow_inner : public flow_spec<typename F::spec_t,
+				     F::type | IBV_FLOW_SPEC_INNER> {};
+#endif
+
+template <typename... S>
+struct flow_specs;
+
+template <>
+struct flow_specs<> {
+	static const size_t size = 0;
+	static const int count = 0;
+
+	static void init(uint8_t *p) {}
+};
+
+template <typename H, typename... T>
+struct flow_specs<H, T...> {
+	typedef H head;
+	typedef flow_specs<T...> tail;
+	typedef typename H::spec_t spec_t;
+
+	static const size_t size = sizeof(spec_t) + tail::size;
+	static const int count = 1 + tail::count;
+
+	static void init(uint8_t *p) {
+		spec_t *s = (spec_t *)p;
+
+		s->type = (enum ibv_flow_spec_type)H::type;
+		s->size = sizeof(spec_t);
+		tail::init(p + sizeof(spec_t));
+	}
+};
+
+template <int N, typename L>
+struct flow_spec_at {
+	typedef flow_spec_at<N - 1, typename L::tail> next;
+	typedef typename next::spec_t spec_t;
+
+	static const size_t offset = sizeof(typename L::spec_t) + next::offset;
+};
+
+template <typename L>
+struct flow_spec_at<0, L> {
+	typedef typename L::spec_t spec_t;
+
+	static const size_t offset = 0;
+};
+
+template <typename... S>
+struct ibvt_flow {
+	typedef flow_specs<S...> specs;
+
+	static const size_t size = sizeof(struct ibv_flow_attr) + specs::size;
+	static const int count = specs::count;
+
+	static_assert(size <= UINT16_MAX, "flow rule does not fit ibv_flow_attr.size");
+	static_assert(count <= UINT8_MAX, "too many specs for ibv_flow_attr.num_of_specs");
+
+	uint8_t buff[size] ALIGN(8);
+
+	ibvt_flow(uint16_t priority = 0) {
+		struct ibv_flow_attr *a = attr();
+
+		memset(buff, 0, size);
+		a->type = IBV_FLOW_ATTR_NORMAL;
+		a->size = size;
+		a->priority = priority;
+		a->num_of_specs = count;
+		specs::init(buff + sizeof(struct ibv_flow_attr));
+	}
+
+	struct ibv_flow_attr *attr() {
+		return (struct ibv_flow_attr *)buff;
+	}
+
+	template <int N>
+	typename flow_spec_at<N, specs>::spec_t &spec() {
+		static_assert(N < count, "spec index out of range");
+		return *(typename flow_spec_at<N, specs>::spec_t *)
+			(buff + sizeof(struct ibv_flow_attr) +
+			 flow_spec_at<N, specs>::offset);
+	}
+};
+
+/* Helpers taking host order values and setting exact-match masks */
+
+static inline void flow_set_eth(struct ibv_flow_spec_eth &s,
+				const uint8_t *dst, const uint8_t *src,
+				uint16_t ether_type)
+{
+	memcpy(s.val.dst_mac, dst, sizeof(s.val.dst_mac));
+	memset(s.mask.dst_mac, 0xff, sizeof(s.mask.dst_mac));
+	memcpy(s.val.src_mac, src, sizeof(s.val.src_mac));
+	memset(s.mask.src_mac, 0xff, sizeof(s.mask.src_mac));
+	s.val.ether_type = htons(ether_type);
+	s.mask.ether_type = 0xffff;
+}
+
+static inline void flow_set_ipv4(struct ibv_flow_spec_ipv4 &s,
+				 uint32_t src_ip, uint32_t dst_ip)
+{
+	s.val.src_ip = htonl(src_ip);
+	s.mask.src_ip = 0xffffffff;
+	s.val.dst_ip = htonl(dst_ip);
+	s.mask.dst_ip = 0xffffffff;
+}
+
+static inline void flow_set_udp(struct ibv_flow_spec_tcp_udp &s,
+				uint16_t src_port, uint16_t dst_port)
+{
+	s.val.src_port = htons(src_port);
+	s.mask.src_port = 0xffff;
+	s.val.dst_port = htons(dst_port);
+	s.mask.dst_port = 0xffff;
+}
+
+/*
+ * Software steering: match a frame against a rule the way the NIC would,
+ * for backends without flow steering hardware.
+ */
+
+#define FLOW_VXLAN_PORT 4789
+#define FLOW_VXLAN_HDR 8
+
+struct flow_pkt {
+	const struct ether_header *eth[2];
+	const struct iphdr *ip[2];
+	const struct udphdr *udp[2];
+	const uint8_t *vxlan;
+};
+
+static inline void flow_parse_l2(struct flow_pkt &p, int l,
+				 const uint8_t *data, size_t len)
+{
+	const uint8_t *end = data + len;
+
+	if (data + sizeof(struct ether_header) > end)
+		return;
+	p.eth[l] = (const struct ether_header *)data;
+	data += sizeof(struct ether_header);
+
+	if (p.eth[l]->ether_type != htons(ETH_P_IP) ||
+	    data + sizeof(struct iphdr) > end)
+		return;
+	p.ip[l] = (const struct iphdr *)data;
+	data += p.ip[l]->ihl * 4;
+
+	if (p.ip[l]->protocol != IPPROTO_UDP ||
+	    data + sizeof(struct udphdr) > end)
+		return;
+	p.udp[l] = (const struct udphdr *)data;
+	data += sizeof(struct udphdr);
+
+	if (l || p.udp[l]->dest != htons(FLOW_VXLAN_PORT) ||
+	    data + FLOW_VXLAN_HDR > end)
+		return;
+	p.vxlan = data;
+	flow_parse_l2(p, 1, data + FLOW_VXLAN_HDR, end - data - FLOW_VXLAN_HDR);
+}
+
+static inline bool flow_cmp(const void *val, const void *mask,
+			    const void *pkt, size_t n)
+{
+	const uint8_t *v = (const uint8_t *)val;
+	const uint8_t *m = (const uint8_t *)mask;
+	const uint8_t *p = (const uint8_t *)pkt;
+
+	for (size_t i = 0; i < n; i++)
+		if ((v[i] & m[i]) != (p[i] & m[i]))
+			return false;
+	return true;
+}
+
+/* Returns true when every spec of the rule matches, *tag gets the action tag */
+static inline bool flow_match(struct ibv_flow_attr *attr,
+			      const void *frame, size_t len, uint32_t *tag)
+{
+	uint8_t *s = (uint8_t *)(attr + 1);
+	struct flow_pkt p;
+
+	memset(&p, 0, sizeof(p));
+	flow_parse_l2(p, 0, (const uint8_t *)frame, len);
+	*tag = 0;
+
+	for (int i = 0; i < attr->num_of_specs; i++) {
+		struct ibv_flow_spec *spec = (struct ibv_flow_spec *)s;
+		int type = spec->hdr.type;
+		int l = 0;
+
+		s += spec->hdr.size;
+#ifdef HAVE_VXLAN
+		if (type & IBV_FLOW_SPEC_INNER) {
+			type &= ~IBV_FLOW_SPEC_INNER;
+			l = 1;
+		}
+#endif
+		switch (type) {
+		case IBV_FLOW_SPEC_ETH: {
+			struct ibv_flow_spec_eth &e = *(struct ibv_flow_spec_eth *)spec;
+
+			if (!p.eth[l] ||
+			    !flow_cmp(e.val.dst_mac, e.mask.dst_mac, p.eth[l]->ether_dhost, 6) ||
+			    !flow_cmp(e.val.src_mac, e.mask.src_mac, p.eth[l]->ether_shost, 6) ||
+			    !flow_cmp(&e.val.ether_type, &e.mask.ether_type, &p.eth[l]->ether_type, 2) ||
+			    (e.val.vlan_tag & e.mask.vlan_tag))
+				return false;
+			break;
+		}
+		case IBV_FLOW_SPEC_IPV4: {
+			struct ibv_flow_spec_ipv4 &ip = *(struct ibv_flow_spec_ipv4 *)spec;
+
+			if (!p.ip[l] ||
+			    !flow_cmp(&ip.val.src_ip, &ip.mask.src_ip, &p.ip[l]->saddr, 4) ||
+			    !flow_cmp(&ip.val.dst_ip, &ip.mask.dst_ip, &p.ip[l]->daddr, 4))
+				return false;
+			break;
+		}
+		case IBV_FLOW_SPEC_UDP: {
+			struct ibv_flow_spec_tcp_udp &u = *(struct ibv_flow_spec_tcp_udp *)spec;
+
+			if (!p.udp[l] ||
+			    !flow_cmp(&u.val.src_port, &u.mask.src_port, &p.udp[l]->source, 2) ||
+			    !flow_cmp(&u.val.dst_port, &u.mask.dst_port, &p.udp[l]->dest, 2))
+				return false;
+			break;
+		}
+#ifdef HAVE_VXLAN
+		case IBV_FLOW_SPEC_VXLAN_TUNNEL: {
+			struct ibv_flow_spec_tunnel &t = *(struct ibv_flow_spec_tunnel *)spec;
+			uint32_t vni;
+
+			if (!p.vxlan)
+				return false;
+			vni = htonl(p.vxlan[4] << 16 | p.vxlan[5] << 8 | p.vxlan[6]);
+			if (!flow_cmp(&t.val.tunnel_id, &t.mask.tunnel_id, &vni, 4))
+				return false;
+			break;
+		}
+		case IBV_FLOW_SPEC_ACTION_TAG:
+			*tag = ((struct ibv_flow_spec_action_tag *)spec)->tag_id;
+			break;
+#endif
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Frame construction, the inverse of flow_parse_l2(). Tuples are host
+ * order. VXLAN frames are built in place: the inner frame goes at
+ * buf + FLOW_VXLAN_OVERHEAD and flow_vxlan_encap() prepends the outer
+ * headers, so encapsulation never copies the payload.
+ */
+
+#define FLOW_UDP_HDRS (sizeof(struct ether_header) + sizeof(struct iphdr) + \
+		       sizeof(struct udphdr))
+#define FLOW_VXLAN_OVERHEAD (FLOW_UDP_HDRS + FLOW_VXLAN_HDR)
+
+struct flow_tuple {
+	uint32_t src_ip;
+	uint32_t dst_ip;
+	uint16_t src_port;
+	uint16_t dst_port;
+};
+
+static inline uint16_t flow_ip_csum(const struct iphdr *ip)
+{
+	const uint16_t *w = (const uint16_t *)ip;
+	uint32_t sum = 0;
+
+	for (int i = 0; i < ip->ihl * 2; i++)
+		sum += w[i];
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += sum >> 16;
+	return ~sum;
+}
+
+/* eth/ipv4/udp headers for payload bytes of data, returns the frame length */
+static inline size_t flow_build_udp(uint8_t *buf, const uint8_t *dst,
+				    const uint8_t *src,
+				    const struct flow_tuple &t, size_t payload)
+{
+	struct ether_header *eh = (struct ether_header *)buf;
+	struct iphdr *ip = (struct iphdr *)(eh + 1);
+	struct udphdr *udp = (struct udphdr *)(ip + 1);
+
+	memcpy(eh->ether_dhost, dst, ETH_ALEN);
+	memcpy(eh->ether_shost, src, ETH_ALEN);
+	eh->ether_type = htons(ETH_P_IP);
+
+	memset(ip, 0, sizeof(*ip));
+	ip->ihl = 5;
+	ip->version = 4;
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->tot_len = htons(sizeof(*ip) + sizeof(*udp) + payload);
+	ip->saddr = htonl(t.src_ip);
+	ip->daddr = htonl(t.dst_ip);
+	ip->check = flow_ip_csum(ip);
+
+	udp->source = htons(t.src_port);
+	udp->dest = htons(t.dst_port);
+	udp->len = htons(sizeof(*udp) + payload);
+	udp->check = 0;
+
+	return FLOW_UDP_HDRS + payload;
+}
+
+/*
+ * Outer headers and VXLAN header in front of the inner_len bytes frame at
+ * buf + FLOW_VXLAN_OVERHEAD, returns the frame length. The outer
+ * destination port is always FLOW_VXLAN_PORT.
+ */
+static inline size_t flow_vxlan_encap(uint8_t *buf, const uint8_t *dst,
+				      const uint8_t *src,
+				      const struct flow_tuple &outer,
+				      uint32_t vni, size_t inner_len)
+{
+	struct flow_tuple t = outer;
+	uint8_t *vx = buf + FLOW_UDP_HDRS;
+
+	t.dst_port = FLOW_VXLAN_PORT;
+	flow_build_udp(buf, dst, src, t, FLOW_VXLAN_HDR + inner_len);
+	memset(vx, 0, FLOW_VXLAN_HDR);
+	vx[0] = 0x08;	/* valid VNI */
+	vx[4] = vni >> 16;
+	vx[5] = vni >> 8;
+	vx[6] = vni;
+
+	return FLOW_VXLAN_OVERHEAD + inner_len;
+}
+
+#endif
@@ -0,0 +1,690 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __IBVT_RAW_QP_H_
+#define __IBVT_RAW_QP_H_
+
+#include <list>
+#include <vector>
+
+#include <errno.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+
+#include "env.h"
+#include "flow.h"
+#include "capture.h"
+
+/*
+ * Raw Ethernet QP and its two backends:
+ *
+ *  raw_hw  - IBV_QPT_RAW_PACKET on a RAW_PACKET capable NIC
+ *  raw_pkt - AF_PACKET socket with TPACKET_V3 TX/RX rings on a netdev,
+ *	      flow rules are matched in software and received frames are
+ *	      delivered as completions to a software CQ.
+ *
+ * The pkt backend uses IBV_PKT_DEV (default "lo") for receive and
+ * IBV_PKT_TX_DEV (default IBV_PKT_DEV) for transmit, so it runs either on
+ * loopback or on the two ends of a veth pair.
+ */
+
+#define RAW_QP_DEPTH 256
+
+/*
+ * RX blocks are handed over when full or after the 1ms retire timeout,
+ * keep them well below RAW_QP_DEPTH frames so a full receive window never
+ * waits for the timer.
+ */
+#define PKT_BLOCK_SIZE (1 << 12)
+#define PKT_FRAME_SIZE 2048
+#define PKT_RX_BLOCKS 512
+#define PKT_TX_BLOCKS 128
+#define PKT_TX_DATA TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+struct ibvt_ctx_eth : public ibvt_ctx {
+	ibvt_ctx_eth(ibvt_env &e) : ibvt_ctx(e) {}
+
+	virtual bool check_port(struct ibv_device *dev, struct ibv_port_attr &port_attr) {
+		return ibvt_ctx::check_port(dev, port_attr) &&
+			port_attr.link_layer == IBV_LINK_LAYER_ETHERNET;
+	}
+};
+
+struct ibvt_raw_qp : public ibvt_qp {
+	struct ibv_flow *flow;
+	struct ibvt_capture *capture;
+
+	ibvt_raw_qp(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) :
+		ibvt_qp(e, p, c), flow(NULL), capture(NULL) {}
+
+	virtual void init_attr(struct ibv_qp_init_attr_ex &attr) {
+		ibvt_qp::init_attr(attr);
+		attr.sq_sig_all = 1;
+		attr.cap.max_send_wr = RAW_QP_DEPTH;
+		attr.cap.max_recv_wr = RAW_QP_DEPTH;
+		attr.qp_type = IBV_QPT_RAW_PACKET;
+	}
+
+	virtual void connect(ibvt_qp *r) {
+		struct ibv_qp_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.qp_state = IBV_QPS_INIT;
+		attr.port_num = pd.ctx.port_num;
+		DO(ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PORT));
+
+		memset(&attr, 0, sizeof(attr));
+		attr.qp_state = IBV_QPS_RTR;
+		DO(ibv_modify_qp(qp, &attr, IBV_QP_STATE));
+
+		memset(&attr, 0, sizeof(attr));
+		attr.qp_state = IBV_QPS_RTS;
+		DO(ibv_modify_qp(qp, &attr, IBV_QP_STATE));
+	}
+
+	virtual struct ibv_flow *add_flow(struct ibv_flow_attr *attr) {
+		return ibv_create_flow(qp, attr);
+	}
+
+	virtual int del_flow(struct ibv_flow *f) {
+		return ibv_destroy_flow(f);
+	}
+
+	void create_flow(struct ibv_flow_attr *attr) {
+		SET(flow, add_flow(attr));
+	}
+
+	void destroy_flow() {
+		DO(del_flow(flow));
+		flow = NULL;
+	}
+
+	/* wr_id carries the buffer so received frames can be found from the WC */
+	virtual void recv(ibv_sge sge) {
+		struct ibv_recv_wr wr;
+		struct ibv_recv_wr *bad_wr = NULL;
+
+		memset(&wr, 0, sizeof(wr));
+		wr.wr_id = sge.addr;
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		DO(ibv_post_recv(qp, &wr, &bad_wr));
+	}
+
+	virtual void post_send(ibv_sge sge, enum ibv_wr_opcode opcode,
+			       int flags = IBV_SEND_SIGNALED) {
+		if (capture)
+			capture->put(CAP_TX, (void *)sge.addr, sge.length);
+		EXEC(ibvt_qp::post_send(sge, opcode, flags));
+	}
+
+	/* n signaled sends with a single doorbell */
+	virtual void post_send_batch(struct ibv_sge *sge, int n) {
+		struct ibv_send_wr wr[n];
+		struct ibv_send_wr *bad_wr = NULL;
+
+		if (capture)
+			for (int i = 0; i < n; i++)
+				capture->put(CAP_TX, (void *)sge[i].addr, sge[i].length);
+		memset(wr, 0, sizeof(wr));
+		for (int i = 0; i < n; i++) {
+			wr[i].next = i + 1 < n ? &wr[i + 1] : NULL;
+			wr[i].sg_list = &sge[i];
+			wr[i].num_sge = 1;
+			wr[i]._wr_opcode = IBV_WR_SEND;
+			wr[i]._wr_send_flags = IBV_SEND_SIGNALED;
+		}
+		DO(ibv_post_send(qp, wr, &bad_wr));
+	}
+};
+
+#if HAVE_DECL_IBV_WC_EX_WITH_FLOW_TAG && !defined(HAVE_INFINIBAND_VERBS_EXP_H)
+#define HAVE_CQ_FLOW_TAG 1
+#endif
+
+/*
+ * Base of the raw path CQs: poll_raw() is the backend, poll_tag() adds
+ * the flow tags and hands received frames to the capture.
+ */
+struct ibvt_cq_raw : public ibvt_cq {
+	struct ibvt_capture *capture;
+	/* 0 when poll_raw() leaves the tags at 0 */
+	int tagged;
+
+	ibvt_cq_raw(ibvt_env &e, ibvt_ctx &c) : ibvt_cq(e, c), capture(NULL),
+						 tagged(1) {}
+
+	virtual int poll_raw(struct ibv_wc *wc, uint32_t *tag, int n) = 0;
+
+	int poll_tag(struct ibv_wc *wc, uint32_t *tag, int n) {
+		int ret = poll_raw(wc, tag, n);
+
+		if (capture)
+			for (int i = 0; i < ret; i++)
+				if (!wc[i].status && (wc[i]._wc_opcode & IBV_WC_RECV))
+					capture->put(CAP_RX, (void *)wc[i].wr_id,
+						     wc[i].byte_len);
+		return ret;
+	}
+
+	virtual int poll_wc(struct ibv_wc *wc, int n) {
+		return poll_tag(wc, NULL, n);
+	}
+};
+
+/*
+ * CQ returning the flow tag of each completion next to the WC. A device
+ * without flow tags in its completions gets a plain CQ and tags of 0.
+ */
+struct ibvt_cq_tag : public ibvt_cq_raw {
+#ifdef HAVE_CQ_FLOW_TAG
+	struct ibv_cq_ex *cq_ex;
+
+	ibvt_cq_tag(ibvt_env &e, ibvt_ctx &c) : ibvt_cq_raw(e, c), cq_ex(NULL) {}
+
+	virtual void init() {
+		struct ibv_cq_init_attr_ex attr;
+
+		if (cq)
+			return;
+		EXEC(ctx.init());
+		memset(&attr, 0, sizeof(attr));
+		attr.cqe = 0x1000;
+		attr.wc_flags = IBV_WC_STANDARD_FLAGS | IBV_WC_EX_WITH_FLOW_TAG;
+		cq_ex = ibv_create_cq_ex(ctx.ctx, &attr);
+		if (!cq_ex) {
+			VERBS_INFO("no flow tag CQ, errno %d - plain CQ\n", errno);
+			tagged = 0;
+			EXEC(ibvt_cq::init());
+			return;
+		}
+		cq = ibv_cq_ex_to_cq(cq_ex);
+	}
+
+	virtual int poll_raw(struct ibv_wc *wc, uint32_t *tag, int n) {
+		struct ibv_poll_cq_attr attr;
+		int i = 0, ret;
+
+		if (!cq_ex) {
+			ret = ibvt_cq::poll_wc(wc, n);
+			for (int k = 0; tag && k < ret; k++)
+				tag[k] = 0;
+			return ret;
+		}
+
+		memset(&attr, 0, sizeof(attr));
+		ret = ibv_start_poll(cq_ex, &attr);
+		if (ret)
+			return ret == ENOENT ? 0 : -1;
+
+		do {
+			memset(&wc[i], 0, sizeof(wc[i]));
+			if (tag)
+				tag[i] = 0;
+			wc[i].wr_id = cq_ex->wr_id;
+			wc[i].status = cq_ex->status;
+			wc[i].qp_num = ibv_wc_read_qp_num(cq_ex);
+			wc[i].vendor_err = ibv_wc_read_vendor_err(cq_ex);
+			/* the rest is only valid in a successful completion */
+			if (cq_ex->status != IBV_WC_SUCCESS)
+				continue;
+			wc[i].opcode = ibv_wc_read_opcode(cq_ex);
+			wc[i].byte_len = ibv_wc_read_byte_len(cq_ex);
+			wc[i].wc_flags = ibv_wc_read_wc_flags(cq_ex);
+			if (tag)
+				tag[i] = ibv_wc_read_flow_tag(cq_ex);
+		} while (++i < n && !ibv_next_poll(cq_ex));
+		ibv_end_poll(cq_ex);
+
+		return i;
+	}
+#else
+	ibvt_cq_tag(ibvt_env &e, ibvt_ctx &c) : ibvt_cq_raw(e, c) {
+		tagged = 0;
+	}
+
+	virtual int poll_raw(struct ibv_wc *wc, uint32_t *tag, int n) {
+		int ret = ibvt_cq::poll_wc(wc, n);
+
+		for (int i = 0; tag && i < ret; i++)
+			tag[i] = 0;
+		return ret;
+	}
+#endif
+};
+
+struct ibvt_ctx_pkt : public ibvt_ctx {
+	int ifindex;
+	int tx_ifindex;
+
+	ibvt_ctx_pkt(ibvt_env &e) : ibvt_ctx(e), ifindex(0), tx_ifindex(0) {}
+
+	int lookup(const char *name) {
+		int idx = if_nametoindex(name);
+
+		if (!idx) {
+			VERBS_NOTICE("interface %s not found\n", name);
+			env.skip = 1;
+		}
+		return idx;
+	}
+
+	virtual void init() {
+		const char *dev = getenv("IBV_PKT_DEV") ?: "lo";
+		const char *tx_dev = getenv("IBV_PKT_TX_DEV") ?: dev;
+
+		if (ifindex)
+			return;
+		ifindex = lookup(dev);
+		tx_ifindex = lookup(tx_dev);
+	}
+};
+
+struct ibvt_pd_pkt : public ibvt_pd {
+	ibvt_ctx_pkt &pctx;
+
+	ibvt_pd_pkt(ibvt_env &e, ibvt_ctx_pkt &c) : ibvt_pd(e, c), pctx(c) {}
+
+	virtual void init() {
+		EXEC(ctx.init());
+	}
+};
+
+struct ibvt_mr_pkt : public ibvt_mr {
+	ibvt_mr_pkt(ibvt_env &e, ibvt_pd &p, size_t s) : ibvt_mr(e, p, s) {}
+
+	virtual void init() {
+		if (buff)
+			return;
+		EXEC(pd.init());
+		buff = (char *)mmap(NULL, size, PROT_READ|PROT_WRITE, mmap_flags(), -1, 0);
+		ASSERT_NE(buff, MAP_FAILED);
+		memset(buff, 0, size);
+	}
+
+	virtual struct ibv_sge sge(intptr_t start, size_t length) {
+		struct ibv_sge ret;
+
+		memset(&ret, 0, sizeof(ret));
+		ret.addr = (intptr_t)buff + start;
+		ret.length = length;
+
+		return ret;
+	}
+};
+
+struct ibvt_pkt_cqe {
+	struct ibv_wc wc;
+	uint32_t flow_tag;
+};
+
+struct ibvt_raw_qp_pkt;
+
+struct ibvt_cq_pkt : public ibvt_cq_raw {
+	std::vector<struct ibvt_pkt_cqe> ring;
+	std::list<struct ibvt_raw_qp_pkt *> qps;
+	size_t head;
+	size_t tail;
+
+	ibvt_cq_pkt(ibvt_env &e, ibvt_ctx &c) : ibvt_cq_raw(e, c), head(0), tail(0) {}
+
+	virtual void init() {
+		struct ibv_create_cq_attr_ex attr;
+		int cqe;
+
+		if (ring.size())
+			return;
+		EXEC(ctx.init());
+		init_attr(attr, cqe);
+		ring.resize(cqe);
+	}
+
+	bool full() {
+		return tail - head == ring.size();
+	}
+
+	struct ibvt_pkt_cqe &push() {
+		return ring[tail++ % ring.size()];
+	}
+
+	virtual int poll_raw(struct ibv_wc *wc, uint32_t *tag, int n);
+};
+
+struct ibvt_raw_qp_pkt : public ibvt_raw_qp {
+	ibvt_pd_pkt &ppd;
+	ibvt_cq_pkt &pcq;
+	int fd;
+	int tx_fd;
+	uint8_t *rx_ring;
+	uint8_t *tx_ring;
+	unsigned rx_blk;
+	unsigned rx_left;
+	uint8_t *rx_pkt;
+	unsigned tx_head;
+	std::vector<struct ibv_sge> rq;
+	size_t rq_head;
+	size_t rq_tail;
+	std::list<std::vector<uint8_t> > rules;
+
+	ibvt_raw_qp_pkt(ibvt_env &e, ibvt_pd_pkt &p, ibvt_cq_pkt &c) :
+		ibvt_raw_qp(e, p, c), ppd(p), pcq(c), fd(-1), tx_fd(-1),
+		rx_ring(NULL), tx_ring(NULL), rx_blk(0), rx_left(0),
+		rx_pkt(NULL), tx_head(0), rq(RAW_QP_DEPTH), rq_head(0),
+		rq_tail(0) {}
+
+	virtual ~ibvt_raw_qp_pkt() {
+		pcq.qps.remove(this);
+		if (rx_ring)
+			munmap(rx_ring, PKT_BLOCK_SIZE * PKT_RX_BLOCKS);
+		if (tx_ring)
+			munmap(tx_ring, PKT_BLOCK_SIZE * PKT_TX_BLOCKS);
+		if (fd >= 0)
+			close(fd);
+		if (tx_fd >= 0)
+			close(tx_fd);
+	}
+
+	void open_ring(int &s, uint8_t *&ring, int ring_type, int blocks,
+		       int ifindex) {
+		struct tpacket_req3 req;
+		struct sockaddr_ll addr;
+		int ver = TPACKET_V3;
+		int one = 1;
+
+		s = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+		DO(s < 0);
+		DO(setsockopt(s, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)));
+
+		memset(&req, 0, sizeof(req));
+		req.tp_block_size = PKT_BLOCK_SIZE;
+		req.tp_block_nr = blocks;
+		req.tp_frame_size = PKT_FRAME_SIZE;
+		req.tp_frame_nr = PKT_BLOCK_SIZE / PKT_FRAME_SIZE * blocks;
+		if (ring_type == PACKET_RX_RING)
+			req.tp_retire_blk_tov = 1;
+		DO(setsockopt(s, SOL_PACKET, ring_type, &req, sizeof(req)));
+
+		ring = (uint8_t *)mmap(NULL, PKT_BLOCK_SIZE * blocks,
+				       PROT_READ|PROT_WRITE, MAP_SHARED, s, 0);
+		ASSERT_NE(ring, MAP_FAILED);
+
+		if (ring_type == PACKET_TX_RING)
+			setsockopt(s, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+#ifdef PACKET_IGNORE_OUTGOING
+		else
+			setsockopt(s, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sll_family = AF_PACKET;
+		addr.sll_protocol = ring_type == PACKET_RX_RING ? htons(ETH_P_ALL) : 0;
+		addr.sll_ifindex = ifindex;
+		DO(bind(s, (struct sockaddr *)&addr, sizeof(addr)));
+	}
+
+	virtual void init() {
+		if (fd >= 0)
+			return;
+		EXEC(pd.init());
+		EXEC(cq.init());
+		EXEC(open_ring(fd, rx_ring, PACKET_RX_RING, PKT_RX_BLOCKS,
+			       ppd.pctx.ifindex));
+		EXEC(open_ring(tx_fd, tx_ring, PACKET_TX_RING, PKT_TX_BLOCKS,
+			       ppd.pctx.tx_ifindex));
+		pcq.qps.push_back(this);
+	}
+
+	virtual void connect(ibvt_qp *r) {}
+
+	virtual struct ibv_flow *add_flow(struct ibv_flow_attr *attr) {
+		uint8_t *a = (uint8_t *)attr;
+
+		rules.push_back(std::vector<uint8_t>(a, a + attr->size));
+		return (struct ibv_flow *)&rules.back();
+	}
+
+	virtual int del_flow(struct ibv_flow *f) {
+		for (std::list<std::vector<uint8_t> >::iterator i = rules.begin();
+		     i != rules.end(); i++) {
+			if ((struct ibv_flow *)&*i == f) {
+				rules.erase(i);
+				return 0;
+			}
+		}
+		return EINVAL;
+	}
+
+	virtual void recv(ibv_sge sge) {
+		ASSERT_LT(rq_tail - rq_head, rq.size()) << "RQ overflow";
+		rq[rq_tail++ % rq.size()] = sge;
+	}
+
+	virtual void post_send(ibv_sge sge, enum ibv_wr_opcode opcode,
+			       int flags = IBV_SEND_SIGNALED) {
+		ASSERT_EQ(IBV_WR_SEND, opcode);
+		EXEC(post_send_batch(&sge, 1));
+	}
+
+	struct tpacket3_hdr *tx_frame(unsigned i) {
+		return (struct tpacket3_hdr *)(tx_ring + i * PKT_FRAME_SIZE);
+	}
+
+	virtual void post_send_batch(struct ibv_sge *sge, int n) {
+		unsigned frames = PKT_BLOCK_SIZE / PKT_FRAME_SIZE * PKT_TX_BLOCKS;
+
+		if (capture)
+			for (int i = 0; i < n; i++)
+				capture->put(CAP_TX, (void *)sge[i].addr, sge[i].length);
+
+		for (int i = 0; i < n; i++) {
+			struct tpacket3_hdr *h = tx_frame(tx_head);
+
+			ASSERT_LE(sge[i].length, PKT_FRAME_SIZE - PKT_TX_DATA);
+			if (*(volatile uint32_t *)&h->tp_status != TP_STATUS_AVAILABLE)
+				DO(::send(tx_fd, NULL, 0, 0) < 0);
+			ASSERT_EQ((uint32_t)TP_STATUS_AVAILABLE, *(volatile uint32_t *)&h->tp_status);
+
+			memcpy((uint8_t *)h + PKT_TX_DATA, (void *)sge[i].addr,
+			       sge[i].length);
+			h->tp_len = sge[i].length;
+			h->tp_next_offset = 0;
+			__sync_synchronize();
+			h->tp_status = TP_STATUS_SEND_REQUEST;
+			tx_head = (tx_head + 1) % frames;
+		}
+		DO(::send(tx_fd, NULL, 0, 0) < 0);
+
+		for (int i = 0; i < n; i++) {
+			ASSERT_FALSE(pcq.full()) << "CQ overrun";
+			struct ibvt_pkt_cqe &c = pcq.push();
+
+			memset(&c, 0, sizeof(c));
+			c.wc._wc_opcode = (enum ibv_wc_opcode)IBV_WC_SEND;
+			c.wc.byte_len = sge[i].length;
+		}
+	}
+
+	/* false when the frame can't be taken now and must stay in the ring */
+	bool rx_frame(struct tpacket3_hdr *h) {
+		struct sockaddr_ll *sll = (struct sockaddr_ll *)
+			((uint8_t *)h + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+		uint8_t *data = (uint8_t *)h + h->tp_mac;
+		uint32_t tag = 0;
+		bool hit = false;
+
+		if (sll->sll_pkttype == PACKET_OUTGOING)
+			return true;
+
+		for (std::list<std::vector<uint8_t> >::iterator i = rules.begin();
+		     !hit && i != rules.end(); i++)
+			hit = flow_match((struct ibv_flow_attr *)&(*i)[0], data,
+					 h->tp_snaplen, &tag);
+		if (!hit)
+			return true;
+		if (rq_head == rq_tail || pcq.full())
+			return false;
+
+		struct ibv_sge &sge = rq[rq_head++ % rq.size()];
+		struct ibvt_pkt_cqe &c = pcq.push();
+
+		memcpy((void *)sge.addr, data, std::min(sge.length, h->tp_snaplen));
+		memset(&c, 0, sizeof(c));
+		c.wc.wr_id = sge.addr;
+		c.wc._wc_opcode = (enum ibv_wc_opcode)IBV_WC_RECV;
+		c.wc.byte_len = h->tp_snaplen;
+		c.flow_tag = tag;
+		return true;
+	}
+
+	void progress() {
+		for (;;) {
+			struct tpacket_block_desc *b = (struct tpacket_block_desc *)
+				(rx_ring + rx_blk * PKT_BLOCK_SIZE);
+
+			if (!(*(volatile uint32_t *)&b->hdr.bh1.block_status & TP_STATUS_USER))
+				return;
+			__sync_synchronize();
+
+			if (!rx_pkt) {
+				rx_pkt = (uint8_t *)b + b->hdr.bh1.offset_to_first_pkt;
+				rx_left = rules.empty() ? 0 : b->hdr.bh1.num_pkts;
+			}
+			for (; rx_left; rx_left--) {
+				struct tpacket3_hdr *h = (struct tpacket3_hdr *)rx_pkt;
+
+				if (!rx_frame(h))
+					return;
+				rx_pkt += h->tp_next_offset;
+			}
+
+			__sync_synchronize();
+			b->hdr.bh1.block_status = TP_STATUS_KERNEL;
+			rx_pkt = NULL;
+			rx_blk = (rx_blk + 1) % PKT_RX_BLOCKS;
+		}
+	}
+};
+
+inline int ibvt_cq_pkt::poll_raw(struct ibv_wc *wc, uint32_t *tag, int n) {
+	int i;
+
+	for (std::list<struct ibvt_raw_qp_pkt *>::iterator q = qps.begin();
+	     q != qps.end(); q++)
+		(*q)->progress();
+
+	for (i = 0; i < n && head != tail; i++) {
+		struct ibvt_pkt_cqe &c = ring[head++ % ring.size()];
+
+		wc[i] = c.wc;
+		if (tag)
+			tag[i] = c.flow_tag;
+	}
+
+	return i;
+}
+
+/*
+ * Completion demultiplexer keyed by flow tag.
+ *
+ * Tags are handed out by the test from a dense range [base, base + n), so
+ * the table is a flat array and dispatch is a subtract, a bounds check and
+ * one indexed load; per-flow counters live next to the handler.
+ */
+typedef void (*flow_handler_fn)(void *arg, struct ibv_wc &wc);
+
+struct flow_handler {
+	flow_handler_fn fn;
+	void *arg;
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+struct ibvt_flow_demux {
+	uint32_t base;
+	std::vector<struct flow_handler> table;
+	uint64_t unknown;
+
+	ibvt_flow_demux(uint32_t b, uint32_t n) : base(b), table(n), unknown(0) {}
+
+	struct flow_handler *lookup(uint32_t tag) {
+		uint32_t i = tag - base;
+
+		return i < table.size() ? &table[i] : NULL;
+	}
+
+	/* -EINVAL for a tag outside [base, base + n) */
+	int set(uint32_t tag, flow_handler_fn fn, void *arg) {
+		struct flow_handler *h = lookup(tag);
+
+		if (!h)
+			return -EINVAL;
+		h->fn = fn;
+		h->arg = arg;
+		return 0;
+	}
+
+	void dispatch(struct ibv_wc *wc, uint32_t *tag, int n) {
+		for (int i = 0; i < n; i++) {
+			struct flow_handler *h = lookup(tag[i]);
+
+			if (!h) {
+				unknown++;
+				continue;
+			}
+			h->packets++;
+			h->bytes += wc[i].byte_len;
+			if (h->fn)
+				h->fn(h->arg, wc[i]);
+		}
+	}
+};
+
+static inline void raw_capture(ibvt_raw_qp &qp, ibvt_cq_raw &cq)
+{
+	qp.capture = cq.capture = ibvt_capture_env();
+}
+
+struct raw_hw {
+	typedef ibvt_ctx_eth CTX;
+	typedef ibvt_pd PD;
+	typedef ibvt_cq_tag CQ;
+	typedef ibvt_raw_qp QP;
+	typedef ibvt_mr MR;
+};
+
+struct raw_pkt {
+	typedef ibvt_ctx_pkt CTX;
+	typedef ibvt_pd_pkt PD;
+	typedef ibvt_cq_pkt CQ;
+	typedef ibvt_raw_qp_pkt QP;
+	typedef ibvt_mr_pkt MR;
+};
+
+typedef testing::Types<raw_hw, raw_pkt> raw_backends;
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __IBVT_STATS_H_
+#define __IBVT_STATS_H_
+
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+
+/*
+ * Latency samples for the benchmarks. Samples are kept as is and sorted
+ * on the first percentile query, so add() is a push_back on the measured
+ * path. Times are in usec.
+ */
+
+static inline double lat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+struct ibvt_lat {
+	std::vector<double> v;
+	double total;
+	bool sorted;
+
+	ibvt_lat(size_t n = 0) : total(0), sorted(true) { v.reserve(n); }
+
+	void add(double usec) {
+		v.push_back(usec);
+		total += usec;
+		sorted = false;
+	}
+
+	void clear() {
+		v.clear();
+		total = 0;
+		sorted = true;
+	}
+
+	size_t count() { return v.size(); }
+
+	double avg() { return v.empty() ? 0 : total / v.size(); }
+
+	double pct(double p) {
+		if (v.empty())
+			return 0;
+		if (!sorted) {
+			std::sort(v.begin(), v.end());
+			sorted = true;
+		}
+		return v[std::min(v.size() - 1, (size_t)(p / 100 * v.size()))];
+	}
+
+	void report(const char *what) {
+		VERBS_NOTICE("%s: %zu samples, avg %.2f p50 %.2f p90 %.2f "
+			     "p99 %.2f max %.2f usec\n", what, count(), avg(),
+			     pct(50), pct(90), pct(99), pct(100));
+	}
+};
+
+#endif
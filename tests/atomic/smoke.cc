@@ -0,0 +1,241 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+#include "stats.h"
+
+#define ATOMIC_QPS 16
+#define ATOMIC_DEPTH 16
+#define ATOMIC_OPS 100000
+/* a counter per cache line, so distinct counters do not share one */
+#define ATOMIC_STRIDE 64
+
+static inline long atomic_ops(void)
+{
+	return getenv("IBV_ATOMIC_OPS") ? atol(getenv("IBV_ATOMIC_OPS")) :
+		ATOMIC_OPS;
+}
+
+struct atomic_test : public testing::Test, public ibvt_env {
+	ibvt_ctx ctx;
+	ibvt_pd pd;
+	ibvt_cq cq;
+	ibvt_qp_rc *qp[ATOMIC_QPS];
+	ibvt_qp_rc *peer[ATOMIC_QPS];
+	ibvt_mr_atomic res;
+	ibvt_mr_atomic ctr;
+	int depth;
+
+	atomic_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		cq(*this, ctx),
+		res(*this, pd, ATOMIC_QPS * ATOMIC_DEPTH),
+		ctr(*this, pd, ATOMIC_QPS, ATOMIC_STRIDE),
+		depth(1)
+	{
+		for (int i = 0; i < ATOMIC_QPS; i++) {
+			qp[i] = new ibvt_qp_rc(*this, pd, cq);
+			peer[i] = new ibvt_qp_rc(*this, pd, cq);
+		}
+	}
+
+	virtual ~atomic_test() {
+		for (int i = 0; i < ATOMIC_QPS; i++) {
+			delete qp[i];
+			delete peer[i];
+		}
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		depth = std::min(ATOMIC_DEPTH,
+				 std::min(ctx.dev_attr_orig->max_qp_rd_atom,
+					  ctx.dev_attr_orig->max_qp_init_rd_atom));
+		depth = std::max(depth, 1);
+		for (int i = 0; i < ATOMIC_QPS; i++) {
+			qp[i]->rd_atomic = depth;
+			peer[i]->rd_atomic = depth;
+			INIT(qp[i]->init());
+			INIT(peer[i]->init());
+		}
+		for (int i = 0; i < ATOMIC_QPS; i++) {
+			INIT(qp[i]->connect(peer[i]));
+			INIT(peer[i]->connect(qp[i]));
+		}
+		INIT(res.init());
+		INIT(ctr.init());
+	}
+
+	virtual void TearDown() {
+		ASSERT_FALSE(HasFailure());
+	}
+
+	/*
+	 * ops atomics from the first nqps QPs, up to depth in flight on
+	 * each, all on counter 0 when shared or on a counter per QP. A
+	 * compare and swap expects the last value its QP saw and moves it
+	 * one up, as a sequencer or a lock would, and may lose the race.
+	 */
+	void bench(const char *what, int nqps, bool shared, bool cas) {
+		long ops = atomic_ops();
+		std::vector<long> posted(nqps), completed(nqps);
+		std::vector<uint64_t> expect(nqps), cmp(nqps * depth);
+		std::vector<double> start(nqps * depth);
+		struct ibv_wc wc[ATOMIC_DEPTH];
+		long issued = 0, done = 0, won = 0;
+		long retries = POLL_RETRIES;
+		uint64_t sum = 0;
+		ibvt_lat lat(ops);
+		double t;
+
+		for (int q = 0; q < ATOMIC_QPS; q++)
+			ctr.word(q) = 0;
+
+		t = lat_now();
+		while (done < ops) {
+			for (int q = 0; q < nqps; q++) {
+				while (posted[q] - completed[q] < depth &&
+				       issued < ops) {
+					int s = q * depth + posted[q] % depth;
+					struct ibv_sge dst = ctr.sge(shared ? 0 : q);
+
+					start[s] = lat_now();
+					cmp[s] = expect[q];
+					if (cas)
+						EXEC(qp[q]->cmp_swp(res.sge(s), dst,
+							cmp[s], cmp[s] + 1, q));
+					else
+						EXEC(qp[q]->fetch_add(res.sge(s), dst,
+							1, q));
+					posted[q]++;
+					issued++;
+				}
+			}
+
+			int n = cq.poll_wc(wc, ATOMIC_DEPTH);
+			ASSERT_GE(n, 0);
+			if (!n) {
+				ASSERT_GT(--retries, 0);
+				continue;
+			}
+			retries = POLL_RETRIES;
+			for (int i = 0; i < n; i++) {
+				int q = wc[i].wr_id;
+				int s = q * depth + completed[q] % depth;
+				uint64_t old = res.word(s);
+
+				ASSERT_FALSE(wc[i].status) <<
+					ibv_wc_status_str(wc[i].status);
+				lat.add(lat_now() - start[s]);
+				if (cas && old == cmp[s]) {
+					won++;
+					expect[q] = old + 1;
+				} else {
+					expect[q] = old;
+				}
+				completed[q]++;
+				done++;
+			}
+		}
+		t = lat_now() - t;
+
+		for (int q = 0; q < nqps; q++) {
+			sum += ctr.word(q);
+			if (!shared && !cas) {
+				ASSERT_EQ((uint64_t)completed[q], ctr.word(q));
+			}
+		}
+		ASSERT_EQ((uint64_t)(cas ? won : ops), sum);
+
+		VERBS_NOTICE("%s %s: %d QPs, depth %d, %.0f atomics/s\n",
+			     what, cas ? "cmp_swp" : "fetch_add", nqps, depth,
+			     ops / t * 1e6);
+		if (cas)
+			VERBS_NOTICE("  %ld of %ld swaps won\n", won, ops);
+		lat.report("  latency");
+	}
+};
+
+TEST_F(atomic_test, t0_fetch_add) {
+	CHK_SUT(atomic);
+	for (int i = 0; i < 3; i++) {
+		EXEC(qp[0]->fetch_add(res.sge(i), ctr.sge(0), i + 1));
+		EXEC(cq.poll(1));
+	}
+	ASSERT_EQ(0U, res.word(0));
+	ASSERT_EQ(1U, res.word(1));
+	ASSERT_EQ(3U, res.word(2));
+	ASSERT_EQ(6U, ctr.word(0));
+	ASSERT_EQ(0U, ctr.word(1));
+}
+
+TEST_F(atomic_test, t1_cmp_swp) {
+	CHK_SUT(atomic);
+	ctr.word(1) = 5;
+	EXEC(qp[0]->cmp_swp(res.sge(0), ctr.sge(1), 5, 7));
+	EXEC(cq.poll(1));
+	ASSERT_EQ(5U, res.word(0));
+	ASSERT_EQ(7U, ctr.word(1));
+
+	/* a stale compare leaves the word alone and returns it */
+	EXEC(qp[0]->cmp_swp(res.sge(0), ctr.sge(1), 5, 9));
+	EXEC(cq.poll(1));
+	ASSERT_EQ(7U, res.word(0));
+	ASSERT_EQ(7U, ctr.word(1));
+}
+
+TEST_F(atomic_test, b0_single) {
+	CHK_SUT(atomic);
+	EXEC(bench("single", 1, true, false));
+	EXEC(bench("single", 1, true, true));
+}
+
+TEST_F(atomic_test, b1_contended) {
+	CHK_SUT(atomic);
+	EXEC(bench("contended", ATOMIC_QPS, true, false));
+	EXEC(bench("contended", ATOMIC_QPS, true, true));
+}
+
+TEST_F(atomic_test, b2_distinct) {
+	CHK_SUT(atomic);
+	EXEC(bench("distinct", ATOMIC_QPS, false, false));
+	EXEC(bench("distinct", ATOMIC_QPS, false, true));
+}
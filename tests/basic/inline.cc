@@ -0,0 +1,166 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+#include "stats.h"
+
+#define INLINE_SZ 0x1000
+#define INLINE_PINGS 10000
+
+static size_t mr_hdr(ibvt_mr &) { return 0; }
+static size_t mr_hdr(ibvt_mr_hdr &m) { return m.hdr_size; }
+
+template <typename T1, typename T2>
+struct inline_types {
+	typedef T1 QP;
+	typedef T2 MR;
+};
+
+template <typename T>
+struct inline_test : public testing::Test, public ibvt_env {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct ibvt_cq cq;
+	struct ibvt_qp_inline<typename T::QP> qa;
+	struct ibvt_qp_inline<typename T::QP> qb;
+	struct T::MR src;
+	struct T::MR dst;
+	size_t hdr;
+
+	inline_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		cq(*this, ctx),
+		qa(*this, pd, cq),
+		qb(*this, pd, cq),
+		src(*this, pd, INLINE_SZ),
+		dst(*this, pd, INLINE_SZ),
+		hdr(mr_hdr(src))
+	{ }
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		INIT(qa.init());
+		INIT(qb.init());
+		INIT(qa.connect(&qb));
+		INIT(qb.connect(&qa));
+		INIT(src.fill());
+		INIT(dst.init());
+	}
+
+	virtual void TearDown() {
+		ASSERT_FALSE(HasFailure());
+	}
+
+	/* a len byte message from q to its peer, both completions reaped */
+	void msg(ibvt_qp_inline<typename T::QP> &q, ibvt_qp &peer, size_t len) {
+		EXECL(peer.recv(dst.sge(0, len + hdr)));
+		EXECL(q.send(src.sge(0, len + hdr)));
+		EXEC(cq.poll(1));
+		EXEC(cq.poll(1));
+	}
+
+	void pingpong(size_t len, bool use_inline, ibvt_lat &lat) {
+		double t;
+
+		qa.use_inline = qb.use_inline = use_inline;
+		for (int i = 0; i < INLINE_PINGS; i++) {
+			t = lat_now();
+			EXEC(msg(qa, qb, len));
+			EXEC(msg(qb, qa, len));
+			lat.add((lat_now() - t) / 2);
+		}
+	}
+};
+
+typedef testing::Types<
+	inline_types<ibvt_qp_rc, ibvt_mr>,
+	inline_types<ibvt_qp_ud, ibvt_mr_ud>
+> inline_test_list;
+
+TYPED_TEST_CASE(inline_test, inline_test_list);
+
+TYPED_TEST(inline_test, t0_no_lkey) {
+	struct ibv_sge sge;
+	char expect[64];
+	char *p;
+
+	CHK_SUT(inline);
+	ASSERT_GE(this->qa.max_inline, 64U);
+
+	/* inline data is taken at post time, with no lkey */
+	sge = this->src.sge(0, 64 + this->hdr);
+	sge.lkey = 0;
+	p = this->src.buff + this->hdr;
+	memcpy(expect, p, 64);
+	EXEC(qb.recv(this->dst.sge(0, 64 + this->hdr)));
+	EXEC(qa.send(sge));
+	memset(p, 0, 64);
+	EXEC(cq.poll(1));
+	EXEC(cq.poll(1));
+	ASSERT_EQ(0, memcmp(expect, this->dst.buff + this->hdr, 64));
+}
+
+/*
+ * Half round trips either side of the inline cap, inline where it fits
+ * and through a DMA read of the registered buffer. What inline saves per
+ * message is the payload read and the lkey lookup behind it.
+ */
+TYPED_TEST(inline_test, b0_sweep) {
+	size_t cap;
+
+	CHK_SUT(inline);
+	cap = this->qa.max_inline;
+	VERBS_NOTICE("max_inline_data %zu, asked for %u\n", cap, ibvt_inline());
+	for (size_t len = 8; len <= 2 * cap &&
+	     len + this->hdr <= INLINE_SZ; len *= 2) {
+		ibvt_lat dma(INLINE_PINGS), inl(INLINE_PINGS);
+
+		EXEC(pingpong(len, false, dma));
+		if (len <= cap)
+			EXEC(pingpong(len, true, inl));
+		if (len <= cap)
+			VERBS_NOTICE("%5zu bytes: dma p50 %.2f p99 %.2f, inline "
+				     "p50 %.2f p99 %.2f usec, %.2f usec saved\n",
+				     len, dma.pct(50), dma.pct(99), inl.pct(50),
+				     inl.pct(99), dma.pct(50) - inl.pct(50));
+		else
+			VERBS_NOTICE("%5zu bytes: dma p50 %.2f p99 %.2f usec, "
+				     "above the cap\n", len, dma.pct(50),
+				     dma.pct(99));
+	}
+}
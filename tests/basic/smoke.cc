@@ -105,7 +105,9 @@ typedef testing::Types<
 	types_3<ibvt_qp_rc, ibvt_mr, ibvt_cq>,
 	types_3<ibvt_qp_ud, ibvt_mr_ud, ibvt_cq>,
 	types_3<ibvt_qp_rc, ibvt_mr, ibvt_cq_event>,
-	types_3<ibvt_qp_ud, ibvt_mr_ud, ibvt_cq_event>
+	types_3<ibvt_qp_ud, ibvt_mr_ud, ibvt_cq_event>,
+	types_3<ibvt_qp_inline<ibvt_qp_rc>, ibvt_mr, ibvt_cq>,
+	types_3<ibvt_qp_inline<ibvt_qp_ud>, ibvt_mr_ud, ibvt_cq>
 > base_test_env_list;
 
 TYPED_TEST_CASE(base_test, base_test_env_list);
@@ -137,7 +139,8 @@ struct rdma_test : public base_test<T> {};
 
 typedef testing::Types<
 	types_3<ibvt_qp_rc, ibvt_mr, ibvt_cq>,
-	types_3<ibvt_qp_rc, ibvt_mr, ibvt_cq_event>
+	types_3<ibvt_qp_rc, ibvt_mr, ibvt_cq_event>,
+	types_3<ibvt_qp_inline<ibvt_qp_rc>, ibvt_mr, ibvt_cq>
 > rdma_test_env_list;
 
 TYPED_TEST_CASE(rdma_test, rdma_test_env_list);
@@ -37,6 +37,7 @@ class tc_verbs_create_cq : public cc_init_verbs_test {};
 class tc_verbs_post_send_en : public cc_init_verbs_test {};
 class tc_verbs_post_recv_en : public cc_init_verbs_test {};
 class tc_verbs_post_send_wait : public cc_init_verbs_test {};
+class tc_verbs_sched : public cc_init_verbs_test {};
 #else
 class cc_dummy_class : public testing::Test {
 protected:
@@ -50,6 +51,7 @@ class tc_verbs_create_cq : public cc_dummy_class {};
 class tc_verbs_post_send_en : public cc_dummy_class {};
 class tc_verbs_post_recv_en : public cc_dummy_class {};
 class tc_verbs_post_send_wait : public cc_dummy_class {};
+class tc_verbs_sched : public cc_dummy_class {};
 #endif
 
 #ifdef HAVE_CROSS_CHANNEL_CALC
@@ -0,0 +1,368 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _IBVERBS_CC_SCHED_
+#define _IBVERBS_CC_SCHED_
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+/*
+ * Cross-channel schedule builder.
+ *
+ * A schedule is a list of steps per QP in posting order: sends, WQE
+ * enables of a managed QP and waits for a CQ to reach a count. check()
+ * runs the schedule against a model of the QPs and CQs and rejects the
+ * ones that can not finish, enable WQEs that are not there or leave CQEs
+ * a wait of the next run would count. compile()
+ * lays the WR chains out once, in one arena, with the real QPs and CQs
+ * bound and WAIT_EN_LAST set where it belongs, so post() is a handful of
+ * post calls on memory nobody touches between runs.
+ *
+ * QPs and CQs are indices into the tables given to compile().
+ */
+
+enum cc_step_type {
+	CC_SEND,
+	CC_ENABLE,
+	CC_WAIT,
+};
+
+struct cc_step {
+	enum cc_step_type type;
+	int target;		/* QP to enable or CQ to wait on */
+	int count;		/* WQEs to enable, 0 for all, or CQEs to wait for */
+	bool signaled;
+};
+
+struct cc_qp {
+	bool cross_channel;	/* may post enables and waits */
+	bool managed;		/* its sends run once enabled */
+	int scq;
+	int rcq;
+	int peer;		/* the QP its sends land on */
+	int recvs;		/* receives posted with the schedule */
+	bool own_sge;
+	struct ibv_sge ssge;	/* what its sends carry */
+	struct ibv_sge rsge;	/* where its receives land */
+	std::vector<struct cc_step> steps;
+};
+
+struct cc_sched {
+	std::vector<struct cc_qp> qps;
+	int num_cqs;
+	char err[128];
+
+	struct ibv_send_wr *arena;
+	struct ibv_recv_wr *rarena;
+	std::vector<int> first;
+	std::vector<int> rfirst;
+	struct ibv_qp **qp_tbl;
+
+	cc_sched() : num_cqs(0), arena(NULL), rarena(NULL), qp_tbl(NULL) {
+		err[0] = 0;
+	}
+
+	~cc_sched() {
+		delete[] arena;
+		delete[] rarena;
+	}
+
+	int cq() { return num_cqs++; }
+
+	int qp(int scq, int rcq, bool cross_channel = false,
+	       bool managed = false) {
+		struct cc_qp q = cc_qp();
+
+		q.cross_channel = cross_channel;
+		q.managed = managed;
+		q.scq = scq;
+		q.rcq = rcq;
+		q.peer = qps.size();
+		q.recvs = 0;
+		q.own_sge = false;
+		qps.push_back(q);
+		return qps.size() - 1;
+	}
+
+	void connect(int q, int peer) { qps[q].peer = peer; }
+
+	void recv(int q, int n) { qps[q].recvs += n; }
+
+	/* buffers of q instead of the ones given to compile() */
+	void buf(int q, struct ibv_sge send_sge, struct ibv_sge recv_sge) {
+		qps[q].own_sge = true;
+		qps[q].ssge = send_sge;
+		qps[q].rsge = recv_sge;
+	}
+
+	void step(int q, enum cc_step_type type, int target, int count,
+		  bool signaled) {
+		struct cc_step s = { type, target, count, signaled };
+
+		qps[q].steps.push_back(s);
+	}
+
+	void send(int q, int n = 1, bool signaled = true) {
+		for (int i = 0; i < n; i++)
+			step(q, CC_SEND, -1, 1, signaled);
+	}
+
+	void enable(int q, int target, int n = 0, bool signaled = false) {
+		step(q, CC_ENABLE, target, n, signaled);
+	}
+
+	void wait(int q, int cq, int n, bool signaled = false) {
+		step(q, CC_WAIT, cq, n, signaled);
+	}
+
+	int fail(int ret, const char *fmt, int a, int b, int c = 0, int d = 0) {
+		snprintf(err, sizeof(err), fmt, a, b, c, d);
+		return ret;
+	}
+
+	/*
+	 * Runs the schedule once: every QP executes what is enabled and not
+	 * waiting until nothing moves. Returns 0 when all steps ran, -EINVAL
+	 * for steps no QP could run and -EDEADLK for a schedule that stops
+	 * half way, err says where.
+	 */
+	int check() {
+		size_t n = qps.size();
+		std::vector<size_t> pc(n, 0);
+		std::vector<long> enabled(n, 0), recvs(n, 0);
+		std::vector<long> produced(num_cqs, 0), waited(num_cqs, 0);
+		bool moved = true;
+
+		for (size_t q = 0; q < n; q++) {
+			struct cc_qp &p = qps[q];
+
+			if (p.scq < 0 || p.scq >= num_cqs ||
+			    p.rcq < 0 || p.rcq >= num_cqs ||
+			    p.peer < 0 || p.peer >= (int)n)
+				return fail(-EINVAL, "qp %d: bad cq or peer", q, 0);
+			enabled[q] = p.managed ? 0 : p.steps.size();
+			recvs[q] = p.recvs;
+			for (size_t i = 0; i < p.steps.size(); i++) {
+				struct cc_step &s = p.steps[i];
+
+				if (s.type == CC_SEND)
+					continue;
+				if (!p.cross_channel)
+					return fail(-EINVAL, "qp %d step %d: enable or wait "
+						    "on a QP without cross-channel", q, i);
+				if (s.type == CC_WAIT && (s.target < 0 || s.target >= num_cqs || s.count <= 0))
+					return fail(-EINVAL, "qp %d step %d: bad wait", q, i);
+				if (s.type == CC_ENABLE && (s.target < 0 || s.target >= (int)n ||
+							    !qps[s.target].managed || s.count < 0))
+					return fail(-EINVAL, "qp %d step %d: enable of an "
+						    "unmanaged QP", q, i);
+			}
+		}
+
+		while (moved) {
+			moved = false;
+			for (size_t q = 0; q < n; q++) {
+				struct cc_qp &p = qps[q];
+
+				while (pc[q] < p.steps.size() && (long)pc[q] < enabled[q]) {
+					struct cc_step &s = p.steps[pc[q]];
+
+					if (s.type == CC_WAIT &&
+					    produced[s.target] < waited[s.target] + s.count)
+						break;
+					if (s.type == CC_SEND && !recvs[p.peer])
+						break;
+
+					if (s.type == CC_WAIT) {
+						waited[s.target] += s.count;
+					} else if (s.type == CC_SEND) {
+						recvs[p.peer]--;
+						produced[qps[p.peer].rcq]++;
+					} else {
+						long left = qps[s.target].steps.size() - enabled[s.target];
+
+						if (s.count > left)
+							return fail(-EINVAL, "qp %d step %d: enables %d "
+								    "WQEs, %d left", q, pc[q],
+								    s.count, left);
+						enabled[s.target] += s.count ? s.count : left;
+					}
+					if (s.signaled)
+						produced[p.scq]++;
+					pc[q]++;
+					moved = true;
+				}
+			}
+		}
+
+		for (size_t q = 0; q < n; q++) {
+			struct cc_qp &p = qps[q];
+			struct cc_step *s;
+
+			if (pc[q] == p.steps.size())
+				continue;
+			s = &p.steps[pc[q]];
+			if ((long)pc[q] >= enabled[q])
+				return fail(-EDEADLK, "qp %d step %d: never enabled", q, pc[q]);
+			if (s->type == CC_SEND)
+				return fail(-EDEADLK, "qp %d step %d: no receive on qp %d",
+					    q, pc[q], p.peer);
+			return fail(-EDEADLK, "qp %d step %d: waits for cqe %d of cq %d",
+				    q, pc[q], waited[s->target] + s->count, s->target);
+		}
+
+		/* waits count from where the last run left the CQ */
+		for (int c = 0; c < num_cqs; c++)
+			if (waited[c] && waited[c] != produced[c])
+				return fail(-EINVAL, "cq %d: %d cqes per run, waits "
+					    "account for %d", c, produced[c], waited[c]);
+		return 0;
+	}
+
+	/*
+	 * Lays the checked schedule out for the given QPs and CQs. sge is
+	 * what sends carry and receives take unless buf() said otherwise,
+	 * wr_id of a WR is its step. Without offload the enables and waits
+	 * are left blank for a software engine to run.
+	 */
+	int compile(struct ibv_qp **qp_table, struct ibv_cq **cq_table,
+		    struct ibv_sge sge, bool offload = true) {
+		int ret = check();
+		int sends = 0, recvs = 0;
+
+		if (ret)
+			return ret;
+
+		delete[] arena;
+		delete[] rarena;
+		first.clear();
+		rfirst.clear();
+		for (size_t q = 0; q < qps.size(); q++) {
+			first.push_back(sends);
+			rfirst.push_back(recvs);
+			sends += qps[q].steps.size();
+			recvs += qps[q].recvs;
+		}
+		first.push_back(sends);
+		rfirst.push_back(recvs);
+		arena = new struct ibv_send_wr[sends ? sends : 1];
+		rarena = new struct ibv_recv_wr[recvs ? recvs : 1];
+		memset(arena, 0, sizeof(*arena) * (sends ? sends : 1));
+		memset(rarena, 0, sizeof(*rarena) * (recvs ? recvs : 1));
+		qp_tbl = qp_table;
+
+		for (size_t q = 0; q < qps.size(); q++) {
+			struct cc_qp &p = qps[q];
+
+			if (!p.own_sge)
+				p.ssge = p.rsge = sge;
+		}
+
+		for (size_t q = 0; q < qps.size(); q++) {
+			struct cc_qp &p = qps[q];
+#ifdef HAVE_CROSS_CHANNEL
+			int last = -1;
+#endif
+
+			for (int i = 0; i < p.recvs; i++) {
+				struct ibv_recv_wr &wr = rarena[rfirst[q] + i];
+
+				wr.wr_id = i;
+				wr.sg_list = &p.rsge;
+				wr.num_sge = 1;
+				wr.next = i + 1 < p.recvs ? &wr + 1 : NULL;
+			}
+
+			for (size_t i = 0; i < p.steps.size(); i++) {
+				struct cc_step &s = p.steps[i];
+				struct ibv_send_wr &wr = arena[first[q] + i];
+
+				wr.wr_id = i;
+				wr.next = i + 1 < p.steps.size() ? &wr + 1 : NULL;
+				wr.send_flags = s.signaled ? IBV_SEND_SIGNALED : 0;
+				if (s.type == CC_SEND) {
+					wr.opcode = IBV_WR_SEND;
+					wr.sg_list = &p.ssge;
+					wr.num_sge = 1;
+					continue;
+				}
+				if (!offload)
+					continue;
+#ifdef HAVE_CROSS_CHANNEL
+				if (s.type == CC_WAIT) {
+					wr.opcode = IBV_WR_CQE_WAIT;
+					wr.wr.cqe_wait.cq = cq_table[s.target];
+					wr.wr.cqe_wait.cq_count = s.count;
+				} else {
+					wr.opcode = IBV_WR_SEND_ENABLE;
+					wr.wr.wqe_enable.qp = qp_table[s.target];
+					wr.wr.wqe_enable.wqe_count = s.count;
+				}
+				last = i;
+#else
+				return fail(-EOPNOTSUPP, "qp %d step %d: no cross-channel "
+					    "support", q, i);
+#endif
+			}
+#ifdef HAVE_CROSS_CHANNEL
+			if (offload && last >= 0)
+				arena[first[q] + last].send_flags |= IBV_SEND_WAIT_EN_LAST;
+#endif
+		}
+		return 0;
+	}
+
+	/*
+	 * Posts the compiled schedule, the receives first unless they are
+	 * already there and managed QPs before the QPs enabling them.
+	 */
+	int post(bool recvs = true) {
+		struct ibv_send_wr *bad;
+		struct ibv_recv_wr *rbad;
+		int ret;
+
+		for (size_t q = 0; recvs && q < qps.size(); q++)
+			if (rfirst[q + 1] > rfirst[q] &&
+			    (ret = ibv_post_recv(qp_tbl[q], rarena + rfirst[q], &rbad)))
+				return ret;
+		for (int pass = 0; pass < 2; pass++)
+			for (size_t q = 0; q < qps.size(); q++)
+				if (qps[q].managed == !pass &&
+				    first[q + 1] > first[q] &&
+				    (ret = ibv_post_send(qp_tbl[q], arena + first[q], &bad)))
+					return ret;
+		return 0;
+	}
+};
+
+#endif //_IBVERBS_CC_SCHED_
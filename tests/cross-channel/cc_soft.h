@@ -0,0 +1,167 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _IBVERBS_CC_SOFT_
+#define _IBVERBS_CC_SOFT_
+
+#include <algorithm>
+
+#include "cc_sched.h"
+
+/*
+ * Runs a cc_sched schedule over ordinary QPs and CQs. The engine owns
+ * the CQs and counts their completions: a managed QP gets its send
+ * posted once an enable covers it, a wait passes when its CQ reached the
+ * count and a signaled enable or wait adds a completion to its QP's send
+ * CQ, as the WQE would. A manager chain is taken whole, so its last step
+ * is the WAIT_EN_LAST one. Managers need no QP and CQs nobody posts to
+ * need no CQ, NULL entries in the tables. A run ends with the CQs
+ * drained, so nothing is left for whoever polls them next.
+ */
+struct cc_soft {
+	struct cc_sched &s;
+	struct ibv_qp **qps;
+	struct ibv_cq **cqs;
+	std::vector<size_t> pc;
+	std::vector<long> enabled;
+	std::vector<long> produced;
+	std::vector<long> waited;
+	/* completions each CQ gets in a run */
+	std::vector<long> expect;
+	long left;
+
+	cc_soft(struct cc_sched &sched, struct ibv_qp **q, struct ibv_cq **c) :
+		s(sched), qps(q), cqs(c), left(0) {}
+
+	virtual ~cc_soft() {}
+
+	/* step i of QP q is done, hook for the work between steps */
+	virtual void done(int q, size_t i) {}
+
+	/* posts the receives and arms the counters of one run */
+	int start() {
+		struct ibv_recv_wr *bad;
+		size_t n = s.qps.size();
+		int ret;
+
+		pc.assign(n, 0);
+		enabled.assign(n, 0);
+		produced.assign(s.num_cqs, 0);
+		waited.assign(s.num_cqs, 0);
+		expect.assign(s.num_cqs, 0);
+		left = 0;
+		for (size_t q = 0; q < n; q++) {
+			if (!s.qps[q].managed)
+				enabled[q] = s.qps[q].steps.size();
+			left += s.qps[q].steps.size();
+			for (size_t i = 0; i < s.qps[q].steps.size(); i++)
+				expect[s.qps[q].scq] += s.qps[q].steps[i].signaled;
+			expect[s.qps[q].rcq] += s.rfirst[q + 1] - s.rfirst[q];
+			if (s.rfirst[q + 1] > s.rfirst[q] &&
+			    (ret = ibv_post_recv(qps[q], s.rarena + s.rfirst[q], &bad)))
+				return -ret;
+		}
+		return 0;
+	}
+
+	/* one pass over the CQs and QPs, returns the steps left or -errno */
+	long progress() {
+		struct ibv_wc wc[16];
+
+		for (int c = 0; c < s.num_cqs; c++) {
+			int r;
+
+			if (!cqs[c])
+				continue;
+			r = ibv_poll_cq(cqs[c], 16, wc);
+			if (r < 0)
+				return -EIO;
+			for (int i = 0; i < r; i++)
+				if (wc[i].status)
+					return -EIO;
+			produced[c] += r;
+		}
+
+		for (size_t q = 0; q < s.qps.size(); q++) {
+			struct cc_qp &p = s.qps[q];
+
+			while (pc[q] < p.steps.size() && (long)pc[q] < enabled[q]) {
+				struct cc_step &st = p.steps[pc[q]];
+
+				if (st.type == CC_WAIT) {
+					if (produced[st.target] < waited[st.target] + st.count)
+						break;
+					waited[st.target] += st.count;
+				} else if (st.type == CC_ENABLE) {
+					long all = s.qps[st.target].steps.size();
+
+					enabled[st.target] = st.count ?
+						std::min(all, enabled[st.target] + st.count) : all;
+				} else {
+					struct ibv_send_wr wr = s.arena[s.first[q] + pc[q]];
+					struct ibv_send_wr *bad;
+					int ret;
+
+					wr.next = NULL;
+					ret = ibv_post_send(qps[q], &wr, &bad);
+					if (ret)
+						return -ret;
+				}
+				if (st.signaled && st.type != CC_SEND)
+					produced[p.scq]++;
+				done(q, pc[q]);
+				pc[q]++;
+				left--;
+			}
+		}
+		return left;
+	}
+
+	/* all steps ran and every CQ gave the completions of the run */
+	bool finished() {
+		if (left)
+			return false;
+		for (int c = 0; c < s.num_cqs; c++)
+			if (cqs[c] && produced[c] < expect[c])
+				return false;
+		return true;
+	}
+
+	int run(long retries = 100000000L) {
+		long ret = start();
+
+		while (!ret && !finished() && --retries)
+			if ((ret = progress()) > 0)
+				ret = 0;
+		if (ret < 0)
+			return ret;
+		return finished() ? 0 : -ETIMEDOUT;
+	}
+};
+
+#endif //_IBVERBS_CC_SOFT_
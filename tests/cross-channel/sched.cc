@@ -0,0 +1,211 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cc_classes.h"
+#include "cc_sched.h"
+#include "stats.h"
+
+#define SEND_POST_COUNT		10
+#define SCHED_REPLAY		10000
+
+/* the two stage send of post_task TI.1, laid out to be replayed */
+static void sched_two_stage(struct cc_sched &s, int &qp, int &mqp,
+			    int &scq, int &rcq, int &mcq)
+{
+	scq = s.cq();
+	rcq = s.cq();
+	mcq = s.cq();
+	qp = s.qp(scq, rcq, true, true);
+	mqp = s.qp(mcq, mcq, true);
+
+	s.recv(qp, SEND_POST_COUNT);
+	s.send(qp, SEND_POST_COUNT);
+	s.enable(mqp, qp, SEND_POST_COUNT / 2);
+	s.wait(mqp, rcq, SEND_POST_COUNT / 2);
+	s.enable(mqp, qp);
+	s.wait(mqp, rcq, SEND_POST_COUNT - SEND_POST_COUNT / 2, true);
+}
+
+TEST(cc_sched, t0_check) {
+	int qp, mqp, scq, rcq, mcq;
+
+	{
+		struct cc_sched s;
+
+		sched_two_stage(s, qp, mqp, scq, rcq, mcq);
+		EXPECT_EQ(0, s.check()) << s.err;
+	}
+	{
+		/* post_task TI.1 waits for 1 of the 3 mcq CQEs it makes */
+		struct cc_sched s;
+
+		scq = s.cq();
+		rcq = s.cq();
+		mcq = s.cq();
+		qp = s.qp(scq, rcq, true, true);
+		mqp = s.qp(mcq, mcq, true);
+		s.recv(qp, SEND_POST_COUNT);
+		s.send(qp, SEND_POST_COUNT);
+		s.enable(mqp, qp, 1, true);
+		s.wait(mqp, mcq, 1, true);
+		s.enable(mqp, qp);
+		s.wait(mqp, rcq, SEND_POST_COUNT, true);
+		EXPECT_EQ(-EINVAL, s.check()) << s.err;
+		VERBS_INFO("%s\n", s.err);
+	}
+	{
+		struct cc_sched s;
+
+		sched_two_stage(s, qp, mqp, scq, rcq, mcq);
+		s.wait(mqp, rcq, 1);
+		EXPECT_EQ(-EDEADLK, s.check()) << s.err;
+		VERBS_INFO("%s\n", s.err);
+	}
+	{
+		struct cc_sched s;
+
+		/* a send no wait accounts for shifts the next run */
+		sched_two_stage(s, qp, mqp, scq, rcq, mcq);
+		s.send(qp);
+		s.recv(qp, 1);
+		EXPECT_EQ(-EINVAL, s.check()) << s.err;
+		VERBS_INFO("%s\n", s.err);
+	}
+	{
+		struct cc_sched s;
+
+		scq = s.cq();
+		rcq = s.cq();
+		qp = s.qp(scq, rcq, true, true);
+		mqp = s.qp(scq, scq, true);
+		s.recv(qp, 1);
+		s.send(qp);
+		s.wait(mqp, rcq, 1);
+		EXPECT_EQ(-EDEADLK, s.check()) << s.err;
+		VERBS_INFO("%s\n", s.err);
+	}
+	{
+		struct cc_sched s;
+
+		scq = s.cq();
+		rcq = s.cq();
+		qp = s.qp(scq, rcq, true, true);
+		mqp = s.qp(scq, rcq, true);
+		s.recv(qp, 2);
+		s.send(qp, 2);
+		s.enable(mqp, qp, 3);
+		EXPECT_EQ(-EINVAL, s.check()) << s.err;
+		VERBS_INFO("%s\n", s.err);
+	}
+	{
+		struct cc_sched s;
+
+		scq = s.cq();
+		rcq = s.cq();
+		qp = s.qp(scq, rcq);
+		s.recv(qp, 1);
+		s.send(qp);
+		s.wait(qp, rcq, 1);
+		EXPECT_EQ(-EINVAL, s.check()) << s.err;
+		VERBS_INFO("%s\n", s.err);
+	}
+	{
+		/* more sends than receives on the peer */
+		struct cc_sched s;
+
+		scq = s.cq();
+		rcq = s.cq();
+		qp = s.qp(scq, rcq, true, true);
+		mqp = s.qp(scq, scq, true);
+		s.recv(qp, 1);
+		s.send(qp, 2);
+		s.enable(mqp, qp);
+		s.wait(mqp, rcq, 2);
+		EXPECT_EQ(-EDEADLK, s.check()) << s.err;
+		VERBS_INFO("%s\n", s.err);
+	}
+}
+
+/* building and checking a schedule is paid once, not per run */
+TEST(cc_sched, t1_build) {
+	ibvt_lat lat(SCHED_REPLAY);
+	int qp, mqp, scq, rcq, mcq;
+
+	for (int i = 0; i < SCHED_REPLAY; i++) {
+		double t = lat_now();
+		struct cc_sched s;
+
+		sched_two_stage(s, qp, mqp, scq, rcq, mcq);
+		ASSERT_EQ(0, s.check()) << s.err;
+		lat.add(lat_now() - t);
+	}
+	lat.report("cc_sched build and check");
+}
+
+/* the two stage schedule compiled once and posted SCHED_REPLAY times */
+TEST_F(tc_verbs_sched, ti_1) {
+#ifdef HAVE_CROSS_CHANNEL
+	struct cc_sched s;
+	struct ibv_qp *qps[2];
+	struct ibv_cq *cqs[3];
+	struct ibv_sge sge;
+	ibvt_lat post(SCHED_REPLAY);
+	int qp, mqp, scq, rcq, mcq;
+	double t;
+
+	__init_test(IBV_QP_CREATE_CROSS_CHANNEL | IBV_QP_CREATE_MANAGED_SEND,
+		    DEFAULT_DEPTH, SEND_POST_COUNT);
+
+	t = lat_now();
+	sched_two_stage(s, qp, mqp, scq, rcq, mcq);
+	qps[qp] = ctx->qp;
+	qps[mqp] = ctx->mqp;
+	cqs[scq] = ctx->scq;
+	cqs[rcq] = ctx->rcq;
+	cqs[mcq] = ctx->mcq;
+	sge.addr = (uintptr_t)ctx->net_buf;
+	sge.length = ctx->size;
+	sge.lkey = ctx->mr->lkey;
+	ASSERT_EQ(0, s.compile(qps, cqs, sge)) << s.err;
+	VERBS_NOTICE("cc_sched compile %.2f usec\n", lat_now() - t);
+
+	for (int i = 0; i < SCHED_REPLAY; i++) {
+		/* __init_test posted the receives of the first run */
+		t = lat_now();
+		ASSERT_EQ(EOK, s.post(i > 0));
+		post.add(lat_now() - t);
+
+		__poll_cq(ctx->scq, ctx->cq_tx_depth, ctx->wc, SEND_POST_COUNT);
+		__poll_cq(ctx->rcq, ctx->cq_rx_depth, ctx->wc, SEND_POST_COUNT);
+		__poll_cq(ctx->mcq, 0x10, ctx->wc, 1);
+		ASSERT_EQ(IBV_WC_SUCCESS, ctx->wc[0].status);
+	}
+	post.report("cc_sched post");
+#endif
+}
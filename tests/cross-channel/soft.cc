@@ -0,0 +1,254 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+#include "stats.h"
+#include "cc_soft.h"
+
+/* recursive doubling among loopback ranks, one RC pair per rank pair and round */
+#define CC_RANKS 4
+#define CC_ROUNDS 2
+#define CC_LEN 64
+#define CC_RUNS 1000
+
+struct cc_soft_qp : public ibvt_qp_rc {
+	ibvt_cq &scq;
+
+	cc_soft_qp(ibvt_env &e, ibvt_pd &p, ibvt_cq &s, ibvt_cq &r) :
+		ibvt_qp_rc(e, p, r), scq(s) {}
+
+	virtual void init_attr(struct ibv_qp_init_attr_ex &attr) {
+		ibvt_qp_rc::init_attr(attr);
+		attr.send_cq = scq.cq;
+	}
+};
+
+struct cc_soft_test : public testing::Test, public ibvt_env {
+	ibvt_ctx ctx;
+	ibvt_pd pd;
+	ibvt_cq *scq[CC_RANKS];
+	ibvt_cq *rcq[CC_RANKS][CC_ROUNDS];
+	cc_soft_qp *qp[CC_RANKS][CC_ROUNDS];
+	ibvt_mr *mr[CC_RANKS];
+
+	struct cc_sched sched;
+	int mgr[CC_RANKS];
+	struct ibv_qp *qps[CC_RANKS * (CC_ROUNDS + 1)];
+	struct ibv_cq *cqs[CC_RANKS * (CC_ROUNDS + 2)];
+
+	cc_soft_test() : ctx(*this, NULL), pd(*this, ctx) {
+		for (int i = 0; i < CC_RANKS; i++) {
+			scq[i] = new ibvt_cq(*this, ctx);
+			for (int r = 0; r < CC_ROUNDS; r++) {
+				rcq[i][r] = new ibvt_cq(*this, ctx);
+				qp[i][r] = new cc_soft_qp(*this, pd, *scq[i], *rcq[i][r]);
+			}
+			mr[i] = new ibvt_mr(*this, pd,
+					    sizeof(double) * CC_LEN * (2 * CC_ROUNDS + 1));
+		}
+	}
+
+	virtual ~cc_soft_test() {
+		for (int i = 0; i < CC_RANKS; i++) {
+			for (int r = 0; r < CC_ROUNDS; r++)
+				delete qp[i][r];
+			for (int r = 0; r < CC_ROUNDS; r++)
+				delete rcq[i][r];
+			delete scq[i];
+			delete mr[i];
+		}
+	}
+
+	/* the vector rank i sends in round r, the last one is the result */
+	double *acc(int i, int r) {
+		return (double *)mr[i]->buff + CC_LEN * r;
+	}
+
+	double *in(int i, int r) {
+		return (double *)mr[i]->buff + CC_LEN * (CC_ROUNDS + 1 + r);
+	}
+
+	struct ibv_sge sge(int i, double *p, int len) {
+		return mr[i]->sge((char *)p - mr[i]->buff, len * sizeof(double));
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		for (int i = 0; i < CC_RANKS; i++) {
+			INIT(scq[i]->init());
+			for (int r = 0; r < CC_ROUNDS; r++) {
+				INIT(rcq[i][r]->init());
+				INIT(qp[i][r]->init());
+			}
+			INIT(mr[i]->init());
+			for (int k = 0; k < CC_LEN; k++)
+				acc(i, 0)[k] = i + 1 + k;
+		}
+		for (int i = 0; i < CC_RANKS; i++)
+			for (int r = 0; r < CC_ROUNDS; r++)
+				INIT(qp[i][r]->connect(qp[i ^ (1 << r)][r]));
+	}
+
+	virtual void TearDown() {
+		ASSERT_FALSE(HasFailure());
+	}
+
+	/*
+	 * Every rank sends its vector of round r to rank i ^ 2^r and waits
+	 * for the one coming back before the next round, len 0 is a barrier.
+	 */
+	void build(int len) {
+		struct ibv_sge zero = {};
+		int q[CC_RANKS][CC_ROUNDS], s[CC_RANKS], rc[CC_RANKS][CC_ROUNDS];
+
+		for (int i = 0; i < CC_RANKS; i++) {
+			s[i] = sched.cq();
+			cqs[s[i]] = scq[i]->cq;
+			for (int r = 0; r < CC_ROUNDS; r++) {
+				rc[i][r] = sched.cq();
+				cqs[rc[i][r]] = rcq[i][r]->cq;
+				q[i][r] = sched.qp(s[i], rc[i][r], false, true);
+				qps[q[i][r]] = qp[i][r]->qp;
+				sched.buf(q[i][r], sge(i, acc(i, r), len),
+					  sge(i, in(i, r), len));
+			}
+		}
+		for (int i = 0; i < CC_RANKS; i++) {
+			int m = sched.cq();
+
+			cqs[m] = NULL;
+			mgr[i] = sched.qp(m, m, true);
+			qps[mgr[i]] = NULL;
+			for (int r = 0; r < CC_ROUNDS; r++) {
+				sched.connect(q[i][r], q[i ^ (1 << r)][r]);
+				sched.recv(q[i][r], 1);
+				sched.send(q[i][r]);
+				sched.enable(mgr[i], q[i][r], 1);
+				sched.wait(mgr[i], rc[i][r], 1);
+			}
+		}
+		ASSERT_EQ(0, sched.compile(qps, cqs, zero, false)) << sched.err;
+	}
+
+	void reduce(int i, int r) {
+		for (int k = 0; k < CC_LEN; k++)
+			acc(i, r + 1)[k] = acc(i, r)[k] + in(i, r)[k];
+	}
+
+	void check() {
+		for (int i = 0; i < CC_RANKS; i++) {
+			for (int k = 0; k < CC_LEN; k++)
+				ASSERT_EQ(CC_RANKS * (CC_RANKS + 1) / 2 + CC_RANKS * k,
+					  acc(i, CC_ROUNDS)[k]) << i << " " << k;
+			memset(acc(i, 1), 0, sizeof(double) * CC_LEN * CC_ROUNDS);
+		}
+	}
+
+	/* the same rounds driven by the CPU */
+	void cpu(int len, bool sum) {
+		for (int i = 0; i < CC_RANKS; i++)
+			for (int r = 0; r < CC_ROUNDS; r++)
+				EXEC(qp[i][r]->recv(sge(i, in(i, r), len)));
+		for (int r = 0; r < CC_ROUNDS; r++) {
+			for (int i = 0; i < CC_RANKS; i++)
+				EXEC(qp[i][r]->post_send(sge(i, acc(i, r), len), IBV_WR_SEND));
+			for (int i = 0; i < CC_RANKS; i++) {
+				EXEC(rcq[i][r]->poll(1));
+				if (sum)
+					reduce(i, r);
+			}
+		}
+		for (int i = 0; i < CC_RANKS; i++)
+			for (int r = 0; r < CC_ROUNDS; r++)
+				EXEC(scq[i]->poll(1));
+	}
+};
+
+/* reduces on the wait of each round, before the next enable posts the sum */
+struct cc_soft_allreduce : public cc_soft {
+	cc_soft_test &t;
+	bool sum;
+
+	cc_soft_allreduce(cc_soft_test &test, bool s) :
+		cc_soft(test.sched, test.qps, test.cqs), t(test), sum(s) {}
+
+	virtual void done(int q, size_t i) {
+		if (!sum || (i & 1) == 0)
+			return;
+		for (int rank = 0; rank < CC_RANKS; rank++)
+			if (t.mgr[rank] == q)
+				t.reduce(rank, i / 2);
+	}
+};
+
+static void cc_soft_cmp(cc_soft_test &t, int len, bool sum, const char *what)
+{
+	cc_soft_allreduce engine(t, sum);
+	ibvt_lat soft(CC_RUNS), cpu(CC_RUNS);
+
+	for (int i = 0; i < CC_RUNS; i++) {
+		double t0 = lat_now();
+
+		ASSERT_EQ(0, engine.run());
+		soft.add(lat_now() - t0);
+		if (sum) {
+			ASSERT_NO_FATAL_FAILURE(t.check());
+		}
+
+		t0 = lat_now();
+		ASSERT_NO_FATAL_FAILURE(t.cpu(len, sum));
+		cpu.add(lat_now() - t0);
+		if (sum) {
+			ASSERT_NO_FATAL_FAILURE(t.check());
+		}
+	}
+	VERBS_NOTICE("%s of %d ranks: engine p50 %.2f p99 %.2f, cpu p50 %.2f "
+		     "p99 %.2f usec\n", what, CC_RANKS, soft.pct(50),
+		     soft.pct(99), cpu.pct(50), cpu.pct(99));
+}
+
+TEST_F(cc_soft_test, t0_barrier) {
+	CHK_SUT(rc);
+	EXEC(build(0));
+	cc_soft_cmp(*this, 0, false, "barrier");
+}
+
+TEST_F(cc_soft_test, t1_allreduce) {
+	CHK_SUT(rc);
+	EXEC(build(CC_LEN));
+	cc_soft_cmp(*this, CC_LEN, true, "allreduce");
+}
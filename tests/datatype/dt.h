@@ -0,0 +1,239 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __IBVT_DT_H_
+#define __IBVT_DT_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define DT_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Non-contiguous layouts and the two ways to move them.
+ *
+ * A layout is a list of blocks, offsets and lengths into a buffer, with
+ * adjacent blocks merged. Vector layouts (count blocks of blocklen bytes,
+ * stride apart) are the faces of a halo exchange: a column of a row major
+ * grid is a vector with the row as its stride.
+ *
+ * A layout either goes out as SGE lists, up to max_sge blocks per WR and
+ * gathered by the device, or is packed by the CPU into a registered bounce
+ * buffer and sent as one block. Unpacking scatters a packed buffer back.
+ * Short blocks are copied with 16 byte loads and stores, and vectors of
+ * 4 or 8 byte elements are packed with AVX2 gathers where the CPU has them.
+ * Packing with simd off is a memcpy per block, the reference.
+ */
+
+/* blocks up to this many bytes are copied inline, longer ones by memcpy */
+#define DT_SMALL 256
+
+struct dt_block {
+	size_t off;
+	size_t len;
+};
+
+static inline void dt_copy(char *d, const char *s, size_t len)
+{
+#ifdef DT_X86
+	if (len >= 16 && len <= DT_SMALL) {
+		size_t i;
+
+		for (i = 0; i + 16 <= len; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+
+			/* opaque to -O3, which would make the loop a memcpy call */
+			__asm__("" : "+x"(v));
+			_mm_storeu_si128((__m128i *)(d + i), v);
+		}
+		/* the tail as one more store, overlapping the last one */
+		if (i < len)
+			_mm_storeu_si128((__m128i *)(d + len - 16),
+					 _mm_loadu_si128((const __m128i *)(s + len - 16)));
+		return;
+	}
+#endif
+	switch (len) {
+	case 8:
+		memcpy(d, s, 8);
+		break;
+	case 4:
+		memcpy(d, s, 4);
+		break;
+	default:
+		memcpy(d, s, len);
+	}
+}
+
+#ifdef DT_X86
+__attribute__((target("avx2")))
+static inline size_t dt_gather8(char *out, const char *base, size_t count,
+				size_t stride)
+{
+	__m256i idx = _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4, base += 4 * stride)
+		_mm256_storeu_si256((__m256i *)(out + i * 8),
+			_mm256_i64gather_epi64((const long long *)base, idx, 1));
+	return i;
+}
+
+__attribute__((target("avx2")))
+static inline size_t dt_gather4(char *out, const char *base, size_t count,
+				size_t stride)
+{
+	int s = stride;
+	__m256i idx = _mm256_set_epi32(7 * s, 6 * s, 5 * s, 4 * s,
+				       3 * s, 2 * s, s, 0);
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8, base += 8 * stride)
+		_mm256_storeu_si256((__m256i *)(out + i * 4),
+			_mm256_i32gather_epi32((const int *)base, idx, 1));
+	return i;
+}
+
+static inline bool dt_avx2()
+{
+	static int avx2 = -1;
+
+	if (avx2 < 0)
+		avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	return avx2;
+}
+#endif
+
+struct ibvt_dt {
+	std::vector<dt_block> blocks;
+	/* packed size and the span of the layout in its buffer */
+	size_t bytes;
+	size_t extent;
+	/* a vector of more than one block, 0 otherwise */
+	size_t stride;
+	size_t blocklen;
+
+	ibvt_dt() : bytes(0), extent(0), stride(0), blocklen(0) {}
+
+	void add(size_t off, size_t len) {
+		if (!len)
+			return;
+		if (blocks.size() &&
+		    blocks.back().off + blocks.back().len == off) {
+			blocks.back().len += len;
+		} else {
+			dt_block b = { off, len };
+			blocks.push_back(b);
+		}
+		bytes += len;
+		if (off + len > extent)
+			extent = off + len;
+		stride = blocklen = 0;
+	}
+
+	static ibvt_dt vector(size_t count, size_t blocklen, size_t stride) {
+		ibvt_dt dt;
+
+		for (size_t i = 0; i < count; i++)
+			dt.add(i * stride, blocklen);
+		if (dt.blocks.size() > 1) {
+			dt.stride = stride;
+			dt.blocklen = blocklen;
+		}
+		return dt;
+	}
+
+	static ibvt_dt indexed(int n, const size_t *displs, const size_t *lens) {
+		ibvt_dt dt;
+
+		for (int i = 0; i < n; i++)
+			dt.add(displs[i], lens[i]);
+		return dt;
+	}
+
+	size_t sges() const { return blocks.size(); }
+
+	/*
+	 * Up to max SGEs for the blocks from first on, of a layout at base
+	 * in a region with lkey. Returns how many, first moves past them.
+	 */
+	int sgl(char *base, uint32_t lkey, size_t &first, struct ibv_sge *out,
+		int max) const {
+		int n;
+
+		for (n = 0; n < max && first < blocks.size(); n++, first++) {
+			out[n].addr = (intptr_t)base + blocks[first].off;
+			out[n].length = blocks[first].len;
+			out[n].lkey = lkey;
+		}
+		return n;
+	}
+
+	void pack(char *out, const char *base, bool simd = true) const {
+		size_t i = 0;
+
+		if (!simd) {
+			for (; i < blocks.size(); i++) {
+				memcpy(out, base + blocks[i].off, blocks[i].len);
+				out += blocks[i].len;
+			}
+			return;
+		}
+#ifdef DT_X86
+		if (stride && dt_avx2()) {
+			if (blocklen == 8)
+				i = dt_gather8(out, base, blocks.size(), stride);
+			else if (blocklen == 4 && stride * 7 <= INT32_MAX)
+				i = dt_gather4(out, base, blocks.size(), stride);
+			out += i * blocklen;
+		}
+#endif
+		for (; i < blocks.size(); i++) {
+			dt_copy(out, base + blocks[i].off, blocks[i].len);
+			out += blocks[i].len;
+		}
+	}
+
+	void unpack(char *base, const char *in, bool simd = true) const {
+		for (size_t i = 0; i < blocks.size(); i++) {
+			if (simd)
+				dt_copy(base + blocks[i].off, in, blocks[i].len);
+			else
+				memcpy(base + blocks[i].off, in, blocks[i].len);
+			in += blocks[i].len;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,303 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+#include "stats.h"
+#include "dt.h"
+
+/* SGEs asked for, the QPs get no more than the device max_sge */
+#define DT_SGE 32
+/* a halo face of up to 4096 elements of up to 4096 bytes, every other one */
+#define DT_MAX_BLOCK 4096
+#define DT_MAX_COUNT 4096
+#define DT_PACKED (DT_MAX_BLOCK * DT_MAX_COUNT)
+#define DT_EXTENT (2 * DT_PACKED)
+/* bytes packed per round in the pack benchmark */
+#define DT_PACK_BYTES (1 << 20)
+#define DT_PACK_ROUNDS 20
+#define DT_MSGS 200
+/* unsignaled SGE list writes between signaled ones */
+#define DT_SIGNAL 256
+
+static const size_t dt_elems[] = { 8, 64, 512, 4096 };
+static const size_t dt_counts[] = { 16, 256, 4096 };
+
+static void dt_pattern(char *p, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		p[i] = (i * 7 + (i >> 8)) & 0xff;
+}
+
+TEST(datatype, t0_layout) {
+	size_t displs[] = { 0, 16, 24, 100, 4000 };
+	size_t lens[] = { 16, 8, 30, 1, 96 };
+	std::vector<ibvt_dt> dts;
+	struct ibv_sge sgl[4];
+	size_t first = 0;
+	int n;
+
+	/* adjacent blocks merge, a dense vector is one block */
+	ibvt_dt ix = ibvt_dt::indexed(5, displs, lens);
+	ASSERT_EQ(3U, ix.sges());
+	ASSERT_EQ(54U, ix.blocks[0].len);
+	ASSERT_EQ(151U, ix.bytes);
+	ASSERT_EQ(4096U, ix.extent);
+	ASSERT_EQ(1U, ibvt_dt::vector(16, 8, 8).sges());
+	ASSERT_EQ(0U, ibvt_dt::vector(16, 8, 8).stride);
+
+	/* SGE lists honour the limit and pick up where they stopped */
+	ibvt_dt v = ibvt_dt::vector(10, 8, 24);
+	n = v.sgl((char *)0x1000, 0x55, first, sgl, 4);
+	ASSERT_EQ(4, n);
+	ASSERT_EQ(4U, first);
+	ASSERT_EQ(0x1000U + 3 * 24, sgl[3].addr);
+	ASSERT_EQ(8U, sgl[3].length);
+	ASSERT_EQ(0x55U, sgl[3].lkey);
+	ASSERT_EQ(4, v.sgl((char *)0x1000, 0x55, first, sgl, 4));
+	ASSERT_EQ(2, v.sgl((char *)0x1000, 0x55, first, sgl, 4));
+	ASSERT_EQ(0, v.sgl((char *)0x1000, 0x55, first, sgl, 4));
+
+	/* the copy kernels against memcpy, odd counts leave gather tails */
+	dts.push_back(ix);
+	dts.push_back(ibvt_dt::vector(1001, 4, 12));
+	dts.push_back(ibvt_dt::vector(1003, 8, 40));
+	dts.push_back(ibvt_dt::vector(77, 20, 33));
+	dts.push_back(ibvt_dt::vector(65, 250, 260));
+	dts.push_back(ibvt_dt::vector(9, 3000, 3001));
+	for (size_t i = 0; i < dts.size(); i++) {
+		ibvt_dt &dt = dts[i];
+		std::vector<char> src(dt.extent), a(dt.bytes), b(dt.bytes);
+		std::vector<char> ua(dt.extent), ub(dt.extent);
+
+		dt_pattern(&src[0], dt.extent);
+		dt.pack(&a[0], &src[0], false);
+		dt.pack(&b[0], &src[0], true);
+		ASSERT_EQ(0, memcmp(&a[0], &b[0], dt.bytes)) << "layout " << i;
+		dt.unpack(&ua[0], &a[0], false);
+		dt.unpack(&ub[0], &a[0], true);
+		ASSERT_EQ(0, memcmp(&ua[0], &ub[0], dt.extent)) << "layout " << i;
+		for (size_t j = 0; j < dt.sges(); j++)
+			ASSERT_EQ(0, memcmp(&ua[dt.blocks[j].off],
+					    &src[dt.blocks[j].off],
+					    dt.blocks[j].len));
+	}
+}
+
+/*
+ * Pack and unpack rates of a vector with every other element taken, by
+ * element size, the copy kernels against a memcpy per block.
+ */
+TEST(datatype, b0_pack) {
+	static const size_t elems[] = { 4, 8, 16, 64, 256, 4096 };
+	std::vector<char> grid(2 * DT_PACK_BYTES), packed(DT_PACK_BYTES);
+
+	dt_pattern(&grid[0], grid.size());
+	for (size_t e = 0; e < sizeof(elems) / sizeof(elems[0]); e++) {
+		ibvt_dt dt = ibvt_dt::vector(DT_PACK_BYTES / elems[e],
+					     elems[e], 2 * elems[e]);
+		double t, rate[2][2];
+
+		for (int simd = 0; simd < 2; simd++) {
+			t = lat_now();
+			for (int r = 0; r < DT_PACK_ROUNDS; r++)
+				dt.pack(&packed[0], &grid[0], simd);
+			rate[simd][0] = (double)DT_PACK_ROUNDS *
+					DT_PACK_BYTES / (lat_now() - t) / 1e3;
+			t = lat_now();
+			for (int r = 0; r < DT_PACK_ROUNDS; r++)
+				dt.unpack(&grid[0], &packed[0], simd);
+			rate[simd][1] = (double)DT_PACK_ROUNDS *
+					DT_PACK_BYTES / (lat_now() - t) / 1e3;
+		}
+		VERBS_NOTICE("%4zu byte elements: pack %.2f GB/s, memcpy "
+			     "%.2f GB/s; unpack %.2f GB/s, memcpy %.2f GB/s\n",
+			     elems[e], rate[1][0], rate[0][0], rate[1][1],
+			     rate[0][1]);
+	}
+}
+
+struct datatype_test : public testing::Test, public ibvt_env {
+	ibvt_ctx ctx;
+	ibvt_pd pd;
+	ibvt_cq cq;
+	ibvt_qp_rc qa;
+	ibvt_qp_rc qb;
+	ibvt_mr src;
+	ibvt_mr dst;
+	ibvt_mr bounce;
+
+	datatype_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		cq(*this, ctx),
+		qa(*this, pd, cq),
+		qb(*this, pd, cq),
+		src(*this, pd, DT_EXTENT),
+		dst(*this, pd, DT_EXTENT),
+		bounce(*this, pd, DT_PACKED)
+	{ }
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		qa.max_sge = qb.max_sge =
+			std::min(DT_SGE, ctx.dev_attr_orig->max_sge);
+		INIT(qa.init());
+		INIT(qb.init());
+		INIT(qa.connect(&qb));
+		INIT(qb.connect(&qa));
+		INIT(src.init());
+		INIT(dst.init());
+		INIT(bounce.init());
+		dt_pattern(src.buff, src.size);
+	}
+
+	virtual void TearDown() {
+		ASSERT_FALSE(HasFailure());
+	}
+
+	/* the layout packed into dst, gathered by the device */
+	void write_sgl(const ibvt_dt &dt) {
+		struct ibv_sge sgl[DT_SGE];
+		struct ibv_sge to = dst.sge(0, dt.bytes);
+		size_t first = 0;
+		int wrs = 0, signaled = 0;
+		int n, flags;
+
+		while (first < dt.sges()) {
+			n = dt.sgl(src.buff, src.mr->lkey, first, sgl,
+				   qa.max_sge);
+			flags = (first == dt.sges() ||
+				 ++wrs % DT_SIGNAL == 0) ? IBV_SEND_SIGNALED : 0;
+			EXEC(qa.rdma_sgl(sgl, n, to, IBV_WR_RDMA_WRITE, flags));
+			signaled += !!flags;
+			for (int i = 0; i < n; i++)
+				to.addr += sgl[i].length;
+		}
+		for (int i = 0; i < signaled; i++)
+			EXEC(cq.poll(1));
+	}
+
+	/* the same, packed by the CPU and written from the bounce buffer */
+	void write_packed(const ibvt_dt &dt) {
+		dt.pack(bounce.buff, src.buff);
+		EXEC(qa.rdma(bounce.sge(0, dt.bytes), dst.sge(0, dt.bytes),
+			     IBV_WR_RDMA_WRITE));
+		EXEC(cq.poll(1));
+	}
+
+	void check(const ibvt_dt &dt) {
+		std::vector<char> expect(dt.bytes);
+
+		dt.pack(&expect[0], src.buff, false);
+		ASSERT_EQ(0, memcmp(&expect[0], dst.buff, dt.bytes));
+		memset(dst.buff, 0, dt.bytes);
+	}
+};
+
+TEST_F(datatype_test, t1_gather) {
+	int n;
+
+	CHK_SUT(datatype);
+	ASSERT_GE(qa.max_sge, 2);
+	n = std::min(8, qa.max_sge);
+
+	/* a strided send lands in two blocks of the receiver */
+	ibvt_dt tx = ibvt_dt::vector(n, 100, 300);
+	size_t displs[] = { 64, 4096 };
+	size_t lens[] = { tx.bytes / 2, tx.bytes - tx.bytes / 2 };
+	ibvt_dt rx = ibvt_dt::indexed(2, displs, lens);
+	struct ibv_sge ssgl[8], rsgl[2];
+	std::vector<char> expect(tx.bytes), got(rx.bytes);
+	size_t first = 0;
+
+	ASSERT_EQ(n, tx.sgl(src.buff, src.mr->lkey, first, ssgl, n));
+	first = 0;
+	ASSERT_EQ(2, rx.sgl(dst.buff, dst.mr->lkey, first, rsgl, 2));
+	EXEC(qb.recv_sgl(rsgl, 2));
+	EXEC(qa.post_send_sgl(ssgl, n, IBV_WR_SEND));
+	EXEC(cq.poll(1));
+	EXEC(cq.poll(1));
+
+	tx.pack(&expect[0], src.buff, false);
+	rx.pack(&got[0], dst.buff, false);
+	ASSERT_EQ(0, memcmp(&expect[0], &got[0], tx.bytes));
+	/* nothing between the scattered blocks */
+	ASSERT_EQ(0, dst.buff[63]);
+	ASSERT_EQ(0, dst.buff[64 + lens[0]]);
+	ASSERT_EQ(0, dst.buff[4095]);
+}
+
+/*
+ * A halo face, count elements every other one, to the peer: as SGE lists,
+ * max_sge blocks per RDMA write, or packed into the bounce buffer and
+ * written in one. Lists save the copy and win for large elements; packing
+ * saves WRs and descriptor fetches and wins for small ones, by more the
+ * lower max_sge is.
+ */
+TEST_F(datatype_test, b1_strategy) {
+	CHK_SUT(datatype);
+	VERBS_NOTICE("max_sge %d\n", qa.max_sge);
+	for (size_t e = 0; e < sizeof(dt_elems) / sizeof(dt_elems[0]); e++)
+	for (size_t c = 0; c < sizeof(dt_counts) / sizeof(dt_counts[0]); c++) {
+		ibvt_dt dt = ibvt_dt::vector(dt_counts[c], dt_elems[e],
+					     2 * dt_elems[e]);
+		double t, sgl, packed;
+
+		EXEC(write_sgl(dt));
+		EXEC(check(dt));
+		EXEC(write_packed(dt));
+		EXEC(check(dt));
+
+		t = lat_now();
+		for (int i = 0; i < DT_MSGS; i++)
+			EXEC(write_sgl(dt));
+		sgl = (lat_now() - t) / DT_MSGS;
+		t = lat_now();
+		for (int i = 0; i < DT_MSGS; i++)
+			EXEC(write_packed(dt));
+		packed = (lat_now() - t) / DT_MSGS;
+
+		VERBS_NOTICE("%4zu x %4zu bytes: sge lists %.2f usec in %zu "
+			     "WRs, packed %.2f usec, %s\n", dt_counts[c],
+			     dt_elems[e], sgl,
+			     (dt.sges() + qa.max_sge - 1) / qa.max_sge, packed,
+			     sgl < packed ? "lists win" : "packing wins");
+	}
+}
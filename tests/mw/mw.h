@@ -0,0 +1,158 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __IBVT_MW_H_
+#define __IBVT_MW_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "env.h"
+
+/*
+ * Standard memory windows over an ibvt_mr, as opposed to the UMR built
+ * indirect MR the ODP tests call ibvt_mw.
+ *
+ * A type 1 window is bound with ibv_bind_mw and unbound by a zero length
+ * bind. A type 2 window is bound by an IBV_WR_BIND_MW on the QP it then
+ * belongs to, with the next key of its rkey, and is unbound by a local
+ * invalidation or by the peer with SEND_WITH_INV. The MR needs
+ * IBV_ACCESS_MW_BIND.
+ */
+
+#if HAVE_DECL_IBV_WR_BIND_MW && !defined(HAVE_INFINIBAND_VERBS_EXP_H)
+#define HAVE_MW_BIND
+
+#define IBVT_MW_ACCESS (IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE)
+
+struct ibvt_mr_mw : public ibvt_mr {
+	ibvt_mr_mw(ibvt_env &e, ibvt_pd &p, size_t s) :
+		ibvt_mr(e, p, s, 0, IBV_ACCESS_LOCAL_WRITE |
+				    IBV_ACCESS_REMOTE_READ |
+				    IBV_ACCESS_REMOTE_WRITE |
+				    IBV_ACCESS_MW_BIND) {}
+};
+
+struct ibvt_mw_bind : public ibvt_obj {
+	struct ibv_mw *mw;
+	ibvt_mr &mr;
+	ibvt_qp &qp;
+	enum ibv_mw_type type;
+	uint32_t rkey;
+	intptr_t start;
+	size_t length;
+
+	ibvt_mw_bind(ibvt_mr &m, ibvt_qp &q, enum ibv_mw_type t) :
+		ibvt_obj(m.env), mw(NULL), mr(m), qp(q), type(t), rkey(0),
+		start(0), length(0) {}
+
+	virtual ~ibvt_mw_bind() {
+		FREE(ibv_dealloc_mw, mw);
+	}
+
+	virtual void init() {
+		if (mw)
+			return;
+		EXEC(mr.init());
+		SET(mw, ibv_alloc_mw(mr.pd.pd, type));
+		rkey = mw->rkey;
+	}
+
+	/* Binds [s, s + len) of the MR, the window takes a new rkey */
+	virtual void bind(intptr_t s, size_t len, uint64_t wr_id = 0,
+			  int flags = IBV_SEND_SIGNALED,
+			  int access = IBVT_MW_ACCESS) {
+		struct ibv_mw_bind_info info;
+
+		memset(&info, 0, sizeof(info));
+		info.mr = mr.mr;
+		info.addr = (intptr_t)mr.buff + s;
+		info.length = len;
+		info.mw_access_flags = access;
+
+		if (type == IBV_MW_TYPE_1) {
+			struct ibv_mw_bind b;
+
+			memset(&b, 0, sizeof(b));
+			b.wr_id = wr_id;
+			b.send_flags = flags;
+			b.bind_info = info;
+			DO(ibv_bind_mw(qp.qp, mw, &b));
+			rkey = mw->rkey;
+		} else {
+			struct ibv_send_wr wr;
+			struct ibv_send_wr *bad_wr = NULL;
+
+			memset(&wr, 0, sizeof(wr));
+			wr.wr_id = wr_id;
+			wr.opcode = IBV_WR_BIND_MW;
+			wr.send_flags = flags;
+			wr.bind_mw.mw = mw;
+			wr.bind_mw.rkey = ibv_inc_rkey(rkey);
+			wr.bind_mw.bind_info = info;
+			DO(ibv_post_send(qp.qp, &wr, &bad_wr));
+			rkey = wr.bind_mw.rkey;
+		}
+		start = s;
+		length = len;
+	}
+
+	/* Zero length bind of a type 1, local invalidation of a type 2 */
+	virtual void unbind(uint64_t wr_id = 0, int flags = IBV_SEND_SIGNALED) {
+		struct ibv_send_wr wr;
+		struct ibv_send_wr *bad_wr = NULL;
+
+		if (type == IBV_MW_TYPE_1) {
+			EXEC(bind(0, 0, wr_id, flags));
+			return;
+		}
+		memset(&wr, 0, sizeof(wr));
+		wr.wr_id = wr_id;
+		wr.opcode = IBV_WR_LOCAL_INV;
+		wr.send_flags = flags;
+		wr.invalidate_rkey = rkey;
+		DO(ibv_post_send(qp.qp, &wr, &bad_wr));
+		length = 0;
+	}
+
+	/* The bound range for rdma(), which takes the rkey from lkey */
+	virtual struct ibv_sge sge(intptr_t s, size_t len) {
+		struct ibv_sge ret;
+
+		memset(&ret, 0, sizeof(ret));
+		ret.addr = (intptr_t)mr.buff + start + s;
+		ret.length = len;
+		ret.lkey = rkey;
+		return ret;
+	}
+
+	virtual struct ibv_sge sge() { return sge(0, length); }
+};
+
+#endif
+#endif
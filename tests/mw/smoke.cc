@@ -0,0 +1,315 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+#include "stats.h"
+#include "mw.h"
+
+#ifdef HAVE_MW_BIND
+
+#define MW_SZ 0x10000
+#define MW_WINDOWS 16
+#define MW_BINDS 10000
+#define MW_BATCH 64
+#define MW_MSGS 20000
+
+static const size_t mw_sizes[] = { 0x1000, MW_SZ };
+
+struct mw_test : public testing::Test, public ibvt_env {
+	ibvt_ctx ctx;
+	ibvt_pd pd;
+	ibvt_cq cq_s;
+	ibvt_cq cq_t;
+	/* the initiator and the target, which owns the windows */
+	ibvt_qp_rc qp_s;
+	ibvt_qp_rc qp_t;
+	ibvt_mr src;
+	ibvt_mr_mw dst;
+	ibvt_mw_bind *w[MW_WINDOWS];
+
+	mw_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		cq_s(*this, ctx),
+		cq_t(*this, ctx),
+		qp_s(*this, pd, cq_s),
+		qp_t(*this, pd, cq_t),
+		src(*this, pd, MW_WINDOWS * MW_SZ),
+		dst(*this, pd, MW_WINDOWS * MW_SZ)
+	{
+		memset(w, 0, sizeof(w));
+	}
+
+	virtual ~mw_test() {
+		for (int i = 0; i < MW_WINDOWS; i++)
+			delete w[i];
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		INIT(qp_s.init());
+		INIT(qp_t.init());
+		INIT(qp_s.connect(&qp_t));
+		INIT(qp_t.connect(&qp_s));
+		INIT(src.fill());
+		INIT(dst.init());
+	}
+
+	virtual void TearDown() {
+		ASSERT_FALSE(HasFailure());
+	}
+
+	void windows(enum ibv_mw_type type) {
+		for (int i = 0; i < MW_WINDOWS; i++) {
+			delete w[i];
+			w[i] = new ibvt_mw_bind(dst, qp_t, type);
+			EXEC(w[i]->init());
+		}
+	}
+
+	/* n completions, the last one in wc */
+	void reap(ibvt_cq &cq, int n, struct ibv_wc *wc = NULL,
+		  enum ibv_wc_status status = IBV_WC_SUCCESS) {
+		struct ibv_wc tmp[MW_WINDOWS];
+		long retries = POLL_RETRIES;
+		int k;
+
+		while (n > 0) {
+			k = cq.poll_wc(tmp, std::min(n, MW_WINDOWS));
+			ASSERT_GE(k, 0);
+			if (!k) {
+				ASSERT_GT(--retries, 0);
+				continue;
+			}
+			for (int i = 0; i < k; i++)
+				ASSERT_EQ(status, tmp[i].status) <<
+					ibv_wc_status_str(tmp[i].status);
+			if (wc)
+				*wc = tmp[k - 1];
+			n -= k;
+		}
+	}
+
+	/* the plain MR as a remote target, rdma() takes the rkey from lkey */
+	struct ibv_sge rsge(intptr_t start, size_t length) {
+		struct ibv_sge sge = dst.sge(start, length);
+
+		sge.lkey = dst.mr->rkey;
+		return sge;
+	}
+
+	void write(struct ibv_sge src_sge, struct ibv_sge dst_sge,
+		   int flags = IBV_SEND_SIGNALED) {
+		EXEC(qp_s.rdma(src_sge, dst_sge, IBV_WR_RDMA_WRITE,
+			       (enum ibv_send_flags)flags));
+	}
+
+	/* a zero length send, invalidating rkey at the target if set */
+	void notify(uint32_t rkey, int flags = IBV_SEND_SIGNALED) {
+		struct ibv_send_wr wr;
+		struct ibv_send_wr *bad_wr = NULL;
+
+		memset(&wr, 0, sizeof(wr));
+		wr.opcode = rkey ? IBV_WR_SEND_WITH_INV : IBV_WR_SEND;
+		wr.send_flags = flags;
+		wr.invalidate_rkey = rkey;
+		DO(ibv_post_send(qp_s.qp, &wr, &bad_wr));
+	}
+
+	void check(intptr_t start, size_t length) {
+		ASSERT_EQ(0, memcmp(src.buff + start, dst.buff + start, length));
+		memset(dst.buff + start, 0, length);
+	}
+
+	void access(struct ibv_sge sge, bool ok) {
+		EXEC(write(src.sge(0, sge.length), sge));
+		EXEC(reap(cq_s, 1, NULL, ok ? IBV_WC_SUCCESS :
+					     IBV_WC_REM_ACCESS_ERR));
+		if (ok)
+			EXEC(check(sge.addr - (intptr_t)dst.buff, sge.length));
+	}
+
+	void bind_lat(enum ibv_mw_type type) {
+		ibvt_lat bind(MW_BINDS), unbind(MW_BINDS);
+		double t;
+
+		EXEC(windows(type));
+		for (int i = 0; i < MW_BINDS; i++) {
+			t = lat_now();
+			EXEC(w[0]->bind(0, MW_SZ));
+			EXEC(reap(cq_t, 1));
+			bind.add(lat_now() - t);
+
+			t = lat_now();
+			EXEC(w[0]->unbind());
+			EXEC(reap(cq_t, 1));
+			unbind.add(lat_now() - t);
+		}
+
+		t = lat_now();
+		for (int i = 0; i < MW_BINDS; i += MW_BATCH) {
+			for (int k = 0; k < MW_BATCH; k++) {
+				EXEC(w[0]->bind(0, MW_SZ, 0, 0));
+				EXEC(w[0]->unbind(0, k == MW_BATCH - 1 ?
+						  IBV_SEND_SIGNALED : 0));
+			}
+			EXEC(reap(cq_t, 1));
+		}
+		t = lat_now() - t;
+
+		VERBS_NOTICE("type %d window: %.0f bind/unbind pairs/s "
+			     "posted %d at a time\n", type, MW_BINDS / t * 1e6,
+			     MW_BATCH);
+		bind.report("  bind");
+		unbind.report(type == IBV_MW_TYPE_1 ? "  unbind" :
+			      "  local invalidate");
+	}
+
+	/*
+	 * Storage style transfers: the target exposes a buffer per request,
+	 * the initiator writes it and tells so with a send. Either every
+	 * request gets a window of its own, bound for it and invalidated by
+	 * that send, or all go to the one MR rkey.
+	 */
+	void transfer(size_t len, bool scoped) {
+		struct ibv_wc wc[MW_WINDOWS];
+		double t;
+
+		t = lat_now();
+		for (int n = 0; n < MW_MSGS; n += MW_WINDOWS) {
+			for (int i = 0; i < MW_WINDOWS; i++) {
+				EXEC(qp_t.recv(dst.sge(0, 0)));
+				if (scoped)
+					EXEC(w[i]->bind(i * MW_SZ, len, 0,
+						i == MW_WINDOWS - 1 ?
+						IBV_SEND_SIGNALED : 0));
+			}
+			if (scoped)
+				EXEC(reap(cq_t, 1));
+
+			for (int i = 0; i < MW_WINDOWS; i++) {
+				int last = i == MW_WINDOWS - 1 ?
+					   IBV_SEND_SIGNALED : 0;
+
+				EXEC(write(src.sge(i * MW_SZ, len),
+					   scoped ? w[i]->sge() :
+					   rsge(i * MW_SZ, len), 0));
+				EXEC(notify(scoped ? w[i]->rkey : 0, last));
+			}
+			EXEC(reap(cq_s, 1));
+
+			for (int i = 0; i < MW_WINDOWS; i++) {
+				EXEC(reap(cq_t, 1, &wc[i]));
+				if (!scoped)
+					continue;
+				ASSERT_TRUE(wc[i].wc_flags & IBV_WC_WITH_INV);
+				ASSERT_EQ(w[i]->rkey, wc[i].invalidated_rkey);
+			}
+		}
+		t = lat_now() - t;
+
+		VERBS_NOTICE("%6zu bytes, %s: %.0f msgs/s, %.1f MB/s\n", len,
+			     scoped ? "window per message" : "long-lived rkey",
+			     MW_MSGS / t * 1e6, MW_MSGS * len / t);
+	}
+};
+
+TEST_F(mw_test, t0_type1) {
+	struct ibv_sge held;
+
+	CHK_SUT(mw);
+	EXEC(windows(IBV_MW_TYPE_1));
+	EXEC(w[0]->bind(MW_SZ, MW_SZ));
+	EXEC(reap(cq_t, 1));
+	EXEC(access(w[0]->sge(), true));
+	/* the rkey and range the peer was given */
+	held = w[0]->sge();
+	EXEC(w[0]->unbind());
+	EXEC(reap(cq_t, 1));
+	ASSERT_NE(held.lkey, w[0]->rkey);
+	EXEC(access(held, false));
+}
+
+TEST_F(mw_test, t1_type2_local_inv) {
+	uint32_t rkey;
+
+	CHK_SUT(mw);
+	EXEC(windows(IBV_MW_TYPE_2));
+	rkey = w[0]->rkey;
+	EXEC(w[0]->bind(MW_SZ, MW_SZ));
+	EXEC(reap(cq_t, 1));
+	ASSERT_NE(rkey, w[0]->rkey);
+	EXEC(access(w[0]->sge(), true));
+	EXEC(w[0]->unbind());
+	EXEC(reap(cq_t, 1));
+	EXEC(access(w[0]->sge(0, MW_SZ), false));
+}
+
+TEST_F(mw_test, t2_send_inv) {
+	struct ibv_wc wc;
+
+	CHK_SUT(mw);
+	EXEC(windows(IBV_MW_TYPE_2));
+	EXEC(w[0]->bind(0, MW_SZ));
+	EXEC(reap(cq_t, 1));
+	EXEC(qp_t.recv(dst.sge(0, 0)));
+	EXEC(access(w[0]->sge(), true));
+	EXEC(notify(w[0]->rkey));
+	EXEC(reap(cq_s, 1));
+	EXEC(reap(cq_t, 1, &wc));
+	ASSERT_TRUE(wc.wc_flags & IBV_WC_WITH_INV);
+	ASSERT_EQ(w[0]->rkey, wc.invalidated_rkey);
+	EXEC(access(w[0]->sge(), false));
+}
+
+TEST_F(mw_test, b0_bind) {
+	CHK_SUT(mw);
+	EXEC(bind_lat(IBV_MW_TYPE_1));
+	EXEC(bind_lat(IBV_MW_TYPE_2));
+}
+
+TEST_F(mw_test, b1_transfer) {
+	CHK_SUT(mw);
+	EXEC(windows(IBV_MW_TYPE_2));
+	for (size_t i = 0; i < ARRAY_SIZE(mw_sizes); i++) {
+		EXEC(transfer(mw_sizes[i], false));
+		EXEC(transfer(mw_sizes[i], true));
+	}
+}
+
+#endif
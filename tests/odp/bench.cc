@@ -0,0 +1,1003 @@
+/**
+ * Copyright (C) 2016	   Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define __STDC_LIMIT_MACROS
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+#include "odp.h"
+#include "stats.h"
+
+
+/*
+ * ODP fault cost benchmarks.
+ *
+ * Every benchmark moves single pages from src() to dst() of a span
+ * registered by the MEM type under test and reports per page latency:
+ * the first pass takes the page faults, the second one is steady state.
+ * The odp_stats debugfs counters are sampled along the way.
+ */
+
+#define ODP_BENCH_SPAN 0x10000000UL
+#define ODP_BENCH_PAGES 2048
+#define ODP_BENCH_SAMPLES 8
+
+enum odp_pattern {
+	ODP_SEQ,
+	ODP_STRIDED,
+	ODP_RANDOM,
+};
+
+static const char *odp_pattern_str[] = { "seq", "strided", "random" };
+
+static const char *odp_stat_names[] = {
+	"num_odp_mr_pages",
+	"num_page_fault_pages",
+	"num_invalidations",
+	"num_failed_resolutions",
+};
+
+#define ODP_STATS (int)(sizeof(odp_stat_names) / sizeof(odp_stat_names[0]))
+
+struct odp_sample {
+	double usec;
+	long v[ODP_STATS];
+};
+
+template <typename T>
+struct odp_bench : public odp<T> {
+	std::vector<size_t> offs;
+	std::vector<struct odp_sample> samples;
+	double start;
+
+	odp_bench() : odp<T>(), start(0) {}
+
+	/* page offsets in [0, span) in the order they are accessed */
+	void pages(int pattern, size_t span, int n) {
+		size_t span_pages = span / PAGE;
+		unsigned int seed = 1;
+
+		offs.clear();
+		switch (pattern) {
+		case ODP_SEQ:
+			for (int i = 0; i < n; i++)
+				offs.push_back(i * PAGE);
+			break;
+		case ODP_STRIDED:
+			for (int i = 0; i < n; i++)
+				offs.push_back(i * (span_pages / n) * PAGE);
+			break;
+		case ODP_RANDOM: {
+			std::vector<size_t> all(span_pages);
+
+			for (size_t i = 0; i < span_pages; i++)
+				all[i] = i;
+			for (int i = 0; i < n; i++) {
+				std::swap(all[i], all[i + rand_r(&seed) % (span_pages - i)]);
+				offs.push_back(all[i] * PAGE);
+			}
+			break;
+		}
+		}
+	}
+
+	void sample() {
+		struct odp_sample s;
+
+		s.usec = lat_now() - start;
+		for (int i = 0; i < ODP_STATS; i++)
+			s.v[i] = this->stat(odp_stat_names[i]);
+		samples.push_back(s);
+	}
+
+	void pass(ibvt_lat &lat) {
+		size_t every = offs.size() / ODP_BENCH_SAMPLES;
+
+		if (!every)
+			every = 1;
+
+		for (size_t i = 0; i < offs.size(); i++) {
+			double t = lat_now();
+
+			/* no EXEC on the measured path, the failure is checked after */
+			this->xfer(offs[i], PAGE);
+			lat.add(lat_now() - t);
+			if (this->HasFatalFailure())
+				return;
+			if (i % every == every - 1)
+				sample();
+		}
+	}
+
+	void report_samples(int from, int to) {
+		char buff[1024];
+
+		for (int k = 0; k < ODP_STATS; k++) {
+			int len = 0;
+
+			buff[0] = 0;
+			if (samples[from].v[k] < 0)
+				continue;
+			for (int i = from + 1; i <= to; i++)
+				len += snprintf(buff + len, sizeof(buff) - len, " %+ld",
+						samples[i].v[k] - samples[i - 1].v[k]);
+			VERBS_NOTICE("  %s:%s\n", odp_stat_names[k], buff);
+		}
+	}
+
+	void bench(int pattern) {
+		const char *mode = testing::UnitTest::GetInstance()->
+			current_test_info()->type_param();
+		ibvt_lat first(ODP_BENCH_PAGES), steady(ODP_BENCH_PAGES);
+		char *src, *dst;
+
+		EXEC(mem().reg(0, 0, ODP_BENCH_SPAN));
+		EXEC(mem().src().fill());
+		EXEC(mem().dst().init());
+		EXEC(pages(pattern, ODP_BENCH_SPAN, ODP_BENCH_PAGES));
+
+		samples.clear();
+		start = lat_now();
+		EXEC(sample());
+		EXEC(pass(first));
+		EXEC(pass(steady));
+
+		src = this->mem().src().buff;
+		dst = this->mem().dst().buff;
+		for (size_t i = 0; i < offs.size(); i++)
+			ASSERT_EQ(0, memcmp(src + offs[i], dst + offs[i], PAGE))
+				<< "page " << offs[i] / PAGE;
+
+		VERBS_NOTICE("%s %s: %.0f faults/s, steady %.1f MB/s\n",
+			     mode, odp_pattern_str[pattern],
+			     first.count() / first.total * 1e6,
+			     steady.count() * PAGE / steady.total);
+		first.report("  first touch");
+		steady.report("  steady");
+		/* odp_stats deltas per 1/ODP_BENCH_SAMPLES of each pass */
+		report_samples(0, samples.size() - 1);
+
+		EXEC(mem().unreg());
+	}
+};
+
+typedef testing::Types<
+	types<odp_explicit, odp_rc, odp_send>,
+	types<odp_explicit, odp_rc, odp_rdma_read>,
+	types<odp_explicit, odp_rc, odp_rdma_write>,
+#ifdef HAVE_PREFETCH
+	types<odp_prefetch, odp_rc, odp_send>,
+	types<odp_prefetch, odp_rc, odp_rdma_read>,
+	types<odp_prefetch, odp_rc, odp_rdma_write>,
+#endif
+	types<odp_implicit, odp_rc, odp_send>,
+	types<odp_implicit, odp_rc, odp_rdma_read>,
+	types<odp_implicit, odp_rc, odp_rdma_write>,
+#if HAVE_DECL_IBV_ACCESS_HUGETLB
+	types<odp_hugetlb, odp_rc, odp_send>,
+	types<odp_hugetlb, odp_rc, odp_rdma_read>,
+	types<odp_hugetlb, odp_rc, odp_rdma_write>,
+#endif
+#ifdef HAVE_LINUX_USERFAULTFD_H
+	types<odp_soft_explicit, odp_soft, odp_rdma_write>,
+	types<odp_soft_implicit, odp_soft, odp_rdma_write>,
+#endif
+	types<odp_off, odp_rc, odp_send>,
+	types<odp_off, odp_rc, odp_rdma_read>,
+	types<odp_off, odp_rc, odp_rdma_write>
+> odp_env_list_bench;
+
+TYPED_TEST_CASE(odp_bench, odp_env_list_bench);
+
+TYPED_TEST(odp_bench, b0_seq) {
+	ODP_CHK_SUT(ODP_BENCH_SPAN);
+	EXEC(bench(ODP_SEQ));
+}
+
+TYPED_TEST(odp_bench, b1_strided) {
+	ODP_CHK_SUT(ODP_BENCH_SPAN);
+	EXEC(bench(ODP_STRIDED));
+}
+
+TYPED_TEST(odp_bench, b2_random) {
+	ODP_CHK_SUT(ODP_BENCH_SPAN);
+	EXEC(bench(ODP_RANDOM));
+}
+
+/* streaming engine over cold ODP memory, one registration per window */
+TYPED_TEST(odp_bench, b3_window) {
+	ODP_CHK_SUT(ODP_BENCH_SPAN);
+	for (int window = 1; window <= 16; window *= 2)
+		EXEC(test_stream(0, 0, ODP_BENCH_SPAN, 64, window));
+}
+
+/*
+ * Fault storm: threads with a QP pair each write pages between two shared
+ * implicit MRs at the same time, either each to its own range or all of
+ * them to the same pages in different orders.
+ */
+
+#define ODP_STORM_THREADS 16
+#define ODP_STORM_PAGES 1024
+
+struct odp_storm_worker {
+	odp_side_qp<ibvt_qp_rc> src;
+	odp_side_qp<ibvt_qp_rc> dst;
+	ibvt_mr *msrc;
+	ibvt_mr *mdst;
+	std::vector<size_t> offs;
+	ibvt_lat lat;
+	pthread_t thread;
+	/* the first error of the run, -errno, checked on the test thread */
+	int err;
+	enum ibv_wc_status status;
+
+	odp_storm_worker(ibvt_env &e, ibvt_ctx &c, ibvt_pd &p) :
+		src(e, c, p, 0),
+		dst(e, c, p, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE),
+		msrc(NULL), mdst(NULL), lat(ODP_STORM_PAGES), err(0),
+		status(IBV_WC_SUCCESS) {}
+
+	/* one page from msrc to mdst and its completion, 0 or -errno */
+	int write(size_t off) {
+		struct ibv_sge s = msrc->sge(off, PAGE);
+		struct ibv_sge d = mdst->sge(off, PAGE);
+		struct ibv_send_wr wr;
+		struct ibv_send_wr *bad_wr = NULL;
+		struct ibv_wc wc;
+		long retries = POLL_RETRIES;
+		int ret;
+
+		memset(&wr, 0, sizeof(wr));
+		wr.sg_list = &s;
+		wr.num_sge = 1;
+		wr._wr_opcode = IBV_WR_RDMA_WRITE;
+		wr._wr_send_flags = IBV_SEND_SIGNALED;
+		wr.wr.rdma.remote_addr = d.addr;
+		wr.wr.rdma.rkey = d.lkey;
+		ret = ibv_post_send(src.qp.qp, &wr, &bad_wr);
+		if (ret)
+			return -ret;
+		while (!(ret = ibv_poll_cq(src.cq.cq, 1, &wc)) && --retries)
+			;
+		if (ret < 0)
+			return -EIO;
+		if (!ret)
+			return -ETIMEDOUT;
+		status = wc.status;
+		return wc.status ? -EIO : 0;
+	}
+
+	/* no gtest asserts off the test thread, errors go to err */
+	void run() {
+		err = 0;
+		status = IBV_WC_SUCCESS;
+		for (size_t i = 0; i < offs.size() && !err; i++) {
+			double t = lat_now();
+
+			err = write(offs[i]);
+			lat.add(lat_now() - t);
+		}
+	}
+
+	static void *worker(void *arg) {
+		((struct odp_storm_worker *)arg)->run();
+		return NULL;
+	}
+};
+
+struct odp_storm : public testing::Test, public ibvt_env {
+	ibvt_ctx ctx;
+	ibvt_pd pd;
+	ibvt_mr_implicit simr;
+	ibvt_mr_implicit dimr;
+	std::vector<struct odp_storm_worker *> workers;
+
+	odp_storm() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		simr(*this, pd, 0),
+		dimr(*this, pd, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE) {}
+
+	void init_workers() {
+		for (int i = 0; i < ODP_STORM_THREADS; i++) {
+			struct odp_storm_worker *w =
+				new odp_storm_worker(*this, ctx, pd);
+
+			workers.push_back(w);
+			EXECL(w->src.init());
+			EXECL(w->dst.init());
+			EXECL(w->src.qp.connect(&w->dst.qp));
+			EXECL(w->dst.qp.connect(&w->src.qp));
+		}
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		INIT(ctx.init_debugfs());
+		INIT(simr.init());
+		INIT(dimr.init());
+		INIT(init_workers());
+	}
+
+	virtual void TearDown() {
+		for (size_t i = 0; i < workers.size(); i++)
+			delete workers[i];
+		ASSERT_FALSE(HasFailure());
+	}
+
+	void storm(int n, bool overlap) {
+		size_t span = (overlap ? 1 : n) * ODP_STORM_PAGES * PAGE;
+		ibvt_sub_mr src(simr, 0, span);
+		ibvt_sub_mr dst(dimr, 0, span);
+		ibvt_lat all(n * ODP_STORM_PAGES);
+		int started, ret = 0;
+		double usec;
+
+		EXECL(src.fill());
+		EXECL(dst.init());
+
+		for (int k = 0; k < n; k++) {
+			struct odp_storm_worker *w = workers[k];
+			unsigned int seed = k + 1;
+
+			w->msrc = &src;
+			w->mdst = &dst;
+			w->lat.clear();
+			w->offs.clear();
+			for (int i = 0; i < ODP_STORM_PAGES; i++)
+				w->offs.push_back(((overlap ? 0 : k) * ODP_STORM_PAGES + i) * PAGE);
+			if (overlap)
+				for (int i = ODP_STORM_PAGES - 1; i > 0; i--)
+					std::swap(w->offs[i], w->offs[rand_r(&seed) % (i + 1)]);
+		}
+
+		usec = lat_now();
+		/* the workers that did start are joined before failing */
+		for (started = 0; started < n; started++)
+			if ((ret = pthread_create(&workers[started]->thread, NULL,
+						  odp_storm_worker::worker,
+						  workers[started])))
+				break;
+		for (int k = 0; k < started; k++)
+			pthread_join(workers[k]->thread, NULL);
+		usec = lat_now() - usec;
+		ASSERT_EQ(0, ret) << "pthread_create";
+		for (int k = 0; k < n; k++)
+			ASSERT_EQ(0, workers[k]->err) << "thread " << k << " "
+				<< ibv_wc_status_str(workers[k]->status);
+
+		for (int k = 0; k < n; k++)
+			for (size_t i = 0; i < workers[k]->lat.count(); i++)
+				all.add(workers[k]->lat.v[i]);
+		ASSERT_EQ(0, memcmp(src.buff, dst.buff, span));
+
+		VERBS_NOTICE("%2d threads %s: %.0f pages/s, fault p50 %.1f "
+			     "p99 %.1f max %.1f usec\n", n,
+			     overlap ? "overlapping" : "disjoint",
+			     n * ODP_STORM_PAGES / usec * 1e6,
+			     all.pct(50), all.pct(99), all.pct(100));
+	}
+};
+
+TEST_F(odp_storm, s0_disjoint) {
+	ODP_CHK_SUT(ODP_STORM_THREADS * ODP_STORM_PAGES * PAGE);
+	for (int n = 1; n <= ODP_STORM_THREADS; n *= 2)
+		EXEC(storm(n, false));
+}
+
+TEST_F(odp_storm, s1_overlapping) {
+	ODP_CHK_SUT(ODP_STORM_PAGES * PAGE);
+	for (int n = 1; n <= ODP_STORM_THREADS; n *= 2)
+		EXEC(storm(n, true));
+}
+
+/*
+ * Invalidation churn: RDMA writes walk the destination page by page while
+ * a second thread replaces chunks of it half a span ahead of the traffic,
+ * so every replacement invalidates pages the device has mapped and the
+ * traffic refaults them on its next lap.
+ */
+
+#define ODP_CHURN_SPAN 0x1000000UL
+#define ODP_CHURN_CHUNK (16 * PAGE)
+#define ODP_CHURN_OPS (1 << 15)
+#define ODP_CHURN_IDLE ((size_t)-ODP_CHURN_SPAN)
+
+enum odp_churn_how {
+	ODP_NO_CHURN = -1,
+	ODP_MUNMAP,
+	ODP_REMAP,
+	ODP_MREMAP,
+};
+
+static const char *odp_churn_str[] = { "munmap", "remap", "mremap" };
+
+template <typename T>
+struct odp_churn : public odp<T> {
+	size_t pos;
+	size_t busy;
+	int stop;
+	int how;
+	int period;
+	long errors;
+	ibvt_lat inval;
+	pthread_t thread;
+
+	odp_churn() : odp<T>(), pos(0), busy(ODP_CHURN_IDLE), stop(0), how(ODP_NO_CHURN),
+		period(0), errors(0), inval(ODP_CHURN_OPS) {}
+
+	void replace(char *p) {
+		const int prot = PROT_READ | PROT_WRITE;
+		const int flags = MAP_PRIVATE | MAP_ANON;
+		void *scratch = NULL, *r;
+		double t;
+
+		if (how == ODP_MREMAP) {
+			scratch = mmap(NULL, ODP_CHURN_CHUNK, prot, flags, -1, 0);
+			if (scratch == MAP_FAILED) {
+				errors++;
+				return;
+			}
+			memset(scratch, 0, ODP_CHURN_CHUNK);
+		}
+
+		t = lat_now();
+		switch (how) {
+		case ODP_MUNMAP:
+			munmap(p, ODP_CHURN_CHUNK);
+			r = mmap(p, ODP_CHURN_CHUNK, prot, flags | MAP_FIXED, -1, 0);
+			break;
+		case ODP_REMAP:
+			r = mmap(p, ODP_CHURN_CHUNK, prot, flags | MAP_FIXED, -1, 0);
+			break;
+		default:
+			r = mremap(scratch, ODP_CHURN_CHUNK, ODP_CHURN_CHUNK,
+				   MREMAP_MAYMOVE | MREMAP_FIXED, p);
+			break;
+		}
+		inval.add(lat_now() - t);
+		if (r != p)
+			errors++;
+	}
+
+	void replace_loop() {
+		char *buff = this->mem().dst().buff;
+
+		while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+			size_t at = __atomic_load_n(&pos, __ATOMIC_RELAXED);
+
+			at = (at + ODP_CHURN_SPAN / 2) % ODP_CHURN_SPAN;
+			at &= ~(ODP_CHURN_CHUNK - 1);
+			/* pairs with traffic(), one of the two sees the other */
+			__atomic_store_n(&busy, at, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&pos, __ATOMIC_SEQ_CST) - at >= ODP_CHURN_CHUNK)
+				replace(buff + at);
+			__atomic_store_n(&busy, ODP_CHURN_IDLE, __ATOMIC_RELEASE);
+			if (period)
+				usleep(period);
+		}
+	}
+
+	static void *churner(void *arg) {
+		((odp_churn<T> *)arg)->replace_loop();
+		return NULL;
+	}
+
+	/* returns the pages moved, ops near the churned chunk are skipped */
+	long traffic(ibvt_lat *ops) {
+		long moved = 0;
+
+		for (int i = 0; i < ODP_CHURN_OPS; i++) {
+			size_t off = (size_t)i * PAGE % ODP_CHURN_SPAN;
+			double t = lat_now();
+
+			__atomic_store_n(&pos, off, __ATOMIC_SEQ_CST);
+			/* a descheduled churner can leave a hole this far behind */
+			if (off - __atomic_load_n(&busy, __ATOMIC_SEQ_CST) < ODP_CHURN_CHUNK)
+				continue;
+			this->xfer(off, PAGE);
+			if (ops)
+				ops->add(lat_now() - t);
+			if (this->HasFatalFailure())
+				break;
+			moved++;
+		}
+		return moved;
+	}
+
+	/* returns MB/s */
+	double churn(int h, int p, double base) {
+		ibvt_lat ops(ODP_CHURN_OPS);
+		bool churning = h != ODP_NO_CHURN;
+		double usec, mbps;
+		long moved;
+
+		how = h;
+		period = p;
+		stop = 0;
+		errors = 0;
+		inval.clear();
+		if (churning && pthread_create(&thread, NULL, churner, this)) {
+			ADD_FAILURE() << "pthread_create";
+			churning = false;
+		}
+
+		usec = lat_now();
+		moved = traffic(&ops);
+		usec = lat_now() - usec;
+
+		__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+		if (churning)
+			pthread_join(thread, NULL);
+
+		mbps = moved * PAGE / usec;
+		if (how == ODP_NO_CHURN)
+			VERBS_NOTICE("no churn: %.1f MB/s, op p99 %.1f max %.1f usec\n",
+				     mbps, ops.pct(99), ops.pct(100));
+		else
+			VERBS_NOTICE("%s every %d usec: %zu invalidations, "
+				     "p50 %.1f p99 %.1f usec, op p99 %.1f max %.1f "
+				     "usec, %.1f MB/s, %.0f%% loss\n",
+				     odp_churn_str[how], period, inval.count(),
+				     inval.pct(50), inval.pct(99), ops.pct(99),
+				     ops.pct(100), mbps, 100 * (1 - mbps / base));
+		EXPECT_EQ(0, errors);
+		return mbps;
+	}
+
+	void bench() {
+		static const int periods[] = { 1000, 100, 10, 0 };
+		double base;
+
+		EXEC(mem().reg(0, 0, ODP_CHURN_SPAN));
+		EXEC(mem().src().fill());
+		EXEC(mem().dst().init());
+		/* fault everything in once */
+		EXEC(traffic(NULL));
+
+		base = churn(ODP_NO_CHURN, 0, 0);
+		for (int h = ODP_MUNMAP; h <= ODP_MREMAP; h++)
+			for (size_t i = 0; i < ARRAY_SIZE(periods); i++)
+				if (!this->HasFatalFailure())
+					churn(h, periods[i], base);
+
+		EXEC(mem().unreg());
+	}
+};
+
+typedef testing::Types<
+#ifdef HAVE_LINUX_USERFAULTFD_H
+	types<odp_soft_explicit, odp_soft, odp_rdma_write>,
+	types<odp_soft_implicit, odp_soft, odp_rdma_write>,
+#endif
+	types<odp_explicit, odp_rc, odp_rdma_write>,
+	types<odp_implicit, odp_rc, odp_rdma_write>
+> odp_env_list_churn;
+
+TYPED_TEST_CASE(odp_churn, odp_env_list_churn);
+
+TYPED_TEST(odp_churn, c0_invalidate) {
+	ODP_CHK_SUT(ODP_CHURN_SPAN);
+	EXEC(bench());
+}
+
+/*
+ * Reclaim and refault: a resident working set is pushed out with madvise()
+ * and moved again, the first pass after the reclaim takes the refaults.
+ * MADV_PAGEOUT keeps the contents (it needs swap to push anonymous pages
+ * out), MADV_DONTNEED drops them, so it is only applied to the
+ * destination which is rewritten anyway.
+ *
+ * With IBV_ODP_MEMCG=<cgroup v2 directory> the process is moved into that
+ * cgroup with memory.max below the working set for m1_memcg, so the
+ * passes keep refaulting pages the kernel reclaimed under pressure.
+ */
+
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+#define ODP_RECLAIM_SPAN 0x4000000UL
+#define ODP_RECLAIM_CHUNK (16 * PAGE)
+#define ODP_RECLAIM_PASSES 4
+
+struct odp_memcg {
+	char dir[PATH_MAX];
+	char orig[PATH_MAX];
+	/* memory.max of dir before enter(), put back by leave() */
+	char old_max[64];
+	int active;
+
+	odp_memcg() : active(0) {}
+
+	static int file_path(char *path, const char *dir, const char *file) {
+		if (snprintf(path, PATH_MAX, "%s/%s", dir, file) >= PATH_MAX)
+			return -1;
+		return 0;
+	}
+
+	static int write_file(const char *dir, const char *file, const char *val) {
+		char path[PATH_MAX];
+		FILE *f;
+		int ret;
+
+		if (file_path(path, dir, file))
+			return -1;
+		f = fopen(path, "w");
+		if (!f)
+			return -1;
+		ret = fputs(val, f) < 0;
+		return fclose(f) || ret ? -1 : 0;
+	}
+
+	static int read_file(const char *dir, const char *file, char *val,
+			     int len) {
+		char path[PATH_MAX];
+		FILE *f;
+		int ret;
+
+		if (file_path(path, dir, file))
+			return -1;
+		f = fopen(path, "r");
+		if (!f)
+			return -1;
+		ret = fgets(val, len, f) ? 0 : -1;
+		fclose(f);
+		return ret;
+	}
+
+	int enter(size_t limit) {
+		char buff[PATH_MAX];
+		FILE *f;
+
+		if (!getenv("IBV_ODP_MEMCG"))
+			return -1;
+		if (snprintf(dir, sizeof(dir), "%s",
+			     getenv("IBV_ODP_MEMCG")) >= (int)sizeof(dir))
+			return -1;
+
+		f = fopen("/proc/self/cgroup", "r");
+		if (!f)
+			return -1;
+		/* cgroup v2: "0::/path" */
+		if (fscanf(f, "0::%4000s", buff) != 1) {
+			fclose(f);
+			return -1;
+		}
+		fclose(f);
+		if (snprintf(orig, sizeof(orig), "/sys/fs/cgroup%s",
+			     buff) >= (int)sizeof(orig))
+			return -1;
+
+		if (read_file(dir, "memory.max", old_max, sizeof(old_max)))
+			return -1;
+		snprintf(buff, sizeof(buff), "%zu", limit);
+		if (write_file(dir, "memory.max", buff))
+			return -1;
+		snprintf(buff, sizeof(buff), "%d", getpid());
+		if (write_file(dir, "cgroup.procs", buff)) {
+			write_file(dir, "memory.max", old_max);
+			return -1;
+		}
+		active = 1;
+		return 0;
+	}
+
+	/* -1 when the process could not be moved back */
+	int leave() {
+		char buff[64];
+		int ret;
+
+		if (!active)
+			return 0;
+		snprintf(buff, sizeof(buff), "%d", getpid());
+		ret = write_file(orig, "cgroup.procs", buff);
+		write_file(dir, "memory.max", old_max);
+		active = 0;
+		return ret;
+	}
+
+	~odp_memcg() { leave(); }
+};
+
+template <typename T>
+struct odp_reclaim : public odp<T> {
+	odp_reclaim() : odp<T>() {}
+
+	/* one pass over the span, returns usec */
+	double pass() {
+		double t = lat_now();
+
+		for (size_t off = 0; off < ODP_RECLAIM_SPAN; off += ODP_RECLAIM_CHUNK) {
+			this->xfer(off, ODP_RECLAIM_CHUNK);
+			if (this->HasFatalFailure())
+				break;
+		}
+		return lat_now() - t;
+	}
+
+	void check() {
+		ASSERT_EQ(0, memcmp(this->mem().src().buff, this->mem().dst().buff,
+				    ODP_RECLAIM_SPAN));
+	}
+
+	void reclaim(int advice, const char *name) {
+		char *src = this->mem().src().buff;
+		char *dst = this->mem().dst().buff;
+		struct odp_base::odp_stats before, after;
+		double resident, refault, t;
+
+		resident = pass();
+		EXEC(check());
+		EXEC(check_stats());
+		before = this->stats;
+
+		t = lat_now();
+		if ((advice == MADV_PAGEOUT &&
+		     madvise(src, ODP_RECLAIM_SPAN, advice)) ||
+		    madvise(dst, ODP_RECLAIM_SPAN, advice)) {
+			VERBS_NOTICE("%s: madvise failed, errno %d - skipping\n",
+				     name, errno);
+			return;
+		}
+		t = lat_now() - t;
+		EXEC(check_stats());
+		after = this->stats;
+
+		refault = pass();
+		EXEC(check());
+
+		VERBS_NOTICE("%s: %.0f usec, rss %ld -> %ld pages, odp pages "
+			     "%ld -> %ld\n", name, t, before.rss, after.rss,
+			     before.pages, after.pages);
+		VERBS_NOTICE("  resident %.1f MB/s, refault %.1f MB/s, "
+			     "%.1f usec per chunk\n",
+			     ODP_RECLAIM_SPAN / resident,
+			     ODP_RECLAIM_SPAN / refault,
+			     refault * ODP_RECLAIM_CHUNK / ODP_RECLAIM_SPAN);
+	}
+
+	void reg() {
+		EXEC(mem().reg(0, 0, ODP_RECLAIM_SPAN));
+		EXEC(mem().src().fill());
+		EXEC(mem().dst().init());
+		/* fault everything in once */
+		EXEC(pass());
+	}
+
+	void memcg() {
+		odp_memcg cg;
+		double usec;
+
+		/* source and destination do not fit together */
+		if (cg.enter(ODP_RECLAIM_SPAN)) {
+			VERBS_NOTICE("IBV_ODP_MEMCG not set or not usable - skipping\n");
+			return;
+		}
+		EXEC(check_stats());
+		for (int i = 0; i < ODP_RECLAIM_PASSES; i++) {
+			struct odp_base::odp_stats before = this->stats;
+
+			usec = pass();
+			EXEC(check_stats());
+			VERBS_NOTICE("memcg pass %d: %.1f MB/s, rss %ld -> %ld pages, "
+				     "odp pages %ld -> %ld\n", i,
+				     ODP_RECLAIM_SPAN / usec, before.rss,
+				     this->stats.rss, before.pages,
+				     this->stats.pages);
+		}
+		ASSERT_EQ(0, cg.leave()) << "moving back to " << cg.orig;
+		EXEC(check());
+	}
+};
+
+typedef testing::Types<
+#ifdef HAVE_LINUX_USERFAULTFD_H
+	types<odp_soft_explicit, odp_soft, odp_send>,
+	types<odp_soft_implicit, odp_soft, odp_send>,
+#endif
+	types<odp_explicit, odp_rc, odp_send>,
+	types<odp_explicit, odp_rc, odp_rdma_read>,
+	types<odp_explicit, odp_rc, odp_rdma_write>,
+	types<odp_implicit, odp_rc, odp_send>,
+	types<odp_implicit, odp_rc, odp_rdma_read>,
+	types<odp_implicit, odp_rc, odp_rdma_write>
+> odp_env_list_reclaim;
+
+TYPED_TEST_CASE(odp_reclaim, odp_env_list_reclaim);
+
+TYPED_TEST(odp_reclaim, m0_madvise) {
+	ODP_CHK_SUT(ODP_RECLAIM_SPAN);
+	EXEC(reg());
+	EXEC(reclaim(MADV_PAGEOUT, "MADV_PAGEOUT"));
+	EXEC(reclaim(MADV_DONTNEED, "MADV_DONTNEED"));
+	EXEC(mem().unreg());
+}
+
+TYPED_TEST(odp_reclaim, m1_memcg) {
+	ODP_CHK_SUT(ODP_RECLAIM_SPAN);
+	EXEC(reg());
+	EXEC(memcg());
+	EXEC(mem().unreg());
+}
+
+#ifdef HAVE_PREFETCH
+/*
+ * Look-ahead prefetch against no prefetch and against odp_prefetch, which
+ * prefetches the whole MR at registration, on odp_long sized buffers.
+ * The time includes the registration since that is where the full
+ * prefetch pays.
+ */
+
+#define ODP_PF_LEN 0xe0000000UL
+#define ODP_PF_CHUNKS 0x100
+
+template <typename T>
+struct odp_pf : public odp<T> {
+	odp_pf() : odp<T>() {}
+
+	void pf_run(bool ahead) {
+		const char *mode = testing::UnitTest::GetInstance()->
+			current_test_info()->type_param();
+		odp_lookahead la;
+		double usec = lat_now();
+
+		this->lookahead = ahead ? &la : NULL;
+		EXEC(test_stream(0, 0, ODP_PF_LEN, ODP_PF_CHUNKS, 1));
+		this->lookahead = NULL;
+		usec = lat_now() - usec;
+
+		VERBS_NOTICE("%s %s: %.1f MB/s with registration, "
+			     "%ld advise calls, depth %d\n", mode,
+			     ahead ? "look-ahead" : "no look-ahead",
+			     ODP_PF_LEN / usec, la.calls, la.depth);
+	}
+};
+
+typedef testing::Types<
+	types<odp_explicit, odp_rc, odp_send>,
+	types<odp_explicit, odp_rc, odp_rdma_write>,
+	types<odp_implicit, odp_rc, odp_send>,
+	types<odp_implicit, odp_rc, odp_rdma_write>,
+	types<odp_prefetch, odp_rc, odp_send>,
+	types<odp_prefetch, odp_rc, odp_rdma_write>
+> odp_env_list_pf;
+
+TYPED_TEST_CASE(odp_pf, odp_env_list_pf);
+
+TYPED_TEST(odp_pf, p0_lookahead) {
+	ODP_CHK_SUT(ODP_PF_LEN);
+	EXEC(pf_run(false));
+	EXEC(pf_run(true));
+}
+#endif
+
+/*
+ * Anonymous, shared anonymous, tmpfs file and memfd backed MRs, pinned
+ * and ODP: registration (map, zero and register both MRs), first pass
+ * over the span in chunks, which takes the faults where there are any,
+ * and a second, steady state pass.
+ */
+
+#define ODP_FILE_SPAN 0x4000000UL
+#define ODP_FILE_CHUNK (16 * PAGE)
+
+template <typename T>
+struct odp_file : public odp<T> {
+	odp_file() : odp<T>() {}
+
+	void file_pass(ibvt_lat &lat) {
+		for (size_t off = 0; off < ODP_FILE_SPAN; off += ODP_FILE_CHUNK) {
+			double t = lat_now();
+
+			this->xfer(off, ODP_FILE_CHUNK);
+			lat.add(lat_now() - t);
+			if (this->HasFatalFailure())
+				return;
+		}
+	}
+
+	void file_bench() {
+		const char *mode = testing::UnitTest::GetInstance()->
+			current_test_info()->type_param();
+		ibvt_lat first, steady;
+		size_t bad;
+		double reg;
+
+		reg = lat_now();
+		EXEC(mem().reg(0, 0, ODP_FILE_SPAN));
+		EXEC(mem().src().init());
+		EXEC(mem().dst().init());
+		reg = lat_now() - reg;
+
+		odp_pattern_fill(this->mem().src().buff, 0, ODP_FILE_SPAN);
+		EXEC(file_pass(first));
+		EXEC(file_pass(steady));
+		bad = odp_pattern_check(this->mem().dst().buff, 0, ODP_FILE_SPAN);
+		ASSERT_EQ(ODP_FILE_SPAN, bad) << "i=" << bad;
+
+		VERBS_NOTICE("%s: registration %.0f usec, first %.1f MB/s "
+			     "(chunk p50 %.1f p99 %.1f usec), steady %.1f MB/s\n",
+			     mode, reg, ODP_FILE_SPAN / first.total,
+			     first.pct(50), first.pct(99),
+			     ODP_FILE_SPAN / steady.total);
+		EXEC(mem().unreg());
+	}
+};
+
+typedef testing::Types<
+	types<odp_off, odp_rc, odp_rdma_write>,
+	types<odp_off_shared, odp_rc, odp_rdma_write>,
+	types<odp_off_tmpfs, odp_rc, odp_rdma_write>,
+#ifdef HAVE_MEMFD_CREATE
+	types<odp_off_memfd, odp_rc, odp_rdma_write>,
+#endif
+	types<odp_explicit, odp_rc, odp_rdma_write>,
+	types<odp_explicit_shared, odp_rc, odp_rdma_write>,
+	types<odp_explicit_tmpfs, odp_rc, odp_rdma_write>,
+#ifdef HAVE_MEMFD_CREATE
+	types<odp_explicit_memfd, odp_rc, odp_rdma_write>,
+#endif
+	types<odp_off, odp_rc, odp_rdma_read>,
+	types<odp_off_shared, odp_rc, odp_rdma_read>,
+	types<odp_off_tmpfs, odp_rc, odp_rdma_read>,
+#ifdef HAVE_MEMFD_CREATE
+	types<odp_off_memfd, odp_rc, odp_rdma_read>,
+#endif
+	types<odp_explicit, odp_rc, odp_rdma_read>,
+	types<odp_explicit_shared, odp_rc, odp_rdma_read>,
+#ifdef HAVE_MEMFD_CREATE
+	types<odp_explicit_memfd, odp_rc, odp_rdma_read>,
+#endif
+	types<odp_explicit_tmpfs, odp_rc, odp_rdma_read>
+> odp_env_list_file;
+
+TYPED_TEST_CASE(odp_file, odp_env_list_file);
+
+TYPED_TEST(odp_file, f0_backing) {
+	ODP_CHK_SUT(ODP_FILE_SPAN);
+	EXEC(file_bench());
+}
@@ -0,0 +1,1145 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __ODP_H_
+#define __ODP_H_
+
+#include <sys/mman.h>
+#include <deque>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+#include "stats.h"
+
+#ifdef __x86_64__
+
+#define PAGE 0x1000
+#define UP (1ULL<<47)
+
+#elif (__ppc64__|__PPC64__)
+
+#define PAGE 0x10000
+#define UP (1ULL<<46)
+
+#endif
+
+#include "soft.h"
+
+#if HAVE_DECL_IBV_PREFETCH_MR
+#define HAVE_PREFETCH
+#define IBV_EXP_PREFETCH_WRITE_ACCESS 0
+#elif HAVE_DECL_IBV_EXP_PREFETCH_MR
+#define HAVE_PREFETCH
+#define ibv_prefetch_attr ibv_exp_prefetch_attr
+#define ibv_prefetch_mr ibv_exp_prefetch_mr
+#elif HAVE_DECL_IBV_ADVISE_MR
+#define HAVE_PREFETCH
+#define HAVE_ADVISE
+#endif
+
+/*
+ * Prefetches part of an ODP MR. Asynchronous unless sync is set, where the
+ * interface allows it: ibv_advise_mr() without IBV_ADVISE_MR_FLAG_FLUSH
+ * only queues the work, the older prefetch calls always wait.
+ */
+static inline int odp_advise(ibvt_mr &m, size_t off, size_t len, bool sync)
+{
+#if defined(HAVE_ADVISE)
+	while (len) {
+		struct ibv_sge sge;
+		int ret;
+
+		sge.addr = (uintptr_t)m.buff + off;
+		sge.length = std::min(len, (size_t)1 << 30);
+		sge.lkey = m.mr->lkey;
+		ret = ibv_advise_mr(m.pd.pd, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE,
+				    sync ? IBV_ADVISE_MR_FLAG_FLUSH : 0, &sge, 1);
+		if (ret)
+			return ret;
+		off += sge.length;
+		len -= sge.length;
+	}
+	return 0;
+#elif defined(HAVE_PREFETCH)
+	struct ibv_prefetch_attr attr;
+
+	attr.flags = IBV_EXP_PREFETCH_WRITE_ACCESS;
+	attr.addr = m.buff + off;
+	attr.length = len;
+	attr.comp_mask = 0;
+	return ibv_prefetch_mr(m.mr, &attr);
+#else
+	return ENOSYS;
+#endif
+}
+
+#define ODP_LOOKAHEAD_MAX 32
+
+/*
+ * Look-ahead prefetch for streaming transfers: once chunk k is posted,
+ * chunks up to k + depth are advised asynchronously. The depth follows
+ * how long a chunk takes to complete compared to the fastest one seen,
+ * which is the cost without faults: a slow chunk means the faults are
+ * still exposed and the depth doubles, a chunk close to the fastest one
+ * means the prefetch is far enough ahead and the depth backs off by one.
+ */
+struct odp_lookahead {
+	int depth;
+	int max_depth;
+	int next;
+	long calls;
+	double fastest;
+
+	odp_lookahead(int max = ODP_LOOKAHEAD_MAX) :
+		depth(1), max_depth(max), next(0), calls(0), fastest(0) {}
+
+	int advance(ibvt_mr &src, ibvt_mr &dst, size_t chunk, int k, int count) {
+		if (next <= k)
+			next = k + 1;
+		for (; next <= k + depth && next < count; next++) {
+			int ret = odp_advise(src, chunk * next, chunk, false) ||
+				  odp_advise(dst, chunk * next, chunk, false);
+
+			calls += 2;
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	void update(double usec) {
+		if (!fastest || usec < fastest)
+			fastest = usec;
+		if (usec > 2 * fastest)
+			depth = std::min(depth * 2, max_depth);
+		else if (usec < fastest * 5 / 4 && depth > 1)
+			depth--;
+	}
+};
+
+#define ODP_WINDOW 8
+
+/* chunks in flight for the streaming tests, IBV_ODP_WINDOW overrides */
+static inline int odp_window()
+{
+	return getenv("IBV_ODP_WINDOW") ? atoi(getenv("IBV_ODP_WINDOW")) : ODP_WINDOW;
+}
+
+/*
+ * The ibvt_mr::fill() pattern, byte i of a buffer is i & 0xff, for any
+ * part of the buffer. Both copy from a table in 256 byte pieces.
+ */
+static inline const char *odp_pattern(size_t off)
+{
+	static char table[512];
+
+	if (!table[1])
+		for (int i = 0; i < 512; i++)
+			table[i] = i & 0xff;
+	return table + (off & 0xff);
+}
+
+static inline void odp_pattern_fill(char *p, size_t off, size_t len)
+{
+	while (len) {
+		size_t n = std::min(len, (size_t)0x100);
+
+		memcpy(p, odp_pattern(off), n);
+		p += n;
+		off += n;
+		len -= n;
+	}
+}
+
+/* returns the index of the first byte off the pattern, len if none */
+static inline size_t odp_pattern_check(const char *p, size_t off, size_t len)
+{
+	for (size_t i = 0; i < len; ) {
+		size_t n = std::min(len - i, (size_t)0x100);
+
+		if (memcmp(p + i, odp_pattern(off + i), n))
+			for (size_t j = 0; j < n; j++)
+				if (p[i + j] != odp_pattern(off + i + j)[0])
+					return i + j;
+		i += n;
+	}
+	return len;
+}
+
+struct ibvt_mr_implicit : public ibvt_mr {
+	ibvt_mr_implicit(ibvt_env &e, ibvt_pd &p, long a) :
+		ibvt_mr(e, p, 0, 0, a) {}
+
+	virtual void init() {
+		EXEC(pd.init());
+		SET(mr, ibv_reg_mr(pd.pd, 0, UINT64_MAX, IBV_ACCESS_ON_DEMAND | access_flags));
+		if (mr)
+			VERBS_TRACE("\t\t\t\t\tibv_reg_mr(pd, 0, 0, %lx) = %x\n", access_flags, mr->lkey);
+	}
+};
+
+#ifdef HAVE_PREFETCH
+struct ibvt_mr_pf : public ibvt_mr {
+	ibvt_mr_pf(ibvt_env &e, ibvt_pd &p, size_t s, intptr_t a, long af) :
+		ibvt_mr(e, p, s, a, af) {}
+
+	virtual void init() {
+		EXEC(ibvt_mr::init());
+		DO(odp_advise(*this, 0, size, true));
+	}
+};
+#endif
+
+#if HAVE_DECL_IBV_ACCESS_HUGETLB
+struct ibvt_mr_hp : public ibvt_mr {
+	ibvt_mr_hp(ibvt_env &e, ibvt_pd &p, size_t s, intptr_t a, long af) :
+		ibvt_mr(e, p, s, a, af | IBV_ACCESS_HUGETLB) {}
+
+	virtual int mmap_flags() {
+		return MAP_PRIVATE|MAP_ANON|MAP_HUGETLB;
+	}
+};
+#endif
+
+struct ibvt_sub_mr : public ibvt_mr {
+	ibvt_mr_implicit &master;
+
+	ibvt_sub_mr(ibvt_mr_implicit &i, intptr_t a, size_t size) :
+		ibvt_mr(i.env, i.pd, size, a), master(i) {}
+
+	virtual void init() {
+		int flags = MAP_PRIVATE|MAP_ANON;
+		if (addr)
+			flags |= MAP_FIXED;
+		mr = master.mr;
+		buff = (char*)mmap((void*)addr, size, PROT_READ|PROT_WRITE, flags, -1, 0);
+		ASSERT_NE(buff, MAP_FAILED);
+	}
+
+	virtual ~ibvt_sub_mr() {
+		mr = NULL;
+	}
+};
+
+#ifdef HAVE_MEMFD_CREATE
+#define ODP_PATTERN_BLOCK 0x200000
+
+/*
+ * Maps one memfd block holding the fill pattern again and again over size
+ * bytes, so a source of any size takes a single block of RAM. The block
+ * is a multiple of the 256 byte pattern period, so every copy lines up
+ * with odp_pattern() at its own offset.
+ */
+static inline char *odp_pattern_map(intptr_t addr, size_t size, int flags)
+{
+	size_t block = std::min(size, (size_t)ODP_PATTERN_BLOCK);
+	char *buff = (char *)MAP_FAILED;
+	int fd = memfd_create("ibvt_pattern", 0);
+
+	if (fd < 0)
+		return buff;
+	if (!ftruncate(fd, block))
+		buff = (char *)mmap((void *)addr, size, PROT_NONE,
+				    flags|MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+	for (size_t off = 0; buff != MAP_FAILED && off < size; off += block) {
+		if (mmap(buff + off, std::min(block, size - off),
+			 PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+			 fd, 0) != MAP_FAILED)
+			continue;
+		munmap(buff, size);
+		buff = (char *)MAP_FAILED;
+	}
+	close(fd);
+	if (buff != MAP_FAILED)
+		odp_pattern_fill(buff, 0, block);
+	return buff;
+}
+
+/* read-only source, every write shows up in all the copies of the block */
+struct ibvt_mr_pattern : public ibvt_mr {
+	ibvt_mr_pattern(ibvt_env &e, ibvt_pd &p, size_t s, intptr_t a, long af) :
+		ibvt_mr(e, p, s, a, af) {}
+
+	virtual void init() {
+		if (mr)
+			return;
+		EXEC(pd.init());
+		buff = odp_pattern_map(addr, size, 0);
+		ASSERT_NE(buff, MAP_FAILED) << "errno: " << errno;
+		SET(mr, ibv_reg_mr(pd.pd, buff, size, access_flags));
+		VERBS_TRACE("\t\t\t\tibv_reg_mr(pd, %p, %zx, %lx) = %x\n", buff, size, access_flags, mr->lkey);
+	}
+
+	virtual void fill() {
+		EXEC(init());
+	}
+};
+
+struct ibvt_sub_mr_pattern : public ibvt_sub_mr {
+	ibvt_sub_mr_pattern(ibvt_mr_implicit &i, intptr_t a, size_t size) :
+		ibvt_sub_mr(i, a, size) {}
+
+	virtual void init() {
+		mr = master.mr;
+		buff = odp_pattern_map(addr, size, addr ? MAP_FIXED : 0);
+		ASSERT_NE(buff, MAP_FAILED) << "errno: " << errno;
+	}
+
+	virtual void fill() {
+		EXEC(init());
+	}
+};
+#endif
+
+struct odp_side : public ibvt_obj {
+	ibvt_ctx &ctx;
+	ibvt_pd &pd;
+	int access_flags;
+
+	odp_side(ibvt_env &e, ibvt_ctx &c, ibvt_pd &p, int a) :
+		ibvt_obj(e),
+		ctx(c),
+		pd(p),
+		access_flags(a) {}
+
+	virtual ibvt_qp &get_qp() = 0;
+};
+
+template<typename QP>
+struct odp_side_qp : public odp_side {
+	ibvt_cq cq;
+	QP qp;
+
+	odp_side_qp(ibvt_env &e, ibvt_ctx &c, ibvt_pd &p, int a) :
+		odp_side(e, c, p, a),
+		cq(e, ctx),
+		qp(e, pd, cq) {}
+
+	virtual void init() {
+		EXEC(qp.init());
+	}
+
+	virtual ibvt_qp &get_qp() { return qp; }
+};
+
+struct odp_mem : public ibvt_obj {
+	odp_side &ssrc;
+	odp_side &sdst;
+
+	ibvt_mr *psrc;
+	ibvt_mr *pdst;
+
+	odp_mem(odp_side &s, odp_side &d) : ibvt_obj(s.env), ssrc(s), sdst(d), psrc(NULL), pdst(NULL) {}
+
+	virtual void init() {}
+	virtual void reg(unsigned long src_addr, unsigned long dst_addr, size_t len) = 0;
+	virtual ibvt_mr &src() { return *psrc; }
+	virtual ibvt_mr &dst() { return *pdst; }
+	/* writes the pattern of the source bytes at off */
+	virtual void fill_src(size_t off, size_t len) {
+		odp_pattern_fill(psrc->buff + off, off, len);
+	}
+	/* RAM taken by moving len bytes */
+	virtual size_t ram(size_t len) { return len * 3; }
+	virtual void unreg() {
+		if (psrc)
+			delete psrc;
+		if (pdst)
+			delete pdst;
+	}
+};
+
+struct odp_trans : public ibvt_obj {
+	odp_trans(ibvt_env &e) : ibvt_obj(e) {}
+
+	virtual void send(ibv_sge sge) = 0;
+	virtual void recv(ibv_sge sge) = 0;
+	virtual void rdma_src(ibv_sge src_sge, ibv_sge dst_sge, enum ibv_wr_opcode opcode) {}
+	virtual void rdma_dst(ibv_sge src_sge, ibv_sge dst_sge, enum ibv_wr_opcode opcode) {}
+	virtual void poll_src() = 0;
+	virtual void poll_dst() = 0;
+	/* set when the transfers bypass ctx, odp_stats/ come from soft_stat() */
+	virtual bool soft() { return false; }
+	virtual long soft_stat(const char *var) { return -1; }
+};
+
+struct odp_base : public testing::Test, public ibvt_env {
+	ibvt_ctx ctx;
+	ibvt_pd pd;
+	int src_access_flags;
+	int dst_access_flags;
+
+	odp_base(int s, int d) :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		src_access_flags(s),
+		dst_access_flags(d),
+		lookahead(NULL) {}
+
+	/* prefetch policy of stream(), none when NULL */
+	struct odp_lookahead *lookahead;
+
+	/* last values seen by check_stats(), -1 when not exposed */
+	struct odp_stats {
+		long mrs;
+		long pages;
+		long rss;
+	} stats;
+
+	long stat(const char *var) {
+		char path[PATH_MAX];
+
+		if (trans().soft())
+			return trans().soft_stat(var);
+		snprintf(path, sizeof(path), "odp_stats/%s", var);
+		return ctx.read_debugfs(path);
+	}
+
+	long rss_pages() {
+		long size, rss;
+		FILE *f = fopen("/proc/self/statm", "r");
+
+		if (!f)
+			return -1;
+		if (fscanf(f, "%ld %ld", &size, &rss) != 2)
+			rss = -1;
+		fclose(f);
+		return rss;
+	}
+
+	/* samples the page counters, negative values are not checked */
+	void check_stats(long mrs = -1, long pages = -1) {
+		stats.mrs = stat("num_odp_mrs");
+		stats.pages = stat("num_odp_mr_pages");
+		stats.rss = rss_pages();
+		if (mrs >= 0 && stats.mrs >= 0) {
+			ASSERT_EQ(mrs, stats.mrs) << "num_odp_mrs";
+		}
+		if (pages >= 0 && stats.pages >= 0) {
+			ASSERT_EQ(pages, stats.pages) << "num_odp_mr_pages";
+		}
+	}
+
+	virtual odp_mem &mem() = 0;
+	virtual odp_trans &trans() = 0;
+	/* starts moving len bytes at offset off from src() to dst() */
+	virtual void post(size_t off, size_t len) = 0;
+	/* waits for the oldest posted transfer */
+	virtual void wait() = 0;
+	virtual void test(unsigned long src, unsigned long dst, size_t len, int count = 1) = 0;
+
+	void xfer(size_t off, size_t len) {
+		EXEC(post(off, len));
+		EXEC(wait());
+	}
+
+	/*
+	 * Streaming engine: keeps up to window chunks in flight, fills the
+	 * source of the next chunk while the posted ones transfer and checks
+	 * each chunk as soon as it completes, so the CPU work overlaps the
+	 * transfers instead of bracketing them.
+	 */
+	void stream(size_t len, int count, int window) {
+		char *dst = mem().dst().buff;
+		size_t chunk = len / count;
+		int posted = 0, done = 0;
+		double usec = lat_now(), t;
+
+		while (done < count) {
+			if (posted < count && posted - done < window) {
+				size_t off = chunk * posted++;
+
+				mem().fill_src(off, chunk);
+				EXEC(post(off, chunk));
+				if (lookahead)
+					DO(lookahead->advance(mem().src(), mem().dst(),
+							      chunk, posted - 1, count));
+				continue;
+			}
+			t = lat_now();
+			EXEC(wait());
+			if (lookahead)
+				lookahead->update(lat_now() - t);
+
+			size_t off = chunk * done++;
+			size_t bad = odp_pattern_check(dst + off, off, chunk);
+
+			ASSERT_EQ(chunk, bad) << "i=" << off + bad;
+		}
+		usec = lat_now() - usec;
+		VERBS_NOTICE("%d x %zu bytes, window %d: %.1f MB/s\n",
+			     count, chunk, window, len / usec);
+	}
+
+	void test_stream(unsigned long src, unsigned long dst, size_t len,
+			 int count, int window) {
+		EXEC(mem().reg(src, dst, len));
+		EXEC(mem().src().init());
+		EXEC(mem().dst().init());
+
+		EXEC(check_stats(2, 0));
+		EXEC(stream(len, count, window));
+		EXEC(check_stats(2, len / 0x1000 * 2));
+		EXEC(mem().unreg());
+	}
+
+	virtual void init() {
+		if (!trans().soft()) {
+			INIT(ctx.init());
+			INIT(ctx.init_debugfs());
+		}
+		INIT(check_stats(0, 0));
+	}
+
+	virtual void SetUp() {
+		INIT(init());
+	}
+
+	virtual void TearDown() {
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+template<typename QP>
+struct odp_qp : public odp_trans {
+	ibvt_ctx &ctx;
+	ibvt_pd &pd;
+	odp_side_qp<QP> src;
+	odp_side_qp<QP> dst;
+
+	odp_qp(odp_base &e) :
+		odp_trans(e),
+		ctx(e.ctx),
+		pd(e.pd),
+		src(e, e.ctx, e.pd, e.src_access_flags),
+		dst(e, e.ctx, e.pd, e.dst_access_flags) {}
+
+	virtual void init() {
+		INIT(src.init());
+		INIT(dst.init());
+		INIT(src.qp.connect(&dst.qp));
+		INIT(dst.qp.connect(&src.qp));
+	}
+
+	virtual void send(ibv_sge sge) { src.qp.send(sge); }
+	virtual void recv(ibv_sge sge) { dst.qp.recv(sge); }
+	virtual void rdma_src(ibv_sge src_sge, ibv_sge dst_sge,
+			      enum ibv_wr_opcode opcode) {
+		src.qp.rdma(src_sge, dst_sge, opcode);
+	}
+	virtual void rdma_dst(ibv_sge src_sge, ibv_sge dst_sge,
+			      enum ibv_wr_opcode opcode) {
+		dst.qp.rdma(src_sge, dst_sge, opcode);
+	}
+	virtual void poll_src() { src.cq.poll(1); }
+	virtual void poll_dst() { dst.cq.poll(1); }
+};
+
+typedef odp_qp<ibvt_qp_rc> odp_rc;
+
+#ifdef HAVE_INFINIBAND_VERBS_EXP_H
+struct odp_side_dci : public odp_side {
+	ibvt_cq cq;
+	ibvt_qp_dc qp;
+
+	odp_side_dci(ibvt_env &e, ibvt_ctx &c, ibvt_pd &p, int a) :
+		odp_side(e, c, p, a),
+		cq(e, ctx),
+		qp(e, pd, cq) {}
+
+	virtual void init() {
+		EXEC(qp.init());
+	}
+
+	virtual ibvt_qp &get_qp() { return qp; }
+};
+
+struct odp_side_dct : public odp_side {
+	ibvt_cq cq;
+	ibvt_srq srq;
+	ibvt_dct dct;
+	ibvt_qp_rc _qp;
+
+	odp_side_dct(ibvt_env &e, ibvt_ctx &c, ibvt_pd &p, int a) :
+		odp_side(e, c, p, a),
+		cq(e, ctx),
+		srq(e, pd, cq),
+		dct(e, pd, cq, srq),
+		_qp(e, p, cq) {}
+
+	virtual void init() {
+		EXEC(dct.init());
+	}
+
+	virtual ibvt_qp &get_qp() { return _qp; }
+};
+
+struct odp_dc : public odp_trans {
+	ibvt_ctx &ctx;
+	ibvt_pd &pd;
+	odp_side_dci src;
+	odp_side_dct dst;
+
+	odp_dc(odp_base &e) :
+		odp_trans(e),
+		ctx(e.ctx),
+		pd(e.pd),
+		src(e, e.ctx, e.pd, e.src_access_flags),
+		dst(e, e.ctx, e.pd, e.dst_access_flags) {}
+
+	virtual void init() {
+		INIT(src.init());
+		INIT(dst.init());
+		INIT(src.qp.connect(&dst.dct));
+	}
+
+	virtual void send(ibv_sge sge) { src.qp.send(sge); }
+	virtual void recv(ibv_sge sge) { dst.srq.recv(sge); }
+	virtual void rdma_src(ibv_sge src_sge, ibv_sge dst_sge,
+			      enum ibv_wr_opcode opcode) {
+		src.qp.rdma(src_sge, dst_sge, opcode);
+	}
+	virtual void rdma_dst(ibv_sge src_sge, ibv_sge dst_sge,
+			      enum ibv_wr_opcode opcode) {
+		FAIL();
+	}
+	virtual void poll_src() { src.cq.poll(1); }
+	virtual void poll_dst() { dst.cq.poll(1); }
+
+};
+#endif
+
+struct odp_off : public odp_mem {
+	odp_off(odp_side &s, odp_side &d) : odp_mem(s, d) {}
+
+	virtual void reg(unsigned long src_addr, unsigned long dst_addr, size_t len) {
+		SET(psrc, new ibvt_mr(ssrc.env, ssrc.pd, len, src_addr, ssrc.access_flags));
+		SET(pdst, new ibvt_mr(sdst.env, sdst.pd, len, dst_addr, sdst.access_flags));
+	}
+
+};
+
+struct odp_explicit : public odp_mem {
+	odp_explicit(odp_side &s, odp_side &d) : odp_mem(s, d) {}
+
+	virtual void reg(unsigned long src_addr, unsigned long dst_addr, size_t len) {
+		SET(psrc, new ibvt_mr(ssrc.env, ssrc.pd, len, src_addr, ssrc.access_flags | IBV_ACCESS_ON_DEMAND));
+		SET(pdst, new ibvt_mr(sdst.env, sdst.pd, len, dst_addr, sdst.access_flags | IBV_ACCESS_ON_DEMAND));
+	}
+};
+
+#ifdef HAVE_PREFETCH
+struct odp_prefetch : public odp_mem {
+	odp_prefetch(odp_side &s, odp_side &d) : odp_mem(s, d) {}
+
+	virtual void reg(unsigned long src_addr, unsigned long dst_addr, size_t len) {
+		SET(psrc, new ibvt_mr_pf(ssrc.env, ssrc.pd, len, src_addr, ssrc.access_flags | IBV_ACCESS_ON_DEMAND));
+		SET(pdst, new ibvt_mr_pf(sdst.env, sdst.pd, len, dst_addr, sdst.access_flags | IBV_ACCESS_ON_DEMAND));
+	}
+};
+#endif
+
+
+#if HAVE_DECL_IBV_ACCESS_HUGETLB
+struct odp_hugetlb : public odp_mem {
+	odp_hugetlb(odp_side &s, odp_side &d) : odp_mem(s, d) {}
+
+	virtual void reg(unsigned long src_addr, unsigned long dst_addr, size_t len) {
+		SET(psrc, new ibvt_mr_hp(ssrc.env, ssrc.pd, len, src_addr, ssrc.access_flags | IBV_ACCESS_ON_DEMAND));
+		SET(pdst, new ibvt_mr_hp(sdst.env, sdst.pd, len, dst_addr, sdst.access_flags | IBV_ACCESS_ON_DEMAND));
+	}
+};
+#endif
+
+/* pinned (odp = 0) or explicit ODP MRs of type MR */
+template <typename MR, int odp>
+struct odp_backed : public odp_mem {
+	odp_backed(odp_side &s, odp_side &d) : odp_mem(s, d) {}
+
+	virtual void reg(unsigned long src_addr, unsigned long dst_addr, size_t len) {
+		SET(psrc, new MR(ssrc.env, ssrc.pd, len, src_addr, ssrc.access_flags | odp));
+		SET(pdst, new MR(sdst.env, sdst.pd, len, dst_addr, sdst.access_flags | odp));
+	}
+};
+
+typedef odp_backed<ibvt_mr_shared, 0> odp_off_shared;
+typedef odp_backed<ibvt_mr_shared, IBV_ACCESS_ON_DEMAND> odp_explicit_shared;
+typedef odp_backed<ibvt_mr_file, 0> odp_off_tmpfs;
+typedef odp_backed<ibvt_mr_file, IBV_ACCESS_ON_DEMAND> odp_explicit_tmpfs;
+#ifdef HAVE_MEMFD_CREATE
+typedef odp_backed<ibvt_mr_memfd, 0> odp_off_memfd;
+typedef odp_backed<ibvt_mr_memfd, IBV_ACCESS_ON_DEMAND> odp_explicit_memfd;
+#endif
+
+struct odp_implicit : public odp_mem {
+	ibvt_mr_implicit simr;
+	ibvt_mr_implicit dimr;
+	odp_implicit(odp_side &s, odp_side &d) : odp_mem(s, d),
+		simr(s.env, s.pd, s.access_flags),
+		dimr(d.env, d.pd, d.access_flags) {}
+
+	virtual void reg(unsigned long src_addr, unsigned long dst_addr, size_t len) {
+		SET(psrc, new ibvt_sub_mr(simr, src_addr, len));
+		SET(pdst, new ibvt_sub_mr(dimr, dst_addr, len));
+	}
+	virtual void init() {
+		simr.init();
+		dimr.init();
+	}
+};
+
+#ifdef HAVE_MEMFD_CREATE
+/*
+ * MEM with the source swapped for the repeating pattern mapping, so moving
+ * len bytes needs RAM for the destination only.
+ */
+template <typename MEM>
+struct odp_pattern_src : public MEM {
+	odp_pattern_src(odp_side &s, odp_side &d) : MEM(s, d) {}
+
+	virtual void reg(unsigned long src_addr, unsigned long dst_addr, size_t len) {
+		EXEC(MEM::reg(src_addr, dst_addr, len));
+
+		ibvt_sub_mr *sub = dynamic_cast<ibvt_sub_mr *>(this->psrc);
+		ibvt_mr *src;
+
+		if (sub)
+			src = new ibvt_sub_mr_pattern(sub->master, src_addr, len);
+		else
+			src = new ibvt_mr_pattern(this->ssrc.env, this->ssrc.pd, len,
+						  src_addr, this->psrc->access_flags);
+		delete this->psrc;
+		this->psrc = src;
+	}
+
+	virtual void fill_src(size_t off, size_t len) {}
+	virtual size_t ram(size_t len) { return len + ODP_PATTERN_BLOCK; }
+};
+
+typedef odp_pattern_src<odp_off> odp_off_pattern;
+typedef odp_pattern_src<odp_explicit> odp_explicit_pattern;
+typedef odp_pattern_src<odp_implicit> odp_implicit_pattern;
+#endif
+
+#ifdef HAVE_LINUX_USERFAULTFD_H
+/* ODP MR on odp_soft_dev instead of the HCA */
+struct ibvt_mr_soft : public ibvt_mr {
+	odp_soft_dev &dev;
+	struct ibv_mr smr;
+
+	ibvt_mr_soft(odp_soft_dev &d, ibvt_env &e, ibvt_pd &p, size_t s,
+		     intptr_t a, long af) :
+		ibvt_mr(e, p, s, a, af | IBV_ACCESS_ON_DEMAND), dev(d) {
+		memset(&smr, 0, sizeof(smr));
+	}
+
+	virtual void init() {
+		if (mr)
+			return;
+		buff = (char*)mmap((void*)addr, size, PROT_READ|PROT_WRITE, mmap_flags(), -1, 0);
+		ASSERT_NE(buff, MAP_FAILED) << "errno: " << errno;
+		/* no memset, the pages stay missing until touched */
+		DO(dev.watch(buff, size));
+		smr.addr = buff;
+		smr.length = size;
+		smr.lkey = smr.rkey = dev.reg(buff, size, access_flags);
+		mr = &smr;
+		VERBS_TRACE("\t\t\t\tsoft reg_mr(%p, %zx, %lx) = %x\n", buff, size, access_flags, mr->lkey);
+	}
+
+	virtual ~ibvt_mr_soft() {
+		if (mr)
+			dev.dereg(smr.lkey);
+		mr = NULL;
+	}
+};
+
+struct ibvt_mr_soft_implicit : public ibvt_mr_implicit {
+	odp_soft_dev &dev;
+	struct ibv_mr smr;
+
+	ibvt_mr_soft_implicit(odp_soft_dev &d, ibvt_env &e, ibvt_pd &p, long a) :
+		ibvt_mr_implicit(e, p, a), dev(d) {
+		memset(&smr, 0, sizeof(smr));
+	}
+
+	virtual void init() {
+		if (mr)
+			return;
+		smr.length = UINT64_MAX;
+		smr.lkey = smr.rkey = dev.reg(0, UINT64_MAX, IBV_ACCESS_ON_DEMAND | access_flags);
+		mr = &smr;
+	}
+
+	virtual ~ibvt_mr_soft_implicit() {
+		if (mr)
+			dev.dereg(smr.lkey);
+		mr = NULL;
+	}
+};
+
+/* the mapping is watched, so unmapping it invalidates its device pages */
+struct ibvt_sub_mr_soft : public ibvt_sub_mr {
+	odp_soft_dev &dev;
+
+	ibvt_sub_mr_soft(ibvt_mr_soft_implicit &i, intptr_t a, size_t size) :
+		ibvt_sub_mr(i, a, size), dev(i.dev) {}
+
+	virtual void init() {
+		EXEC(ibvt_sub_mr::init());
+		DO(dev.watch(buff, size));
+	}
+};
+
+/* no QP, the transfers are done in software by odp_soft */
+struct odp_side_soft : public odp_side_qp<ibvt_qp_rc> {
+	odp_soft_dev &dev;
+
+	odp_side_soft(ibvt_env &e, ibvt_ctx &c, ibvt_pd &p, int a, odp_soft_dev &d) :
+		odp_side_qp<ibvt_qp_rc>(e, c, p, a), dev(d) {}
+
+	virtual void init() {}
+};
+
+/*
+ * Transport on odp_soft_dev. Work requests are queued as posted and carried
+ * out in order when their side is polled: every transfer checks the MR
+ * bounds and access rights, takes the device faults and copies the data.
+ */
+struct odp_soft : public odp_trans {
+	struct wr {
+		ibv_sge local;
+		ibv_sge remote;
+		enum ibv_wr_opcode opcode;
+	};
+
+	odp_soft_dev dev;
+	odp_side_soft src;
+	odp_side_soft dst;
+	std::deque<struct wr> sq[2];
+	std::deque<ibv_sge> rq;
+	int cqes[2];
+
+	odp_soft(odp_base &e) :
+		odp_trans(e),
+		dev(e),
+		src(e, e.ctx, e.pd, e.src_access_flags, dev),
+		dst(e, e.ctx, e.pd, e.dst_access_flags, dev) {
+		cqes[0] = cqes[1] = 0;
+	}
+
+	virtual ~odp_soft() {
+		if (dev.fault_pages || dev.uffd_faults)
+			dev.report();
+	}
+
+	virtual void init() {
+		INIT(dev.init());
+	}
+
+	virtual bool soft() { return true; }
+	virtual long soft_stat(const char *var) { return dev.stat(var); }
+
+	void post(int side, ibv_sge local, ibv_sge remote, enum ibv_wr_opcode opcode) {
+		struct wr w = { local, remote, opcode };
+
+		sq[side].push_back(w);
+	}
+
+	virtual void send(ibv_sge sge) { post(0, sge, sge, IBV_WR_SEND); }
+	virtual void recv(ibv_sge sge) { rq.push_back(sge); }
+	virtual void rdma_src(ibv_sge src_sge, ibv_sge dst_sge,
+			      enum ibv_wr_opcode opcode) {
+		post(0, src_sge, dst_sge, opcode);
+	}
+	virtual void rdma_dst(ibv_sge src_sge, ibv_sge dst_sge,
+			      enum ibv_wr_opcode opcode) {
+		post(1, src_sge, dst_sge, opcode);
+	}
+
+	bool execute(struct wr &w) {
+		ibv_sge from = w.local, to = w.remote;
+		long from_need = 0, to_need = IBV_ACCESS_REMOTE_WRITE;
+
+		switch (w.opcode) {
+		case IBV_WR_SEND:
+			if (rq.empty())
+				return false;
+			to = rq.front();
+			rq.pop_front();
+			to_need = IBV_ACCESS_LOCAL_WRITE;
+			cqes[1]++;
+			break;
+		case IBV_WR_RDMA_READ:
+			from = w.remote;
+			to = w.local;
+			from_need = IBV_ACCESS_REMOTE_READ;
+			to_need = IBV_ACCESS_LOCAL_WRITE;
+			break;
+		default:
+			break;
+		}
+		if (from.length > to.length ||
+		    !dev.access(from.lkey, from.addr, from.length, from_need) ||
+		    !dev.access(to.lkey, to.addr, from.length, to_need))
+			return false;
+		memcpy((void *)to.addr, (void *)from.addr, from.length);
+		return true;
+	}
+
+	void poll(int side) {
+		while (!sq[side].empty()) {
+			struct wr w = sq[side].front();
+
+			sq[side].pop_front();
+			ASSERT_TRUE(execute(w)) << "opcode " << w.opcode << " failed";
+			cqes[side]++;
+		}
+		ASSERT_LT(0, cqes[side]) << "no completion";
+		cqes[side]--;
+	}
+
+	virtual void poll_src() { EXEC(poll(0)); }
+	virtual void poll_dst() { EXEC(poll(1)); }
+};
+
+struct odp_soft_explicit : public odp_mem {
+	odp_soft_dev &dev;
+
+	odp_soft_explicit(odp_side_soft &s, odp_side_soft &d) : odp_mem(s, d), dev(s.dev) {}
+
+	virtual void reg(unsigned long src_addr, unsigned long dst_addr, size_t len) {
+		SET(psrc, new ibvt_mr_soft(dev, ssrc.env, ssrc.pd, len, src_addr, ssrc.access_flags));
+		SET(pdst, new ibvt_mr_soft(dev, sdst.env, sdst.pd, len, dst_addr, sdst.access_flags));
+	}
+};
+
+struct odp_soft_implicit : public odp_mem {
+	ibvt_mr_soft_implicit simr;
+	ibvt_mr_soft_implicit dimr;
+
+	odp_soft_implicit(odp_side_soft &s, odp_side_soft &d) : odp_mem(s, d),
+		simr(s.dev, s.env, s.pd, s.access_flags),
+		dimr(d.dev, d.env, d.pd, d.access_flags) {}
+
+	virtual void reg(unsigned long src_addr, unsigned long dst_addr, size_t len) {
+		SET(psrc, new ibvt_sub_mr_soft(simr, src_addr, len));
+		SET(pdst, new ibvt_sub_mr_soft(dimr, dst_addr, len));
+	}
+	virtual void init() {
+		simr.init();
+		dimr.init();
+	}
+};
+#endif
+
+#ifdef HAVE_INFINIBAND_VERBS_EXP_H
+struct ibvt_qp_rc_umr : public ibvt_qp_rc {
+	ibvt_qp_rc_umr(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) :
+		ibvt_qp_rc(e, p, c) {}
+
+	virtual void init_attr(struct ibv_qp_init_attr_ex &attr) {
+		ibvt_qp_rc::init_attr(attr);
+		attr.comp_mask |= IBV_EXP_QP_INIT_ATTR_CREATE_FLAGS;
+		attr.comp_mask |= IBV_EXP_QP_INIT_ATTR_MAX_INL_KLMS;
+		attr.exp_create_flags |= IBV_EXP_QP_CREATE_UMR;
+		attr.max_inl_send_klms = 3;
+	}
+};
+
+typedef odp_qp<ibvt_qp_rc_umr> odp_rc_umr;
+
+struct ibvt_mw : public ibvt_mr {
+	ibvt_mr &master;
+	ibvt_qp &qp;
+
+	ibvt_mw(ibvt_mr &i, intptr_t a, size_t size, ibvt_qp &q) :
+		ibvt_mr(i.env, i.pd, size, a), master(i), qp(q) {}
+
+	virtual void init() {
+		int flags = MAP_PRIVATE|MAP_ANON;
+		if (addr)
+			flags |= MAP_FIXED;
+		buff = (char*)mmap((void*)addr, size, PROT_READ|PROT_WRITE, flags, -1, 0);
+		ASSERT_NE(buff, MAP_FAILED);
+
+		struct ibv_exp_create_mr_in mr_in = {};
+		mr_in.pd = pd.pd;
+		mr_in.attr.create_flags = IBV_EXP_MR_INDIRECT_KLMS;
+		mr_in.attr.max_klm_list_size = 3;
+		mr_in.attr.exp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+		mr_in.comp_mask = 0;
+		SET(mr, ibv_exp_create_mr(&mr_in));
+
+		struct ibv_exp_mem_region mem_reg = {};
+		mem_reg.base_addr = (intptr_t)buff;
+		mem_reg.length = size;
+		mem_reg.mr = master.mr;
+
+		struct ibv_exp_send_wr wr = {}, *bad_wr = NULL;
+		wr.exp_opcode = IBV_EXP_WR_UMR_FILL;
+		wr.ext_op.umr.umr_type = IBV_EXP_UMR_MR_LIST;
+		wr.ext_op.umr.exp_access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+		wr.ext_op.umr.modified_mr = mr;
+		wr.ext_op.umr.num_mrs = 1;
+		wr.ext_op.umr.mem_list.mem_reg_list = &mem_reg;
+		wr.ext_op.umr.base_addr = (intptr_t)buff;
+		wr.exp_send_flags = IBV_EXP_SEND_INLINE;
+
+		DO(ibv_exp_post_send(qp.qp, &wr, &bad_wr));
+	}
+};
+
+struct odp_implicit_mw : public odp_implicit {
+	odp_implicit_mw(odp_side &s, odp_side &d) :
+		odp_implicit(s, d) {};
+
+	virtual void reg(unsigned long src_addr, unsigned long dst_addr, size_t len) {
+		SET(psrc, new ibvt_mw(simr, src_addr, len, ssrc.get_qp()));
+		SET(pdst, new ibvt_mw(dimr, dst_addr, len, sdst.get_qp()));
+	}
+};
+#endif
+
+#define ODP_CHK_SUT_RAM(ram) \
+	this->check_ram("MemAvailable:", ram); \
+	CHK_SUT(odp);
+
+#define ODP_CHK_SUT(len) ODP_CHK_SUT_RAM(len * 3)
+
+struct odp_send : public odp_base {
+	odp_send():
+		odp_base(0, IBV_ACCESS_LOCAL_WRITE) {}
+
+	virtual void post(size_t off, size_t len) {
+		EXEC(trans().recv(mem().dst().sge(off, len)));
+		EXEC(trans().send(mem().src().sge(off, len)));
+	}
+
+	virtual void wait() {
+		EXEC(trans().poll_src());
+		EXEC(trans().poll_dst());
+	}
+
+	virtual void test(unsigned long src, unsigned long dst, size_t len, int count = 1) {
+		EXEC(mem().reg(src, dst, len));
+		EXEC(mem().src().fill());
+		EXEC(mem().dst().init());
+
+		EXEC(check_stats(2, 0));
+		for (int i = 0; i < count; i++)
+			EXEC(xfer(len/count*i, len/count));
+		EXEC(check_stats(2, len / 0x1000 * 2));
+
+		EXEC(mem().dst().check());
+		EXEC(mem().unreg());
+	}
+};
+
+struct odp_rdma_read : public odp_base {
+	odp_rdma_read():
+		odp_base(IBV_ACCESS_REMOTE_READ, IBV_ACCESS_LOCAL_WRITE) {}
+
+	virtual void post(size_t off, size_t len) {
+		EXEC(trans().rdma_dst(mem().dst().sge(off, len),
+				      mem().src().sge(off, len),
+				      IBV_WR_RDMA_READ));
+	}
+
+	virtual void wait() {
+		EXEC(trans().poll_dst());
+	}
+
+	virtual void test(unsigned long src, unsigned long dst, size_t len, int count = 1) {
+		EXEC(mem().reg(src, dst, len));
+		EXEC(mem().src().fill());
+		EXEC(mem().dst().init());
+
+		EXEC(check_stats(2, 0));
+		for (int i = 0; i < count; i++)
+			EXEC(xfer(len/count*i, len/count));
+		EXEC(check_stats(2, len / 0x1000 * 2));
+		EXEC(mem().dst().check());
+		EXEC(mem().unreg());
+	}
+};
+
+struct odp_rdma_write : public odp_base {
+	odp_rdma_write():
+		odp_base(0, IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE) {}
+
+	virtual void post(size_t off, size_t len) {
+		EXEC(trans().rdma_src(mem().src().sge(off, len),
+				      mem().dst().sge(off, len),
+				      IBV_WR_RDMA_WRITE));
+	}
+
+	virtual void wait() {
+		EXEC(trans().poll_src());
+	}
+
+	virtual void test(unsigned long src, unsigned long dst, size_t len, int count = 1) {
+		EXEC(mem().reg(src, dst, len));
+		EXEC(mem().src().fill());
+		EXEC(mem().dst().init());
+
+		EXEC(check_stats(2, 0));
+		for (int i = 0; i < count; i++)
+			EXEC(xfer(len/count*i, len/count));
+		EXEC(check_stats(2, len / 0x1000 * 2));
+		EXEC(mem().dst().check());
+		EXEC(mem().unreg());
+	}
+};
+
+template <typename T1, typename T2, typename T3>
+struct types {
+	typedef T1 MEM;
+	typedef T2 TRANS;
+	typedef T3 OP;
+};
+
+template <typename T>
+struct odp : public T::OP {
+	typename T::TRANS _trans;
+	typename T::MEM _mem;
+	odp():
+		T::OP(),
+		_trans(*this),
+		_mem(_trans.src, _trans.dst) {}
+	odp_mem &mem() { return _mem; }
+	odp_trans &trans() { return _trans; }
+	virtual void init() {
+		INIT(T::OP::init());
+		INIT(_trans.init());
+		INIT(_mem.init());
+	}
+};
+
+#endif
@@ -0,0 +1,364 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __ODP_SOFT_H_
+#define __ODP_SOFT_H_
+
+#ifdef HAVE_LINUX_USERFAULTFD_H
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "env.h"
+#include "stats.h"
+
+/*
+ * Software stand-in for an ODP capable device, for hosts without one.
+ *
+ * ODP MRs are registered with a userfaultfd: their pages are populated on
+ * first touch by the handler thread, and unmapping or discarding them is
+ * reported back as an event the way the MMU notifier reports it to the
+ * driver. The device page table is a bitmap of the pages a transfer has
+ * touched. A transfer hitting a page outside of it takes a device fault,
+ * which is timed, and invalidations clear the bits again. A sequence
+ * count makes a fault that raced with an invalidation retry, so a fault
+ * never maps a page the handler has just dropped.
+ *
+ * stat() serves the odp_stats/ counters of the driver debugfs.
+ */
+
+#define ODP_SOFT_WORD (64 * PAGE)
+
+struct odp_soft_dev : public ibvt_obj {
+	struct region {
+		uintptr_t start;
+		size_t len;
+		long access;
+		long pages;
+		/* present pages, a bit per page in ODP_SOFT_WORD sized words */
+		std::unordered_map<uintptr_t, uint64_t> table;
+	};
+
+	std::map<uint32_t, region> regions;
+	uint32_t next_key;
+	pthread_mutex_t lock;
+	unsigned long seq;
+
+	int uffd;
+	int stop_fd[2];
+	pthread_t thread;
+	char *zero;
+
+	long mrs;
+	long pages;
+	long fault_pages;
+	long invalidations;
+	long failed;
+	long uffd_faults;
+
+	/* device faults, taken by the transfers */
+	ibvt_lat fault_lat;
+	/* userfaultfd resolutions, taken by the handler thread */
+	ibvt_lat uffd_lat;
+
+	odp_soft_dev(ibvt_env &e) :
+		ibvt_obj(e), next_key(1), seq(0), uffd(-1), zero(NULL),
+		mrs(0), pages(0), fault_pages(0), invalidations(0), failed(0),
+		uffd_faults(0)
+	{
+		pthread_mutex_init(&lock, NULL);
+		stop_fd[0] = stop_fd[1] = -1;
+	}
+
+	virtual void init() {
+		struct uffdio_api api = {};
+
+		if (uffd >= 0)
+			return;
+		uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+		api.api = UFFD_API;
+		api.features = UFFD_FEATURE_EVENT_REMOVE |
+			       UFFD_FEATURE_EVENT_UNMAP |
+			       UFFD_FEATURE_EVENT_REMAP;
+		if (uffd < 0 || ioctl(uffd, UFFDIO_API, &api)) {
+			VERBS_NOTICE("userfaultfd is not usable, errno %d\n", errno);
+			env.skip = 1;
+			return;
+		}
+		zero = (char *)calloc(1, PAGE);
+		ASSERT_TRUE(zero);
+		ASSERT_EQ(0, pipe(stop_fd));
+		ASSERT_EQ(0, pthread_create(&thread, NULL, handler, this));
+	}
+
+	virtual ~odp_soft_dev() {
+		if (stop_fd[1] >= 0) {
+			close(stop_fd[1]);
+			pthread_join(thread, NULL);
+			close(stop_fd[0]);
+		}
+		if (uffd >= 0)
+			close(uffd);
+		free(zero);
+		pthread_mutex_destroy(&lock);
+	}
+
+	/* starts tracking faults and unmaps of [addr, addr + len) */
+	int watch(void *addr, size_t len) {
+		struct uffdio_register reg = {};
+
+		reg.range.start = (uintptr_t)addr;
+		reg.range.len = (len + PAGE - 1) & ~(size_t)(PAGE - 1);
+		reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+		return ioctl(uffd, UFFDIO_REGISTER, &reg);
+	}
+
+	uint32_t reg(void *addr, size_t len, long access) {
+		uint32_t key;
+
+		pthread_mutex_lock(&lock);
+		key = next_key++;
+		region &r = regions[key];
+		r.start = (uintptr_t)addr;
+		r.len = len;
+		r.access = access;
+		r.pages = 0;
+		mrs++;
+		pthread_mutex_unlock(&lock);
+		return key;
+	}
+
+	void dereg(uint32_t key) {
+		pthread_mutex_lock(&lock);
+		mrs--;
+		pages -= regions[key].pages;
+		regions.erase(key);
+		pthread_mutex_unlock(&lock);
+	}
+
+	long stat(const char *var) {
+		if (!strcmp(var, "num_odp_mrs"))
+			return mrs;
+		if (!strcmp(var, "num_odp_mr_pages"))
+			return pages;
+		if (!strcmp(var, "num_page_fault_pages"))
+			return fault_pages;
+		if (!strcmp(var, "num_invalidations"))
+			return invalidations;
+		if (!strcmp(var, "num_failed_resolutions"))
+			return failed;
+		return -1;
+	}
+
+	/* the region behind key if it covers [addr, addr + len) with need */
+	region *find(uint32_t key, uintptr_t addr, size_t len, long need) {
+		std::map<uint32_t, region>::iterator it = regions.find(key);
+
+		if (it == regions.end() || addr < it->second.start ||
+		    addr - it->second.start + len > it->second.len ||
+		    (it->second.access & need) != need)
+			return NULL;
+		return &it->second;
+	}
+
+	/*
+	 * Device access to len bytes at addr through key, need is the access
+	 * right it takes. Faults in the pages the device has not mapped yet,
+	 * returns false on a protection or bounds error.
+	 */
+	bool access(uint32_t key, uintptr_t addr, size_t len, long need) {
+		double t = 0;
+
+		for (;;) {
+			std::vector<uintptr_t> missing;
+			unsigned long s;
+			region *r;
+
+			pthread_mutex_lock(&lock);
+			r = find(key, addr, len, need);
+			if (!r) {
+				__atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+				pthread_mutex_unlock(&lock);
+				return false;
+			}
+			for (uintptr_t p = addr & ~(uintptr_t)(PAGE - 1); p < addr + len; p += PAGE)
+				if (!present(*r, p))
+					missing.push_back(p);
+			s = seq;
+			pthread_mutex_unlock(&lock);
+
+			if (missing.empty())
+				return true;
+			if (!t)
+				t = lat_now();
+			for (size_t i = 0; i < missing.size(); i++)
+				(void)*(volatile char *)missing[i];
+
+			pthread_mutex_lock(&lock);
+			r = find(key, addr, len, need);
+			if (r && s == seq) {
+				for (size_t i = 0; i < missing.size(); i++)
+					set(*r, missing[i]);
+				fault_pages += missing.size();
+				pthread_mutex_unlock(&lock);
+				fault_lat.add(lat_now() - t);
+				return true;
+			}
+			/* raced with an invalidation, fault again */
+			pthread_mutex_unlock(&lock);
+		}
+	}
+
+	bool present(region &r, uintptr_t p) {
+		std::unordered_map<uintptr_t, uint64_t>::iterator w =
+			r.table.find(p / ODP_SOFT_WORD);
+
+		return w != r.table.end() &&
+			(w->second >> (p / PAGE % 64) & 1);
+	}
+
+	void set(region &r, uintptr_t p) {
+		uint64_t &w = r.table[p / ODP_SOFT_WORD];
+		uint64_t bit = 1ULL << (p / PAGE % 64);
+
+		if (w & bit)
+			return;
+		w |= bit;
+		r.pages++;
+		pages++;
+	}
+
+	/* drops [start, end) from the device page table, the lock is held */
+	void invalidate(uintptr_t start, uintptr_t end) {
+		seq++;
+		for (std::map<uint32_t, region>::iterator it = regions.begin();
+		     it != regions.end(); it++) {
+			region &r = it->second;
+			uintptr_t from = std::max(start, r.start);
+			uintptr_t to = std::min(end, r.start + std::min(r.len, UINTPTR_MAX - r.start));
+			long n = 0;
+
+			if (from >= to)
+				continue;
+			from &= ~(uintptr_t)(PAGE - 1);
+			for (uintptr_t k = from / ODP_SOFT_WORD; k <= (to - 1) / ODP_SOFT_WORD; k++) {
+				std::unordered_map<uintptr_t, uint64_t>::iterator w = r.table.find(k);
+				uint64_t mask = ~0ULL;
+
+				if (w == r.table.end())
+					continue;
+				if (k == from / ODP_SOFT_WORD)
+					mask &= ~0ULL << (from / PAGE % 64);
+				if (k == (to - 1) / ODP_SOFT_WORD)
+					mask &= ~0ULL >> (63 - (to - 1) / PAGE % 64);
+				n += __builtin_popcountll(w->second & mask);
+				w->second &= ~mask;
+				if (!w->second)
+					r.table.erase(w);
+			}
+			if (n) {
+				r.pages -= n;
+				pages -= n;
+				invalidations++;
+			}
+		}
+	}
+
+	void resolve(uintptr_t addr) {
+		struct uffdio_copy copy = {};
+		double t = lat_now();
+
+		copy.dst = addr & ~(uintptr_t)(PAGE - 1);
+		copy.src = (uintptr_t)zero;
+		copy.len = PAGE;
+		/* EEXIST: another thread faulted on the same page first */
+		if (ioctl(uffd, UFFDIO_COPY, &copy) && errno != EEXIST) {
+			__atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		uffd_lat.add(lat_now() - t);
+		uffd_faults++;
+	}
+
+	void handle() {
+		struct pollfd fds[2] = { { uffd, POLLIN, 0 }, { stop_fd[0], POLLIN, 0 } };
+		struct uffd_msg msg;
+
+		for (;;) {
+			if (poll(fds, 2, -1) < 0 && errno != EINTR)
+				return;
+			if (fds[1].revents)
+				return;
+			while (read(uffd, &msg, sizeof(msg)) == sizeof(msg)) {
+				switch (msg.event) {
+				case UFFD_EVENT_PAGEFAULT:
+					resolve(msg.arg.pagefault.address);
+					break;
+				case UFFD_EVENT_REMOVE:
+				case UFFD_EVENT_UNMAP:
+					pthread_mutex_lock(&lock);
+					invalidate(msg.arg.remove.start, msg.arg.remove.end);
+					pthread_mutex_unlock(&lock);
+					break;
+				case UFFD_EVENT_REMAP:
+					pthread_mutex_lock(&lock);
+					invalidate(msg.arg.remap.from,
+						   msg.arg.remap.from + msg.arg.remap.len);
+					pthread_mutex_unlock(&lock);
+					break;
+				}
+			}
+		}
+	}
+
+	static void *handler(void *arg) {
+		((odp_soft_dev *)arg)->handle();
+		return NULL;
+	}
+
+	void report() {
+		VERBS_NOTICE("soft ODP: %ld device fault pages, %ld userfaultfd faults, "
+			     "%ld invalidations, %ld failed\n", fault_pages,
+			     uffd_faults, invalidations, failed);
+		if (fault_lat.count())
+			fault_lat.report("  device fault");
+		if (uffd_lat.count())
+			uffd_lat.report("  userfaultfd resolve");
+	}
+};
+
+#endif
+
+#endif
@@ -0,0 +1,261 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <list>
+
+#include "env.h"
+#include "stats.h"
+#include "peer_mem.h"
+
+#define PEER_MEM_OBJS 4096
+
+struct peer_registry_count : public peer_registry {
+	long calls;
+
+	peer_registry_count() : calls(0) {}
+
+	virtual void *reg(void *addr, size_t length) {
+		calls++;
+		return addr;
+	}
+
+	virtual int dereg(void *mr) {
+		calls--;
+		return 0;
+	}
+};
+
+TEST(peer_mem, t0_slab) {
+	struct peer_slab slab;
+	uintptr_t base;
+	size_t size;
+	char *a, *b, *c;
+
+	a = (char *)slab.alloc(0x40);
+	b = (char *)slab.alloc(0x40);
+	ASSERT_TRUE(a && b);
+	ASSERT_EQ(0U, (uintptr_t)a % PEER_PAGE);
+	ASSERT_EQ(PEER_PAGE, (uintptr_t)(b - a));
+	ASSERT_EQ(1, slab.maps);
+
+	/* a freed chunk comes back cleared */
+	memset(a, 0xa5, 0x40);
+	slab.free(a, 0x40);
+	c = (char *)slab.alloc(0x100);
+	ASSERT_EQ(a, c);
+	ASSERT_EQ(0, c[0x3f]);
+	ASSERT_EQ(1, slab.reuses);
+
+	/* every class carves its own slab */
+	c = (char *)slab.alloc(0x3000);
+	ASSERT_TRUE(c);
+	ASSERT_EQ(0U, (uintptr_t)c % PEER_PAGE);
+	ASSERT_EQ(2, slab.maps);
+	ASSERT_TRUE(slab.extent((uintptr_t)c + 0x10, 0x100, base, size));
+	ASSERT_EQ(PEER_SLAB_SIZE, size);
+	ASSERT_FALSE(slab.extent((uintptr_t)&base, sizeof(base), base, size));
+
+	/* anything above a slab is mapped alone and unmapped on free */
+	c = (char *)slab.alloc(PEER_SLAB_SIZE + 1);
+	ASSERT_TRUE(c);
+	ASSERT_EQ(3, slab.maps);
+	ASSERT_TRUE(slab.extent((uintptr_t)c, PEER_SLAB_SIZE + 1, base, size));
+	ASSERT_EQ(PEER_SLAB_SIZE + PEER_PAGE, size);
+	slab.free(c, PEER_SLAB_SIZE + 1);
+	ASSERT_EQ(2U, slab.slabs.size());
+}
+
+TEST(peer_mem, t1_registry) {
+	struct peer_registry_count regs;
+	uintptr_t base = 0x40000000;
+	peer_reg *r[4];
+
+	/* a covered range shares the registration */
+	r[0] = regs.get(base + 0x1000, 0x100, base, PEER_SLAB_SIZE);
+	r[1] = regs.get(base + 0x8000, 0x4000, base + 0x8000, 0x4000);
+	ASSERT_EQ(r[0], r[1]);
+	ASSERT_EQ(2, r[0]->refs);
+	ASSERT_EQ(1, regs.calls);
+	ASSERT_EQ(1, regs.hits);
+
+	/* overlapping but not covered registers again */
+	r[2] = regs.get(base + PEER_SLAB_SIZE - 0x1000, 0x2000,
+			base + PEER_SLAB_SIZE - 0x1000, 0x2000);
+	ASSERT_NE(r[0], r[2]);
+	ASSERT_EQ(2, regs.calls);
+
+	/* found from the granule it spills into as well */
+	r[3] = regs.get(base + PEER_SLAB_SIZE, 0x100,
+			base + PEER_SLAB_SIZE, 0x100);
+	ASSERT_EQ(r[2], r[3]);
+	ASSERT_EQ(2U, regs.size());
+
+	regs.put(r[1]);
+	ASSERT_EQ(2U, regs.size());
+	regs.put(r[0]);
+	ASSERT_EQ(1U, regs.size());
+	ASSERT_FALSE(regs.find(base + 0x1000, 0x100));
+	regs.put(r[3]);
+	regs.put(r[2]);
+	ASSERT_EQ(0U, regs.size());
+	ASSERT_EQ(0, regs.calls);
+	ASSERT_TRUE(regs.index.empty());
+}
+
+/*
+ * The peer side of creating and destroying n QPs and n CQs, each a queue
+ * buffer and a doorbell record, both registered: the slab and the shared
+ * registry against an mmap and a registration per buffer kept in a list.
+ */
+struct peer_mem_legacy {
+	struct mr {
+		void *addr;
+		size_t length;
+	};
+
+	std::list<struct mr *> mr_list;
+	long maps;
+	long regs;
+
+	peer_mem_legacy() : maps(0), regs(0) {}
+
+	void *alloc(size_t length) {
+		void *p = mmap(NULL, length, PROT_READ|PROT_WRITE,
+			       MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		maps++;
+		return p == MAP_FAILED ? NULL : p;
+	}
+
+	void free(void *p, size_t length) { munmap(p, length); }
+
+	struct mr *reg(void *addr, size_t length) {
+		struct mr *m = new mr;
+		m->addr = addr;
+		m->length = length;
+		mr_list.push_back(m);
+		regs++;
+		return m;
+	}
+
+	void dereg(struct mr *m) {
+		mr_list.remove(m);
+		delete m;
+	}
+};
+
+struct peer_mem_obj {
+	void *buf[2];
+	size_t len[2];
+	void *reg[2];
+};
+
+static void peer_mem_sizes(struct peer_mem_obj &o, bool qp)
+{
+	o.len[0] = qp ? 0x8000 : 0x4000;
+	o.len[1] = 0x40;
+}
+
+TEST(peer_mem, t2_setup) {
+	for (int n = 16; n <= PEER_MEM_OBJS; n *= 4) {
+		std::vector<struct peer_mem_obj> objs(2 * n);
+		double t;
+
+		{
+			struct peer_mem_legacy m;
+
+			t = lat_now();
+			for (int i = 0; i < 2 * n; i++) {
+				struct peer_mem_obj &o = objs[i];
+				peer_mem_sizes(o, i < n);
+				for (int k = 0; k < 2; k++) {
+					o.buf[k] = m.alloc(o.len[k]);
+					ASSERT_TRUE(o.buf[k]);
+					o.reg[k] = m.reg(o.buf[k], o.len[k]);
+				}
+			}
+			/* QPs go before their CQs */
+			for (int i = 0; i < 2 * n; i++) {
+				struct peer_mem_obj &o = objs[i];
+				for (int k = 0; k < 2; k++) {
+					m.dereg((struct peer_mem_legacy::mr *)o.reg[k]);
+					m.free(o.buf[k], o.len[k]);
+				}
+			}
+			t = (lat_now() - t) / (2 * n);
+			ASSERT_TRUE(m.mr_list.empty());
+			VERBS_NOTICE("%d QPs + %d CQs, mmap per buffer: %ld mmaps, "
+				     "%ld registrations, %.2f usec per object\n",
+				     n, n, m.maps, m.regs, t);
+		}
+
+		{
+			struct peer_slab m;
+			struct peer_registry_count regs;
+			uintptr_t base;
+			size_t size;
+
+			t = lat_now();
+			for (int i = 0; i < 2 * n; i++) {
+				struct peer_mem_obj &o = objs[i];
+				peer_mem_sizes(o, i < n);
+				for (int k = 0; k < 2; k++) {
+					o.buf[k] = m.alloc(o.len[k]);
+					ASSERT_TRUE(o.buf[k]);
+					base = (uintptr_t)o.buf[k];
+					size = o.len[k];
+					m.extent(base, o.len[k], base, size);
+					o.reg[k] = regs.get((uintptr_t)o.buf[k],
+							    o.len[k], base, size);
+					ASSERT_TRUE(o.reg[k]);
+				}
+			}
+			for (int i = 0; i < 2 * n; i++) {
+				struct peer_mem_obj &o = objs[i];
+				for (int k = 0; k < 2; k++) {
+					regs.put((peer_reg *)o.reg[k]);
+					m.free(o.buf[k], o.len[k]);
+				}
+			}
+			t = (lat_now() - t) / (2 * n);
+			ASSERT_EQ(0U, regs.size());
+			ASSERT_EQ(m.maps, regs.regs);
+			VERBS_NOTICE("%d QPs + %d CQs, slab: %ld mmaps, "
+				     "%ld registrations, %.2f usec per object\n",
+				     n, n, m.maps, regs.regs, t);
+		}
+	}
+}
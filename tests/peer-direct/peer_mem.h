@@ -0,0 +1,256 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __PEER_MEM_H_
+#define __PEER_MEM_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Memory behind the peer-direct callbacks.
+ *
+ * Queue buffers come from a slab allocator: power of two size classes from
+ * a page up to a slab, carved out of PEER_SLAB_SIZE mappings and recycled
+ * through per class free lists, so creating a QP or CQ does not cost an
+ * mmap. Recycled chunks are cleared, the driver gets zeroed memory either
+ * way. Anything above the largest class is mapped on its own.
+ *
+ * Registrations are shared: a range covered by a live registration takes a
+ * reference on it instead of registering again. Registrations are indexed
+ * by the PEER_REG_SHIFT granules they span, so a lookup scans only the
+ * registrations touching the granule of its start.
+ */
+
+#define PEER_PAGE 0x1000UL
+#define PEER_SLAB_SHIFT 21
+#define PEER_SLAB_SIZE (1UL << PEER_SLAB_SHIFT)
+#define PEER_SLAB_CLASSES (PEER_SLAB_SHIFT - 12 + 1)
+#define PEER_REG_SHIFT 21
+
+struct peer_slab {
+	std::vector<void *> free_list[PEER_SLAB_CLASSES];
+	uintptr_t cur[PEER_SLAB_CLASSES];
+	size_t left[PEER_SLAB_CLASSES];
+	std::map<uintptr_t, size_t> slabs;
+	std::unordered_map<uintptr_t, size_t> large;
+	long maps;
+	long reuses;
+
+	peer_slab() : maps(0), reuses(0) {
+		memset(cur, 0, sizeof(cur));
+		memset(left, 0, sizeof(left));
+	}
+
+	~peer_slab() {
+		for (std::map<uintptr_t, size_t>::iterator it = slabs.begin();
+		     it != slabs.end(); it++)
+			munmap((void *)it->first, it->second);
+	}
+
+	static int cls(size_t length) {
+		int c = 0;
+
+		while ((PEER_PAGE << c) < length)
+			c++;
+		return c;
+	}
+
+	void *map(size_t size) {
+		void *p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+			       MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+		if (p == MAP_FAILED)
+			return NULL;
+		maps++;
+		slabs[(uintptr_t)p] = size;
+		return p;
+	}
+
+	void *alloc(size_t length) {
+		int c = cls(length);
+		size_t sz = PEER_PAGE << c;
+		void *p;
+
+		if (c >= PEER_SLAB_CLASSES) {
+			sz = (length + PEER_PAGE - 1) & ~(PEER_PAGE - 1);
+			p = map(sz);
+			if (p)
+				large[(uintptr_t)p] = sz;
+			return p;
+		}
+
+		if (!free_list[c].empty()) {
+			p = free_list[c].back();
+			free_list[c].pop_back();
+			memset(p, 0, sz);
+			reuses++;
+			return p;
+		}
+
+		if (!left[c]) {
+			p = map(PEER_SLAB_SIZE);
+			if (!p)
+				return NULL;
+			cur[c] = (uintptr_t)p;
+			left[c] = PEER_SLAB_SIZE;
+		}
+		p = (void *)cur[c];
+		cur[c] += sz;
+		left[c] -= sz;
+		return p;
+	}
+
+	void free(void *p, size_t length) {
+		std::unordered_map<uintptr_t, size_t>::iterator it =
+			large.find((uintptr_t)p);
+
+		if (it != large.end()) {
+			munmap(p, it->second);
+			slabs.erase(it->first);
+			large.erase(it);
+			return;
+		}
+		free_list[cls(length)].push_back(p);
+	}
+
+	/* The mapping holding [addr, addr + length), if it is ours */
+	bool extent(uintptr_t addr, size_t length,
+		    uintptr_t &base, size_t &size) {
+		std::map<uintptr_t, size_t>::iterator it =
+			slabs.upper_bound(addr);
+
+		if (it == slabs.begin())
+			return false;
+		--it;
+		if (addr + length > it->first + it->second)
+			return false;
+		base = it->first;
+		size = it->second;
+		return true;
+	}
+};
+
+struct peer_reg {
+	uintptr_t start;
+	uintptr_t end;
+	void *mr;
+	int refs;
+};
+
+struct peer_registry {
+	std::unordered_map<uintptr_t, std::vector<peer_reg *> > index;
+	size_t live;
+	long regs;
+	long hits;
+
+	peer_registry() : live(0), regs(0), hits(0) {}
+	virtual ~peer_registry() {}
+
+	virtual void *reg(void *addr, size_t length) = 0;
+	virtual int dereg(void *mr) = 0;
+
+	size_t size() { return live; }
+
+	peer_reg *find(uintptr_t start, size_t length) {
+		std::unordered_map<uintptr_t, std::vector<peer_reg *> >::iterator
+			it = index.find(start >> PEER_REG_SHIFT);
+
+		if (it == index.end())
+			return NULL;
+		for (size_t i = 0; i < it->second.size(); i++) {
+			peer_reg *r = it->second[i];
+			if (r->start <= start && start + length <= r->end)
+				return r;
+		}
+		return NULL;
+	}
+
+	/*
+	 * A reference on a registration covering [start, start + length),
+	 * registering [base, base + size) when there is none. The caller
+	 * picks base and size to cover the range, wider if it expects
+	 * neighbours to follow.
+	 */
+	peer_reg *get(uintptr_t start, size_t length,
+		      uintptr_t base, size_t size) {
+		peer_reg *r = find(start, length);
+
+		if (r) {
+			r->refs++;
+			hits++;
+			return r;
+		}
+
+		r = new peer_reg;
+		r->mr = reg((void *)base, size);
+		if (!r->mr) {
+			delete r;
+			return NULL;
+		}
+		r->start = base;
+		r->end = base + size;
+		r->refs = 1;
+		for (uintptr_t g = base >> PEER_REG_SHIFT;
+		     g <= (r->end - 1) >> PEER_REG_SHIFT; g++)
+			index[g].push_back(r);
+		regs++;
+		live++;
+		return r;
+	}
+
+	/* Drops a reference, returns what dereg did or 0 */
+	int put(peer_reg *r) {
+		int ret;
+
+		if (--r->refs)
+			return 0;
+		for (uintptr_t g = r->start >> PEER_REG_SHIFT;
+		     g <= (r->end - 1) >> PEER_REG_SHIFT; g++) {
+			std::vector<peer_reg *> &v = index[g];
+			for (size_t i = 0; i < v.size(); i++)
+				if (v[i] == r) {
+					v[i] = v.back();
+					v.pop_back();
+					break;
+				}
+			if (v.empty())
+				index.erase(g);
+		}
+		ret = dereg(r->mr);
+		live--;
+		delete r;
+		return ret;
+	}
+};
+
+#endif
@@ -46,7 +46,10 @@
 #include "env.h"
 
 #include <infiniband/peer_ops.h>
-#include <list>
+#include <set>
+
+#include "stats.h"
+#include "peer_mem.h"
 
 #define SZ 1024
 #define MAX_WR 6
@@ -58,6 +61,7 @@ struct ibvt_peer: public ibvt_obj {
 	struct peer_mr {
 		ibvt_peer &ctx;
 		struct ibv_mr *region;
+		struct peer_reg *reg;
 		uintptr_t start;
 		uintptr_t end;
 
@@ -73,10 +77,30 @@ struct ibvt_peer: public ibvt_obj {
 		size_t length;
 	};
 
-	std::list<struct peer_mr *> mr_list;
+	struct peer_regs : public peer_registry {
+		ibvt_pd &pd;
+
+		peer_regs(ibvt_pd &p) : pd(p) {}
+
+		virtual void *reg(void *addr, size_t length) {
+			return ibv_reg_mr(pd.pd, addr, length,
+					  IBV_ACCESS_LOCAL_WRITE |
+					  IBV_ACCESS_REMOTE_READ |
+					  IBV_ACCESS_REMOTE_WRITE);
+		}
+
+		virtual int dereg(void *mr) {
+			return ibv_dereg_mr((struct ibv_mr *)mr);
+		}
+	};
+
+	struct peer_slab slab;
+	struct peer_regs regs;
+	long handles;
 	std::set<struct queue_buf *> wq_set;
 
-	ibvt_peer(ibvt_env &e, ibvt_pd &p) : ibvt_obj(e), pd(p)
+	ibvt_peer(ibvt_env &e, ibvt_pd &p) : ibvt_obj(e), pd(p), regs(p),
+		handles(0)
 	{
 		attr.peer_id = (uint64_t)this;
 		attr.register_va = register_va;
@@ -95,7 +119,8 @@ struct ibvt_peer: public ibvt_obj {
 	virtual ~ibvt_peer()
 	{
 		EXPECT_EQ(0U, wq_set.size());
-		EXPECT_EQ(0U, mr_list.size());
+		EXPECT_EQ(0, handles);
+		EXPECT_EQ(0U, regs.size());
 	}
 
 	virtual void init() {}
@@ -108,9 +133,8 @@ struct ibvt_peer: public ibvt_obj {
 			ctx->env.fatality = true;
 			return NULL;
 		}
-		qb->pb.addr = mmap(NULL, attr->length, PROT_READ|PROT_WRITE,
-				   MAP_SHARED|MAP_ANONYMOUS, -1, 0);
-		if (qb->pb.addr == MAP_FAILED) {
+		qb->pb.addr = ctx->slab.alloc(attr->length);
+		if (!qb->pb.addr) {
 			VERBS_INFO("mmap failed errno %d\n", errno);
 			ctx->env.fatality = true;
 			delete qb;
@@ -129,7 +153,7 @@ struct ibvt_peer: public ibvt_obj {
 		struct queue_buf *qb = (struct queue_buf*)pb;
 		ibvt_peer *ctx = qb->ctx;
 		VERBS_TRACE("buf_release %p[%lx]\n", qb->pb.addr, qb->length);
-		munmap(qb->pb.addr, qb->length);
+		ctx->slab.free(qb->pb.addr, qb->length);
 		if (ctx->wq_set.erase(qb) != 1) {
 			VERBS_TRACE("unexpected qb\n");
 			ctx->env.fatality = true;
@@ -143,19 +167,22 @@ struct ibvt_peer: public ibvt_obj {
 	{
 		ibvt_peer *ctx = (ibvt_peer *)peer_id;
 		peer_mr *reg_h = new peer_mr(*ctx, start, length);
-
-		reg_h->region = ibv_reg_mr(ctx->pd.pd, start, length,
-					IBV_ACCESS_LOCAL_WRITE |
-					IBV_ACCESS_REMOTE_READ |
-					IBV_ACCESS_REMOTE_WRITE);
-		VERBS_TRACE("register_va %p [%lx] %p\n", start, length, reg_h->region);
-		if (!reg_h->region) {
+		uintptr_t base = reg_h->start;
+		size_t size = length;
+
+		/* queue buffers register their whole slab for the next ones */
+		ctx->slab.extent(reg_h->start, length, base, size);
+		reg_h->reg = ctx->regs.get(reg_h->start, length, base, size);
+		VERBS_TRACE("register_va %p [%lx] %p\n", start, length,
+			    reg_h->reg ? reg_h->reg->mr : NULL);
+		if (!reg_h->reg) {
 			VERBS_TRACE("ibv_reg_mr on peer memory failed\n");
-			reg_h->ctx.env.fatality = true;
+			ctx->env.fatality = true;
+			delete reg_h;
 			return 0;
 		}
-
-		reg_h->ctx.mr_list.push_back(reg_h);
+		reg_h->region = (struct ibv_mr *)reg_h->reg->mr;
+		ctx->handles++;
 
 		return (uint64_t)reg_h;
 	}
@@ -163,11 +190,11 @@ struct ibvt_peer: public ibvt_obj {
 	static int unregister_va(uint64_t registration_id, uint64_t peer_id) {
 		peer_mr *reg_h = (peer_mr *)registration_id;
 		VERBS_TRACE("unregister_va %p\n", reg_h->region);
-		if(ibv_dereg_mr(reg_h->region)) {
+		if(reg_h->ctx.regs.put(reg_h->reg)) {
 			VERBS_TRACE("ibv_dereg_mr on peer memory failed\n");
 			reg_h->ctx.env.fatality = true;
 		}
-		reg_h->ctx.mr_list.remove(reg_h);
+		reg_h->ctx.handles--;
 		delete reg_h;
 		return 1;
 	}
@@ -623,3 +650,99 @@ TYPED_TEST(peerdirect_test, t9_abort16) {
 }
 
 
+
+#define PEER_BENCH_OBJS 1024
+#define PEER_QP_BUF 0x8000
+#define PEER_CQ_BUF 0x4000
+#define PEER_DBREC 0x40
+
+/*
+ * What creating QPs and CQs asks of the peer: a queue buffer and a
+ * doorbell record each, both registered. The callbacks are called
+ * directly, so the numbers are the peer side of the setup time alone.
+ */
+struct peerdirect_bench : public testing::Test, public ibvt_env {
+	struct peer_obj {
+		struct ibv_peer_buf *buf[2];
+		uint64_t reg[2];
+	};
+
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct ibvt_peer peer;
+	std::vector<struct peer_obj> objs;
+
+	peerdirect_bench() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		peer(*this, pd)
+	{}
+
+	void obj_setup(struct peer_obj &o, size_t length) {
+		struct ibv_peer_buf_alloc_attr attr;
+		size_t len[2] = { length, PEER_DBREC };
+
+		for (int i = 0; i < 2; i++) {
+			memset(&attr, 0, sizeof(attr));
+			attr.length = len[i];
+			attr.peer_id = peer.attr.peer_id;
+			attr.alignment = PEER_PAGE;
+			o.buf[i] = peer.attr.buf_alloc(&attr);
+			ASSERT_TRUE(o.buf[i]);
+			o.reg[i] = peer.attr.register_va(o.buf[i]->addr, len[i],
+							 peer.attr.peer_id,
+							 o.buf[i]);
+			ASSERT_TRUE(o.reg[i]);
+		}
+	}
+
+	void obj_teardown(struct peer_obj &o) {
+		for (int i = 1; i >= 0; i--) {
+			peer.attr.unregister_va(o.reg[i], peer.attr.peer_id);
+			peer.attr.buf_release(o.buf[i]);
+		}
+	}
+
+	void setup_teardown(int n) {
+		ibvt_lat setup(2 * n), teardown(2 * n);
+		long maps = peer.slab.maps, regs = peer.regs.regs;
+		double t;
+		char what[64];
+
+		objs.resize(2 * n);
+		for (int i = 0; i < 2 * n; i++) {
+			t = lat_now();
+			EXEC(obj_setup(objs[i], i < n ? PEER_QP_BUF : PEER_CQ_BUF));
+			setup.add(lat_now() - t);
+		}
+		for (int i = 2 * n - 1; i >= 0; i--) {
+			t = lat_now();
+			EXEC(obj_teardown(objs[i]));
+			teardown.add(lat_now() - t);
+		}
+		ASSERT_EQ(0, peer.handles);
+		ASSERT_EQ(0U, peer.regs.size());
+
+		VERBS_NOTICE("%d QPs + %d CQs: %ld mmaps, %ld registrations\n",
+			     n, n, peer.slab.maps - maps, peer.regs.regs - regs);
+		sprintf(what, "  setup x%d", n);
+		setup.report(what);
+		sprintf(what, "  teardown x%d", n);
+		teardown.report(what);
+	}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		INIT(pd.init());
+	}
+
+	virtual void TearDown() {
+		ASSERT_FALSE(HasFailure());
+	}
+};
+
+TEST_F(peerdirect_bench, b0_callbacks) {
+	CHK_SUT(peer-direct);
+	for (int n = 16; n <= PEER_BENCH_OBJS; n *= 4)
+		EXEC(setup_teardown(n));
+}
@@ -0,0 +1,307 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __IBVT_RING_H_
+#define __IBVT_RING_H_
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "env.h"
+
+/*
+ * A message channel over RC: records are RDMA written into a ring at the
+ * receiver and consumed there in place.
+ *
+ * Each record is one RDMA_WRITE_WITH_IMM carrying the record length. Both
+ * ends place records by the same rule: RING_ALIGN aligned, right after the
+ * previous one, or at the start of the ring when a record would straddle
+ * its end. So the length is all the receiver needs to find the record,
+ * and the tail it implies is the one the sender wrote.
+ *
+ * Credits are the bytes and records the receiver has released. It RDMA
+ * writes them into a pair of words at the sender, in batches when the
+ * traffic is one way, or in the same post as its own record when it has
+ * one to send back on that QP. The record count keeps the sender within
+ * the receives posted for the immediates.
+ */
+
+#define RING_ALIGN 64
+#define RING_RECVS 0x800
+/* a signaled send every RING_SIGNAL, at most RING_PENDING of them unreaped */
+#define RING_SIGNAL 32
+#define RING_PENDING 64
+
+/* Offset of a len byte record placed at pos, pos moves past it */
+static inline size_t ring_place(uint64_t &pos, size_t size, size_t len)
+{
+	size_t alen = (len + RING_ALIGN - 1) & ~(size_t)(RING_ALIGN - 1);
+	size_t off = pos & (size - 1);
+
+	if (off + alen > size) {
+		pos += size - off;
+		off = 0;
+	}
+	pos += alen;
+	return off;
+}
+
+static inline uint64_t ring_load(uint64_t &w)
+{
+	return *(volatile uint64_t *)&w;
+}
+
+struct ring_tx {
+	size_t size;
+	size_t max_recs;
+	uint64_t tail;
+	uint64_t recs;
+
+	ring_tx(size_t s, size_t r = RING_RECVS) :
+		size(s), max_recs(r), tail(0), recs(0) {}
+
+	/* Offset of the next record, -ENOSPC until the receiver releases */
+	long reserve(size_t len, uint64_t head, uint64_t done) {
+		uint64_t pos = tail;
+		size_t off;
+
+		if (len > size || recs - done >= max_recs)
+			return -ENOSPC;
+		off = ring_place(pos, size, len);
+		if (pos - head > size)
+			return -ENOSPC;
+		tail = pos;
+		recs++;
+		return off;
+	}
+};
+
+struct ring_rx {
+	size_t size;
+	size_t max_recs;
+	uint64_t pos;
+	uint64_t recs;
+	uint64_t head;
+	uint64_t done;
+	uint64_t credited;
+	uint64_t credited_recs;
+
+	ring_rx(size_t s, size_t r = RING_RECVS) :
+		size(s), max_recs(r), pos(0), recs(0), head(0), done(0),
+		credited(0), credited_recs(0) {}
+
+	size_t next(size_t len) {
+		recs++;
+		return ring_place(pos, size, len);
+	}
+
+	/* everything received so far is consumed */
+	void release() {
+		head = pos;
+		done = recs;
+	}
+
+	bool due(size_t batch) {
+		return head - credited >= batch ||
+		       done - credited_recs >= max_recs / 4;
+	}
+};
+
+struct ibvt_ring_qp : public ibvt_qp_rc {
+	ibvt_cq &scq;
+	long unsignaled;
+	long pending;
+
+	ibvt_ring_qp(ibvt_env &e, ibvt_pd &p, ibvt_cq &s, ibvt_cq &r) :
+		ibvt_qp_rc(e, p, r), scq(s), unsignaled(0), pending(0) {}
+
+	virtual void init_attr(struct ibv_qp_init_attr_ex &attr) {
+		ibvt_qp_rc::init_attr(attr);
+		attr.send_cq = scq.cq;
+	}
+
+	virtual void init() {
+		INIT(scq.init());
+		INIT(ibvt_qp_rc::init());
+	}
+
+	/* Posts a chain, one send in RING_SIGNAL is signaled and reaped */
+	int post(struct ibv_send_wr *wr) {
+		struct ibv_send_wr *last = wr, *bad_wr = NULL;
+		struct ibv_wc wc[RING_PENDING];
+		int n;
+
+		for (unsignaled++; last->next; unsignaled++)
+			last = last->next;
+		if (unsignaled >= RING_SIGNAL) {
+			last->_wr_send_flags |= IBV_SEND_SIGNALED;
+			unsignaled = 0;
+			pending++;
+		}
+		while (pending > RING_PENDING) {
+			n = scq.poll_wc(wc, RING_PENDING);
+			if (n < 0)
+				return n;
+			for (int i = 0; i < n; i++)
+				if (wc[i].status)
+					return -EIO;
+			pending -= n;
+		}
+		return ibv_post_send(qp, wr, &bad_wr);
+	}
+};
+
+struct ibvt_ring : public ibvt_obj {
+	ibvt_ring_qp &tx;
+	ibvt_ring_qp &rx;
+	ibvt_mr ring;
+	/* at the sender, released bytes and records */
+	ibvt_mr_atomic credit;
+	/* at the receiver, the source of the credit write */
+	ibvt_mr_atomic head;
+	struct ring_tx t;
+	struct ring_rx r;
+	size_t batch;
+	long credits;
+	long stalls;
+
+	ibvt_ring(ibvt_env &e, ibvt_ring_qp &s, ibvt_ring_qp &d, size_t size) :
+		ibvt_obj(e),
+		tx(s),
+		rx(d),
+		ring(e, d.pd, size),
+		credit(e, s.pd, 2),
+		head(e, d.pd, 2),
+		t(size),
+		r(size),
+		batch(size / 4),
+		credits(0),
+		stalls(0) {}
+
+	int post_recv() {
+		struct ibv_recv_wr wr;
+		struct ibv_recv_wr *bad_wr = NULL;
+
+		memset(&wr, 0, sizeof(wr));
+		return ibv_post_recv(rx.qp, &wr, &bad_wr);
+	}
+
+	virtual void init() {
+		ASSERT_FALSE(ring.size & (ring.size - 1)) << "ring size";
+		EXEC(ring.init());
+		EXEC(credit.init());
+		EXEC(head.init());
+		for (int i = 0; i < RING_RECVS; i++)
+			DO(post_recv());
+	}
+
+	/* The write handing what was released back to the sender */
+	void credit_wr(struct ibv_send_wr &wr, struct ibv_sge &sge) {
+		head.word(0) = r.head;
+		head.word(1) = r.done;
+		sge = head.sge((intptr_t)0, 2 * sizeof(uint64_t));
+
+		memset(&wr, 0, sizeof(wr));
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr._wr_opcode = IBV_WR_RDMA_WRITE;
+		wr.wr.rdma.remote_addr = credit.sge(0).addr;
+		wr.wr.rdma.rkey = credit.mr->rkey;
+
+		r.credited = r.head;
+		r.credited_recs = r.done;
+		credits++;
+	}
+
+	/*
+	 * Writes the record at sge, 0 once posted or -ENOSPC while the
+	 * receiver holds the space. The credits of ack, a ring the other
+	 * way, ride along in the same post.
+	 */
+	int send(struct ibv_sge sge, ibvt_ring *ack = NULL) {
+		struct ibv_send_wr wr[2], *first = &wr[1];
+		struct ibv_sge csge;
+		long off;
+
+		off = t.reserve(sge.length, ring_load(credit.word(0)),
+				ring_load(credit.word(1)));
+		if (off < 0) {
+			stalls++;
+			return off;
+		}
+
+		memset(&wr[1], 0, sizeof(wr[1]));
+		wr[1].sg_list = &sge;
+		wr[1].num_sge = 1;
+		wr[1]._wr_opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+		wr[1]._wr_imm_data = htonl(sge.length);
+		wr[1].wr.rdma.remote_addr = (uintptr_t)ring.buff + off;
+		wr[1].wr.rdma.rkey = ring.mr->rkey;
+
+		if (ack && ack->r.done != ack->r.credited_recs) {
+			ack->credit_wr(wr[0], csge);
+			wr[0].next = &wr[1];
+			first = wr;
+		}
+		return tx.post(first);
+	}
+
+	/* 1 with the next record in place, 0 when none arrived yet */
+	int recv(char **buf, size_t *len) {
+		struct ibv_wc wc;
+		int n = rx.cq.poll_wc(&wc, 1);
+
+		if (n <= 0)
+			return n;
+		if (wc.status || wc._wc_opcode != IBV_WC_RECV_RDMA_WITH_IMM)
+			return -EIO;
+		*len = ntohl(wc.imm_data);
+		*buf = ring.buff + r.next(*len);
+		n = post_recv();
+		return n ? -n : 1;
+	}
+
+	/*
+	 * Releases the records recv returned. Credits go back once a batch
+	 * is due, unless the caller piggy-backs them on a send of its own.
+	 */
+	int release(bool flush = true) {
+		struct ibv_send_wr wr;
+		struct ibv_sge sge;
+
+		r.release();
+		if (!flush || !r.due(batch))
+			return 0;
+		credit_wr(wr, sge);
+		return rx.post(&wr);
+	}
+};
+
+#endif
@@ -0,0 +1,362 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+#include "stats.h"
+#include "ring.h"
+
+#define RING_SIZE (1 << 22)
+#define RING_MAX_MSG 0x10000
+#define RING_BYTES (1L << 28)
+#define RING_MSGS 100000
+#define RING_PINGS 10000
+/* receives the send/recv pair keeps posted, RING_MAX_MSG each */
+#define SR_RECVS 64
+
+static const size_t ring_sizes[] = { 64, 1024, 16384, RING_MAX_MSG };
+
+TEST(ring, t0_place) {
+	struct ring_tx tx(256, 4);
+	struct ring_rx rx(256, 4);
+	uint64_t pos = 0;
+
+	ASSERT_EQ(0U, ring_place(pos, 256, 1));
+	ASSERT_EQ(64U, ring_place(pos, 256, 100));
+	/* a record never straddles the end */
+	ASSERT_EQ(0U, ring_place(pos, 256, 100));
+	ASSERT_EQ(384U, pos);
+
+	ASSERT_EQ(0, tx.reserve(100, 0, 0));
+	ASSERT_EQ(128, tx.reserve(100, 0, 0));
+	ASSERT_EQ(-ENOSPC, tx.reserve(1, 0, 0));
+	ASSERT_EQ(0, tx.reserve(1, 64, 1));
+	ASSERT_EQ(-ENOSPC, tx.reserve(100, 128, 1));
+	ASSERT_EQ(-ENOSPC, tx.reserve(257, 1024, 3));
+	/* out of receives before out of bytes */
+	ASSERT_EQ(64, tx.reserve(1, 128, 0));
+	ASSERT_EQ(-ENOSPC, tx.reserve(1, 320, 0));
+	ASSERT_EQ(128, tx.reserve(1, 320, 1));
+
+	/* the receiver finds the records from their lengths alone */
+	ASSERT_EQ(0U, rx.next(100));
+	ASSERT_EQ(128U, rx.next(100));
+	ASSERT_EQ(0U, rx.next(1));
+	ASSERT_EQ(64U, rx.next(1));
+	ASSERT_EQ(128U, rx.next(1));
+	ASSERT_FALSE(rx.due(256));
+	rx.release();
+	ASSERT_TRUE(rx.due(256));
+	ASSERT_EQ(448U, rx.head);
+	ASSERT_EQ(5U, rx.done);
+}
+
+TEST(ring, t1_flow) {
+	struct ring_tx tx(0x1000, 16);
+	struct ring_rx rx(0x1000, 16);
+	uint64_t head = 0, done = 0;
+	long sent = 0, stalls = 0;
+
+	/* sender and receiver in lock step, credits in batches */
+	while (sent < 10000) {
+		size_t len = 1 + (sent * 37) % 700;
+		long off = tx.reserve(len, head, done);
+
+		if (off < 0) {
+			ASSERT_EQ(-ENOSPC, off);
+			stalls++;
+			rx.release();
+			ASSERT_TRUE(rx.due(0x400));
+			head = rx.credited = rx.head;
+			done = rx.credited_recs = rx.done;
+			continue;
+		}
+		ASSERT_LE(off + len, 0x1000U);
+		ASSERT_LE(tx.tail - head, 0x1000U);
+		ASSERT_EQ((size_t)off, rx.next(len));
+		sent++;
+	}
+	ASSERT_GT(stalls, 0);
+	ASSERT_EQ(tx.tail, rx.pos);
+}
+
+struct ring_test : public testing::Test, public ibvt_env {
+	ibvt_ctx ctx;
+	ibvt_pd pd;
+	ibvt_cq scq_a, rcq_a, scq_b, rcq_b;
+	ibvt_ring_qp qa, qb;
+	ibvt_ring ab, ba;
+	ibvt_cq scq_c, rcq_c, scq_d, rcq_d;
+	ibvt_ring_qp qc, qd;
+	ibvt_mr src;
+	ibvt_mr dst_c, dst_d;
+	/* receives consumed, they are reposted in order */
+	long recvs_c, recvs_d;
+
+	ring_test() :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		scq_a(*this, ctx), rcq_a(*this, ctx),
+		scq_b(*this, ctx), rcq_b(*this, ctx),
+		qa(*this, pd, scq_a, rcq_a),
+		qb(*this, pd, scq_b, rcq_b),
+		ab(*this, qa, qb, RING_SIZE),
+		ba(*this, qb, qa, RING_SIZE),
+		scq_c(*this, ctx), rcq_c(*this, ctx),
+		scq_d(*this, ctx), rcq_d(*this, ctx),
+		qc(*this, pd, scq_c, rcq_c),
+		qd(*this, pd, scq_d, rcq_d),
+		src(*this, pd, 2 * RING_MAX_MSG),
+		dst_c(*this, pd, SR_RECVS * RING_MAX_MSG),
+		dst_d(*this, pd, SR_RECVS * RING_MAX_MSG),
+		recvs_c(0),
+		recvs_d(0) {}
+
+	virtual void SetUp() {
+		INIT(ctx.init());
+		INIT(qa.init());
+		INIT(qb.init());
+		INIT(qc.init());
+		INIT(qd.init());
+		INIT(qa.connect(&qb));
+		INIT(qb.connect(&qa));
+		INIT(qc.connect(&qd));
+		INIT(qd.connect(&qc));
+		INIT(ab.init());
+		INIT(ba.init());
+		INIT(src.fill());
+		INIT(dst_c.init());
+		INIT(dst_d.init());
+		for (int i = 0; i < SR_RECVS; i++) {
+			INIT(qc.recv(dst_c.sge(i * RING_MAX_MSG, RING_MAX_MSG)));
+			INIT(qd.recv(dst_d.sge(i * RING_MAX_MSG, RING_MAX_MSG)));
+		}
+	}
+
+	virtual void TearDown() {
+		ASSERT_FALSE(HasFailure());
+	}
+
+	/* message seq starts at this offset of the src pattern */
+	struct ibv_sge msg(long seq, size_t len) {
+		return src.sge((seq * RING_ALIGN) % RING_MAX_MSG, len);
+	}
+
+	/* every byte of the record against the filled src it was sent from */
+	void check(long seq, char *p, size_t len) {
+		size_t start = (seq * RING_ALIGN) % RING_MAX_MSG;
+		size_t i;
+
+		if (!memcmp(p, src.buff + start, len))
+			return;
+		for (i = 0; p[i] == src.buff[start + i]; i++)
+			;
+		ASSERT_EQ(src.buff[start + i], p[i])
+			<< "seq " << seq << " offset " << i << " of " << len;
+	}
+
+	void ring_send(ibvt_ring &r, struct ibv_sge sge, ibvt_ring *ack) {
+		long retries = POLL_RETRIES;
+		int ret;
+
+		while ((ret = r.send(sge, ack)) == -ENOSPC)
+			ASSERT_GT(--retries, 0);
+		ASSERT_EQ(0, ret);
+	}
+
+	void ring_recv(ibvt_ring &r, char **p, size_t *len) {
+		long retries = POLL_RETRIES;
+		int ret;
+
+		while (!(ret = r.recv(p, len)))
+			ASSERT_GT(--retries, 0);
+		ASSERT_EQ(1, ret);
+	}
+
+	/*
+	 * The send/recv side has the same selective signaling. Its
+	 * receiver reposts in order and the sender sees that directly,
+	 * which a real channel would have to send back.
+	 */
+	void sr_send(ibvt_ring_qp &q, struct ibv_sge sge) {
+		struct ibv_send_wr wr;
+
+		memset(&wr, 0, sizeof(wr));
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr._wr_opcode = IBV_WR_SEND;
+		ASSERT_EQ(0, q.post(&wr));
+	}
+
+	void sr_recv(ibvt_ring_qp &q, ibvt_mr &dst, long &n, char **p,
+		     size_t *len) {
+		struct ibv_wc wc;
+		long retries = POLL_RETRIES;
+		int ret;
+
+		while (!(ret = q.cq.poll_wc(&wc, 1)))
+			ASSERT_GT(--retries, 0);
+		ASSERT_EQ(1, ret);
+		ASSERT_FALSE(wc.status) << ibv_wc_status_str(wc.status);
+		*p = dst.buff + (n % SR_RECVS) * RING_MAX_MSG;
+		*len = wc.byte_len;
+	}
+
+	/* consumed in place, the buffer goes back to the receive queue */
+	void sr_repost(ibvt_ring_qp &q, ibvt_mr &dst, long &n) {
+		size_t off = (n % SR_RECVS) * RING_MAX_MSG;
+
+		EXECL(q.recv(dst.sge(off, RING_MAX_MSG)));
+		n++;
+	}
+
+	void stream(size_t len) {
+		long msgs = std::max(1000L, std::min((long)RING_MSGS,
+						     RING_BYTES / (long)len));
+		long sent = 0, done = 0, recvd = 0;
+		long stalls = ab.stalls, credits = ab.credits;
+		size_t l;
+		char *p;
+		double t;
+		int ret;
+
+		t = lat_now();
+		while (done < msgs) {
+			while (sent < msgs &&
+			       !(ret = ab.send(msg(sent, len))))
+				sent++;
+			ASSERT_TRUE(sent == msgs || ret == -ENOSPC) << ret;
+			while ((ret = ab.recv(&p, &l)) > 0) {
+				ASSERT_EQ(len, l);
+				EXEC(check(done, p, l));
+				done++;
+			}
+			ASSERT_EQ(0, ret);
+			ASSERT_EQ(0, ab.release());
+		}
+		t = lat_now() - t;
+		VERBS_NOTICE("ring %6zu bytes: %.0f msgs/s, %.1f MB/s, "
+			     "%ld stalls, %ld credit writes\n", len,
+			     msgs / t * 1e6, msgs * len / t, ab.stalls - stalls,
+			     ab.credits - credits);
+
+		t = lat_now();
+		for (sent = 0; recvd < msgs; ) {
+			while (sent < msgs && sent - recvd < SR_RECVS) {
+				EXEC(sr_send(qc, msg(sent, len)));
+				sent++;
+			}
+			EXEC(sr_recv(qd, dst_d, recvs_d, &p, &l));
+			ASSERT_EQ(len, l);
+			EXEC(check(recvd, p, l));
+			EXEC(sr_repost(qd, dst_d, recvs_d));
+			recvd++;
+		}
+		t = lat_now() - t;
+		VERBS_NOTICE("send %6zu bytes: %.0f msgs/s, %.1f MB/s\n", len,
+			     msgs / t * 1e6, msgs * len / t);
+	}
+
+	void pingpong(size_t len) {
+		ibvt_lat ring_rtt(RING_PINGS), sr_rtt(RING_PINGS);
+		size_t l;
+		char *p;
+		double t;
+
+		for (long i = 0; i < RING_PINGS; i++) {
+			t = lat_now();
+			EXEC(ring_send(ab, msg(i, len), &ba));
+			EXEC(ring_recv(ab, &p, &l));
+			EXEC(check(i, p, l));
+			ab.release(false);
+			EXEC(ring_send(ba, msg(i, len), &ab));
+			EXEC(ring_recv(ba, &p, &l));
+			EXEC(check(i, p, l));
+			ba.release(false);
+			ring_rtt.add(lat_now() - t);
+		}
+
+		for (long i = 0; i < RING_PINGS; i++) {
+			t = lat_now();
+			EXEC(sr_send(qc, msg(i, len)));
+			EXEC(sr_recv(qd, dst_d, recvs_d, &p, &l));
+			EXEC(check(i, p, l));
+			EXEC(sr_repost(qd, dst_d, recvs_d));
+			EXEC(sr_send(qd, msg(i, len)));
+			EXEC(sr_recv(qc, dst_c, recvs_c, &p, &l));
+			EXEC(check(i, p, l));
+			EXEC(sr_repost(qc, dst_c, recvs_c));
+			sr_rtt.add(lat_now() - t);
+		}
+
+		VERBS_NOTICE("%zu bytes round trip, %ld piggy-backed credits\n",
+			     len, ab.credits + ba.credits);
+		ring_rtt.report("  ring");
+		sr_rtt.report("  send/recv");
+	}
+};
+
+TEST_F(ring_test, t2_records) {
+	size_t l;
+	char *p;
+
+	CHK_SUT(ring);
+	/* lengths that wrap the ring at odd places, credits on the way */
+	for (long i = 0; i < 4 * RING_SIZE / RING_MAX_MSG; i++) {
+		size_t len = 1 + (i * 4099) % RING_MAX_MSG;
+
+		EXEC(ring_send(ab, msg(i, len), NULL));
+		EXEC(ring_recv(ab, &p, &l));
+		ASSERT_EQ(len, l);
+		EXEC(check(i, p, l));
+		ASSERT_EQ(0, ab.release());
+	}
+	ASSERT_GT(ab.credits, 0);
+}
+
+TEST_F(ring_test, b0_stream) {
+	CHK_SUT(ring);
+	for (size_t i = 0; i < ARRAY_SIZE(ring_sizes); i++)
+		EXEC(stream(ring_sizes[i]));
+}
+
+TEST_F(ring_test, b1_pingpong) {
+	CHK_SUT(ring);
+	for (size_t i = 0; i < ARRAY_SIZE(ring_sizes); i++)
+		EXEC(pingpong(ring_sizes[i]));
+}
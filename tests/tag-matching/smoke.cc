@@ -40,11 +40,16 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
 
 #include <infiniband/verbs.h>
 
 #include "env.h"
 #include "enum.h"
+#include "stats.h"
+#include "tm_sw.h"
 
 #ifdef HAVE_INFINIBAND_VERBS_EXP_H
 #include <infiniband/verbs_exp.h>
@@ -97,6 +102,7 @@
 #define IBV_TMH_EAGER IBV_EXP_TMH_EAGER
 #define IBV_TMH_RNDV IBV_EXP_TMH_RNDV
 #define IBV_TMH_NO_TAG IBV_EXP_TMH_NO_TAG
+#define IBV_TMH_FIN IBV_EXP_TMH_FIN
 #define IBV_WC_TM_MATCH IBV_EXP_WC_TM_MATCH
 #define IBV_WC_TM_DATA_VALID IBV_EXP_WC_TM_DATA_VALID
 #define ibv_rvh ibv_tmh_rvh
@@ -166,8 +172,8 @@ struct ibvt_srq_tm : public ibvt_srq {
 		ibvt_srq::init_attr(attr);
 		attr.comp_mask |= IBV_SRQ_INIT_ATTR_TM;
 		attr.srq_type = IBV_SRQT_TM;
-		attr.tm_cap.max_ops = 10;
-		attr.tm_cap.max_num_tags = 63;
+		attr.tm_cap.max_ops = TM_MAX_OPS;
+		attr.tm_cap.max_num_tags = TM_MAX_TAGS;
 
 		init_attr_dc(attr);
 	}
@@ -215,11 +221,18 @@ struct ibvt_srq_tm : public ibvt_srq {
 
 };
 
+/* rendezvous headers in flight per QP, a slot is reused that many sends later */
+#define TM_HDR_SLOTS 64
+#define TM_HDR_SIZE 0x20
+
 struct ibvt_qp_tm_rc : public ibvt_qp_rc {
 	ibvt_ctx &ctx;
+	ibvt_mr hdr;
+	int hdr_idx;
 
 	ibvt_qp_tm_rc(ibvt_env &e, ibvt_ctx &d, ibvt_pd &p, ibvt_cq &c) :
-		ibvt_qp_rc(e, p, c), ctx(d) {}
+		ibvt_qp_rc(e, p, c), ctx(d),
+		hdr(e, p, TM_HDR_SIZE * TM_HDR_SLOTS), hdr_idx(0) {}
 
 	virtual void init_attr(struct ibv_qp_init_attr_ex &attr)
 	{
@@ -227,6 +240,12 @@ struct ibvt_qp_tm_rc : public ibvt_qp_rc {
 		attr.cap.max_inline_data = 0x80;
 	}
 
+	virtual void init()
+	{
+		INIT(ibvt_qp_rc::init());
+		INIT(hdr.init());
+	}
+
 	virtual void send(ibv_sge sge, uint64_t tag, int tm_op,
 			  ibv_wr_opcode op = IBV_WR_SEND,
 			  int flags = IBV_SEND_SIGNALED)
@@ -241,21 +260,23 @@ struct ibvt_qp_tm_rc : public ibvt_qp_rc {
 
 	virtual void rndv(ibv_sge sge, uint64_t tag)
 	{
-		ibvt_mr hdr(this->env, this->pd, 0x20);
+		struct ibv_sge slot;
 		struct ibv_tmh *tmh;
 		struct ibv_rvh *rvh;
 
-		hdr.init();
-		tmh = (ibv_tmh *)hdr.sge().addr;
+		slot = hdr.sge(TM_HDR_SIZE * hdr_idx, TM_HDR_SIZE);
+		hdr_idx = (hdr_idx + 1) % TM_HDR_SLOTS;
+		tmh = (ibv_tmh *)slot.addr;
 		rvh = (ibv_rvh *)(tmh + 1);
 
+		memset(tmh, 0, TM_HDR_SIZE);
 		tmh->opcode = IBV_TMH_RNDV;
 		tmh->tag = htobe64(tag);
 		rvh->rkey = htobe32(sge.lkey);
 		rvh->va = htobe64(sge.addr);
 		rvh->len = htobe32(sge.length);
 
-		this->post_send(hdr.sge(), IBV_WR_SEND);
+		this->post_send(slot, IBV_WR_SEND);
 	}
 };
 
@@ -512,6 +533,328 @@ struct tag_matching_dc : public tag_matching_base {
 
 #endif
 
+/*
+ * Tag matching without TM hardware: a plain SRQ lands every message in a
+ * bounce slot and tm_sw_engine decides where it goes, so the scenarios
+ * below run on any RC capable device and give the results the TM SRQ is
+ * expected to match.
+ */
+
+#define TM_SW_SLOTS 16
+#define TM_SW_HDR 0x10
+/* rendezvous READs and their FINs in flight */
+#define TM_SW_PULLS 64
+
+struct tm_sw_wc {
+	int status;
+	int opcode;
+	int flags;
+	uint32_t byte_len;
+	uint64_t wr_id;
+};
+
+/* a rendezvous being pulled into its receive */
+struct tm_sw_pull {
+	uint32_t app_ctx;
+	uint32_t len;
+	uint64_t tag;
+	uint64_t wr_id;
+};
+
+struct tag_matching_sw_base : public tag_matching_base {
+	tm_sw_engine engine;
+	std::deque<struct tm_sw_wc> vcq;
+	int ops;
+
+	tag_matching_sw_base() : engine(TM_MAX_TAGS), ops(0) {}
+
+	/* moves the messages that arrived since the last call */
+	virtual void progress() = 0;
+
+	void complete(int status, int opcode, int flags, uint32_t len,
+		      uint64_t wr_id) {
+		struct tm_sw_wc wc = { status, opcode, flags, len, wr_id };
+
+		vcq.push_back(wc);
+	}
+};
+
+/* a real CQ whose completions depend on the software receiver */
+struct ibvt_cq_sw : public ibvt_cq {
+	tag_matching_sw_base &tm;
+
+	ibvt_cq_sw(tag_matching_sw_base &e, ibvt_ctx &c) : ibvt_cq(e, c), tm(e) {}
+
+	virtual int poll_wc(struct ibv_wc *wc, int n) {
+		tm.progress();
+		if (testing::Test::HasFatalFailure())
+			return -1;
+		return ibvt_cq::poll_wc(wc, n);
+	}
+};
+
+/* the TM SRQ completions, produced by the engine */
+struct ibvt_cq_tm_sw : public ibvt_cq {
+	tag_matching_sw_base &tm;
+
+	ibvt_cq_tm_sw(tag_matching_sw_base &e, ibvt_ctx &c) : ibvt_cq(e, c), tm(e) {}
+
+	virtual void poll(int n) {
+		struct tm_sw_wc wc;
+		long retries = POLL_RETRIES;
+
+		VERBS_TRACE("%d.%p polling...\n", __LINE__, this);
+
+		while (tm.vcq.empty() && --retries)
+			EXEC(tm.progress());
+		ASSERT_GT(retries,0);
+
+		wc = tm.vcq.front();
+		tm.vcq.pop_front();
+
+		if (wc.opcode == IBV_WC_TM_RECV && !(wc.flags & (IBV_WC_TM_MATCH | IBV_WC_TM_DATA_VALID)))
+			tm.phase_cnt ++;
+		if (wc.opcode == IBV_WC_TM_ADD || wc.opcode == IBV_WC_TM_DEL)
+			tm.ops --;
+
+		VERBS_INFO("poll status %s(%d) opcode %s(%d) len %d flags %x wr_id %lx\n",
+				ibv_wc_status_str((enum ibv_wc_status)wc.status), wc.status,
+				ibv_wc_opcode_str((enum ibv_wc_opcode)wc.opcode), wc.opcode,
+				wc.byte_len, wc.flags, wc.wr_id);
+		ASSERT_FALSE(wc.status) << ibv_wc_status_str((enum ibv_wc_status)wc.status);
+	}
+};
+
+struct ibvt_srq_tm_sw : public ibvt_srq {
+	tag_matching_sw_base &tm;
+	std::deque<struct ibv_sge> unexp_sge;
+
+	ibvt_srq_tm_sw(tag_matching_sw_base &e, ibvt_pd &p, ibvt_cq &c) :
+		 ibvt_srq(e, p, c), tm(e) {}
+
+	virtual void slot(ibv_sge sge, uint64_t idx) {
+		struct ibv_recv_wr wr;
+		struct ibv_recv_wr *bad_wr = NULL;
+
+		memset(&wr, 0, sizeof(wr));
+		wr.wr_id = idx;
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		DO(ibv_post_srq_recv(srq, &wr, &bad_wr));
+	}
+
+	virtual void unexp(ibvt_mr &mr, int start, int length) {
+		unexp_sge.push_back(mr.sge(start, length));
+	}
+
+	virtual void append(ibvt_mr &mr, int start, int length,
+			    uint64_t tag, int *idx)
+	{
+		int h;
+
+		ASSERT_LT(tm.ops, TM_MAX_OPS) << "too many tag operations outstanding";
+		h = tm.engine.append(tag, TM_SW_FULL_MASK, tag,
+				     mr.sge(start, length), tm.phase_cnt);
+		ASSERT_NE(-ENOSPC, h) << "posted list is full";
+		tm.ops ++;
+		tm.complete(h < 0 ? IBV_WC_GENERAL_ERR : IBV_WC_SUCCESS,
+			    IBV_WC_TM_ADD, 0, 0, tag);
+		if (idx)
+			*idx = h;
+	}
+
+	virtual void remove(int idx)
+	{
+		ASSERT_LT(tm.ops, TM_MAX_OPS) << "too many tag operations outstanding";
+		tm.ops ++;
+		tm.complete(tm.engine.remove(idx) ? IBV_WC_SUCCESS :
+			    IBV_WC_GENERAL_ERR, IBV_WC_TM_DEL, 0, 0, idx);
+	}
+};
+
+/* the receiving side of the software engine, pulls rendezvous data */
+struct ibvt_qp_sw : public ibvt_qp_rc {
+	ibvt_srq &srq;
+
+	ibvt_qp_sw(ibvt_env &e, ibvt_pd &p, ibvt_cq &c, ibvt_srq &s) :
+		    ibvt_qp_rc(e, p, c), srq(s) {}
+
+	virtual void init_attr(struct ibv_qp_init_attr_ex &attr)
+	{
+		ibvt_qp_rc::init_attr(attr);
+		attr.srq = srq.srq;
+	}
+
+	virtual void post(ibv_sge sge, enum ibv_wr_opcode opcode,
+			  uint64_t wr_id, uint64_t va = 0, uint32_t rkey = 0) {
+		struct ibv_send_wr wr;
+		struct ibv_send_wr *bad_wr = NULL;
+
+		memset(&wr, 0, sizeof(wr));
+		wr.wr_id = wr_id;
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr._wr_opcode = opcode;
+		wr._wr_send_flags = IBV_SEND_SIGNALED;
+		wr.wr.rdma.remote_addr = va;
+		wr.wr.rdma.rkey = rkey;
+		DO(ibv_post_send(qp, &wr, &bad_wr));
+	}
+};
+
+struct tag_matching_sw : public tag_matching_sw_base {
+	struct ibvt_ctx ctx;
+	struct ibvt_pd pd;
+	struct ibvt_cq_tm_sw srq_cq;
+	struct ibvt_srq_tm_sw srq;
+	struct ibvt_cq_sw send_cq;
+	struct ibvt_qp_tm_rc send_qp;
+	struct ibvt_cq recv_cq;
+	struct ibvt_qp_sw recv_qp;
+	struct ibvt_mr src_mr;
+	struct ibvt_mr dst_mr;
+	struct ibvt_mr fin;
+	struct ibvt_mr bounce;
+	struct ibvt_mr ctl;
+	size_t sz;
+	/*
+	 * A ring of rendezvous pulls, apart from the bounce slots, which go
+	 * back to the SRQ before the READ completes. An entry and its FIN
+	 * header in ctl are in use from the READ until the FIN is sent, READs
+	 * and sends complete in order on recv_qp.
+	 */
+	std::vector<struct tm_sw_pull> pull;
+	uint64_t pull_head;
+	uint64_t pull_done;
+
+	tag_matching_sw(int s) :
+		ctx(*this, NULL),
+		pd(*this, ctx),
+		srq_cq(*this, ctx),
+		srq(*this, pd, srq_cq),
+		send_cq(*this, ctx),
+		send_qp(*this, ctx, pd, send_cq),
+		recv_cq(*this, ctx),
+		recv_qp(*this, pd, recv_cq, srq),
+		src_mr(*this, pd, s),
+		dst_mr(*this, pd, s),
+		fin(*this, pd, 0x20),
+		bounce(*this, pd, (size_t)s * TM_SW_SLOTS),
+		ctl(*this, pd, TM_SW_HDR * TM_SW_PULLS),
+		sz(s),
+		pull(TM_SW_PULLS),
+		pull_head(0),
+		pull_done(0)
+	{}
+
+	virtual void init() {
+		INIT(ctx.init());
+		INIT(srq.init());
+		INIT(send_qp.init());
+		INIT(recv_qp.init());
+		INIT(recv_qp.connect(&send_qp));
+		INIT(send_qp.connect(&recv_qp));
+		INIT(src_mr.fill());
+		INIT(dst_mr.init());
+		INIT(fin.init());
+		INIT(bounce.init());
+		INIT(ctl.init());
+		for (int i = 0; i < TM_SW_SLOTS; i++)
+			INIT(srq.slot(bounce.sge(sz * i, sz), i));
+	}
+
+	void arrive(uint64_t idx, uint32_t len) {
+		char *msg = bounce.buff + sz * idx;
+		struct ibv_tmh *tmh = (struct ibv_tmh *)msg;
+		uint64_t tag = be64toh(tmh->tag);
+		struct ibv_sge sge;
+		int h = -1;
+
+		if (tmh->opcode != IBV_TMH_NO_TAG)
+			h = engine.match(tag);
+
+		if (h < 0) {
+			/* the whole message, header included, like the TM SRQ */
+			ASSERT_FALSE(srq.unexp_sge.empty()) << "no buffer for an unexpected message";
+			sge = srq.unexp_sge.front();
+			srq.unexp_sge.pop_front();
+			len = std::min(len, sge.length);
+			memcpy((void *)sge.addr, msg, len);
+			if (tmh->opcode == IBV_TMH_NO_TAG) {
+				complete(IBV_WC_SUCCESS, IBV_WC_TM_NO_TAG, 0, len, 0);
+			} else {
+				engine.miss();
+				complete(IBV_WC_SUCCESS, IBV_WC_TM_RECV, 0, len, tag);
+			}
+		} else if (tmh->opcode == IBV_TMH_RNDV) {
+			struct ibv_rvh *rvh = (struct ibv_rvh *)(tmh + 1);
+			struct tm_sw_pull *p = &pull[pull_head % TM_SW_PULLS];
+
+			ASSERT_LT(pull_head - pull_done, (uint64_t)TM_SW_PULLS)
+				<< "too many rendezvous in flight";
+			/* match() released h, it stays intact until the next append */
+			sge = engine.posted[h].sge;
+			sge.length = std::min(sge.length, be32toh(rvh->len));
+			p->app_ctx = tmh->app_ctx;
+			p->len = sge.length;
+			p->tag = tag;
+			p->wr_id = engine.posted[h].wr_id;
+			EXEC(recv_qp.post(sge, IBV_WR_RDMA_READ, pull_head,
+					  be64toh(rvh->va), be32toh(rvh->rkey)));
+			pull_head++;
+		} else {
+			sge = engine.posted[h].sge;
+			len = std::min(len - std::min(len, (uint32_t)TM_SW_HDR),
+				       sge.length);
+			memcpy((void *)sge.addr, msg + TM_SW_HDR, len);
+			complete(IBV_WC_SUCCESS, IBV_WC_TM_RECV,
+				 IBV_WC_TM_MATCH | IBV_WC_TM_DATA_VALID, len,
+				 engine.posted[h].wr_id);
+		}
+		EXEC(srq.slot(bounce.sge(sz * idx, sz), idx));
+	}
+
+	/* the rendezvous data is in place, release the sender */
+	void pulled(uint64_t pos) {
+		uint64_t idx = pos % TM_SW_PULLS;
+		struct ibv_tmh *tmh = (struct ibv_tmh *)(ctl.buff + TM_SW_HDR * idx);
+
+		memset(tmh, 0, sizeof(*tmh));
+		tmh->opcode = IBV_TMH_FIN;
+		tmh->app_ctx = pull[idx].app_ctx;
+		tmh->tag = htobe64(pull[idx].tag);
+		EXEC(recv_qp.post(ctl.sge(TM_SW_HDR * idx, TM_SW_HDR),
+				  IBV_WR_SEND, pos));
+		complete(IBV_WC_SUCCESS, IBV_WC_TM_RECV,
+			 IBV_WC_TM_MATCH | IBV_WC_TM_DATA_VALID,
+			 pull[idx].len, pull[idx].wr_id);
+	}
+
+	virtual void progress() {
+		struct ibv_wc wc[4];
+		int n = recv_cq.poll_wc(wc, 4);
+
+		ASSERT_GE(n, 0);
+		for (int i = 0; i < n; i++) {
+			ASSERT_FALSE(wc[i].status) << ibv_wc_status_str(wc[i].status);
+			if (wc[i]._wc_opcode == IBV_WC_RECV)
+				EXEC(arrive(wc[i].wr_id, wc[i].byte_len));
+			else if (wc[i]._wc_opcode == IBV_WC_RDMA_READ)
+				EXEC(pulled(wc[i].wr_id));
+			else if (wc[i]._wc_opcode == IBV_WC_SEND)
+				pull_done++;
+		}
+	}
+
+	void rndv(int start, int length, uint64_t tag) {
+		EXEC(send_qp.recv(fin.sge()));
+		EXEC(send_qp.rndv(src_mr.sge(start, length), tag));
+		EXEC(send_cq.poll(1));
+		EXEC(send_cq.poll(1));
+		EXEC(srq_cq.poll(1));
+	}
+};
+
 template <typename T1, int val>
 struct types {
 	typedef T1 Base;
@@ -524,14 +867,29 @@ typedef testing::Types<
 	types<tag_matching_dc, 0x2000>,
 	types<tag_matching_dc, 0x40000>,
 #endif
+	types<tag_matching_sw, 0x40>,
+	types<tag_matching_sw, 0x2000>,
+	types<tag_matching_sw, 0x40000>,
 	types<tag_matching_rc, 0x40>,
 	types<tag_matching_rc, 0x2000>,
 	types<tag_matching_rc, 0x40000>
 > tm_cq_list;
 
+#define TM_EAGER_MAX 0x2000
+#define TM_SWEEP 100
+#define TM_REPEAT 10000
+
+/* largest message sent eager, IBV_TM_EAGER overrides */
+static inline int tm_eager_max()
+{
+	return getenv("IBV_TM_EAGER") ? strtol(getenv("IBV_TM_EAGER"), NULL, 0) : TM_EAGER_MAX;
+}
+
 template <typename T>
 struct tag_matching : public testing::Test, public T::Base {
-	tag_matching() : T::Base(SZ()) {}
+	int eager_max;
+
+	tag_matching() : T::Base(SZ()), eager_max(tm_eager_max()) {}
 
 	int SZ() { return T::size; }
 
@@ -555,6 +913,35 @@ struct tag_matching : public testing::Test, public T::Base {
 		EXEC(srq.unexp(this->dst_mr, start, length));
 	}
 
+	/*
+	 * A tagged message picking its protocol by size. Eager leaves the
+	 * payload without the header at the start of the receive, rendezvous
+	 * the whole source.
+	 */
+	void message(int length, uint64_t tag, bool *eager_sent = NULL) {
+		bool e = length <= eager_max;
+
+		EXEC(append(0, length, tag));
+		if (e) {
+			EXEC(eager(0, length, tag));
+			/* the header went over the source pattern */
+			for (int i = 0; i < 0x10; i++)
+				this->src_mr.buff[i] = i;
+		} else {
+			EXEC(rndv(0, length, tag));
+		}
+		if (eager_sent)
+			*eager_sent = e;
+	}
+
+	void check_msg(int length, bool eager_sent) {
+		int skip = eager_sent ? 0x10 : 0;
+
+		for (int i = 0; i < length - skip; i++)
+			ASSERT_EQ((char)((i + skip) & 0xff), this->dst_mr.buff[i]) << "i=" << i;
+		memset(this->dst_mr.buff, 0, length);
+	}
+
 	virtual void SetUp() {
 		T::Base::init();
 	}
@@ -791,18 +1178,21 @@ TYPED_TEST(tag_matching, r1_match) {
 
 }
 
-#ifdef YONATAN
-TYPED_TEST(tag_matching, rX_match) {
+TYPED_TEST(tag_matching, r4_repeat) {
+	ibvt_lat lat(TM_REPEAT);
 	CHK_SUT(tag-matching);
 	EXEC(fix_uwq());
-	for (int i = 0 ; i < 10000 ; i++) {
+	for (int i = 0 ; i < TM_REPEAT ; i++) {
+		double t;
+
 		EXEC(append(0, this->SZ(), 0x1234567890));
+		t = lat_now();
 		EXEC(rndv(0, this->SZ(), 0x1234567890));
+		lat.add(lat_now() - t);
 		EXEC(dst_mr.check());
 	}
-
+	lat.report("rndv");
 }
-#endif
 
 TYPED_TEST(tag_matching, r2_match2) {
 	CHK_SUT(tag-matching);
@@ -853,3 +1243,132 @@ TYPED_TEST(tag_matching, s0_append_remove) {
 	EXEC(dst_mr.check(0x10));
 }
 
+/* eager and rendezvous latency by size, the first size rendezvous wins at */
+TYPED_TEST(tag_matching, p0_crossover) {
+	int cross = 0;
+	CHK_SUT(tag-matching);
+	EXEC(fix_uwq());
+	for (int len = 0x40; len <= this->SZ(); len *= 2) {
+		ibvt_lat eager(TM_SWEEP), rndv(TM_SWEEP);
+
+		for (int i = 0; i < TM_SWEEP; i++) {
+			double t;
+
+			EXEC(append(0, len, i));
+			t = lat_now();
+			EXEC(eager(0, len, i));
+			eager.add(lat_now() - t);
+
+			EXEC(append(0, len, i));
+			t = lat_now();
+			EXEC(rndv(0, len, i));
+			rndv.add(lat_now() - t);
+		}
+		VERBS_NOTICE("tm len 0x%x: eager p50 %.2f p99 %.2f, rndv p50 %.2f p99 %.2f usec\n",
+			     len, eager.pct(50), eager.pct(99), rndv.pct(50), rndv.pct(99));
+		if (!cross && rndv.pct(50) < eager.pct(50))
+			cross = len;
+	}
+	if (cross)
+		VERBS_NOTICE("tm rendezvous wins from 0x%x, eager threshold 0x%x\n",
+			     cross, this->eager_max);
+	else
+		VERBS_NOTICE("tm eager wins up to 0x%x, eager threshold 0x%x\n",
+			     this->SZ(), this->eager_max);
+}
+
+/* sizes on both sides of the threshold, each message checked */
+TYPED_TEST(tag_matching, p1_threshold) {
+	ibvt_lat lat[2];
+	CHK_SUT(tag-matching);
+	EXEC(fix_uwq());
+	for (int i = 0; i < TM_SWEEP; i++) {
+		for (int len = 0x40; len <= this->SZ(); len *= 2) {
+			bool e;
+			double t = lat_now();
+
+			EXEC(message(len, len, &e));
+			lat[e].add(lat_now() - t);
+			EXEC(check_msg(len, e));
+		}
+	}
+	lat[1].report("tm eager");
+	lat[0].report("tm rndv");
+}
+
+#define TM_OPS 0x10000
+
+/*
+ * Tag operation throughput with up to TM_MAX_OPS of them in flight while
+ * the posted list stays near full, eager match latency against list
+ * occupancy and what an unexpected message costs the next append.
+ */
+TYPED_TEST(tag_matching, b0_ops) {
+	int occ[] = { 1, 8, 32, TM_MAX_TAGS - TM_MAX_OPS };
+	int depth[] = { 1, 2, 5, TM_MAX_OPS };
+	std::deque<int> live;
+	uint64_t tag = 0x1000;
+	ibvt_lat resync(TM_SWEEP), plain(TM_SWEEP);
+	double t;
+	int idx, n;
+
+	CHK_SUT(tag-matching);
+	t = lat_now();
+	EXEC(fix_uwq());
+	VERBS_NOTICE("tm fix_uwq %.2f usec\n", lat_now() - t);
+
+	for (size_t o = 0; o < sizeof(occ) / sizeof(occ[0]); o++) {
+		ibvt_lat lat(TM_SWEEP);
+
+		while ((int)live.size() < occ[o] - 1) {
+			EXEC(append(0, this->SZ(), tag++, &idx));
+			live.push_back(idx);
+		}
+		for (int i = 0; i < TM_SWEEP; i++) {
+			EXEC(append(0, this->SZ(), 1));
+			t = lat_now();
+			EXEC(eager(0, 0x40, 1));
+			lat.add(lat_now() - t);
+		}
+		VERBS_NOTICE("tm %d posted: match p50 %.2f p99 %.2f usec\n",
+			     occ[o], lat.pct(50), lat.pct(99));
+	}
+	EXEC(append(0, this->SZ(), tag++, &idx));
+	live.push_back(idx);
+
+	for (size_t d = 0; d < sizeof(depth) / sizeof(depth[0]); d++) {
+		t = lat_now();
+		for (n = 0; n < TM_OPS; n += depth[d]) {
+			for (int k = 0; k < depth[d]; k++) {
+				if ((n + k) & 1) {
+					EXEC(srq.append(this->dst_mr, 0, this->SZ(), tag++, &idx));
+					live.push_back(idx);
+				} else {
+					EXEC(srq.remove(live.front()));
+					live.pop_front();
+				}
+			}
+			for (int k = 0; k < depth[d]; k++)
+				EXEC(srq_cq.poll(0));
+		}
+		t = lat_now() - t;
+		VERBS_NOTICE("tm %d ops in flight: %.0f ops/s\n",
+			     depth[d], n / t * 1e6);
+	}
+
+	for (int i = 0; i < TM_SWEEP; i++) {
+		EXEC(recv(0, this->SZ()));
+		EXEC(eager(0, 0x40, 2));
+		t = lat_now();
+		EXEC(append(0, this->SZ(), 2));
+		resync.add(lat_now() - t);
+		EXEC(eager(0, 0x40, 2));
+
+		t = lat_now();
+		EXEC(append(0, this->SZ(), 2));
+		plain.add(lat_now() - t);
+		EXEC(eager(0, 0x40, 2));
+	}
+	VERBS_NOTICE("tm append p50 %.2f usec, %.2f after an unexpected message\n",
+		     plain.pct(50), resync.pct(50));
+}
@@ -0,0 +1,269 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <infiniband/verbs.h>
+
+#include "env.h"
+#include "stats.h"
+#include "tm_sw.h"
+
+#define TM_SW_OPS (1 << 18)
+#define TM_SW_MAX_DEPTH 4096
+
+static struct ibv_sge tm_sge(uint64_t addr)
+{
+	struct ibv_sge sge;
+
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = addr;
+	sge.length = 0x40;
+	return sge;
+}
+
+TEST(tm_sw, t0_oracle) {
+	struct tm_sw_engine tm(4);
+	int h[4], u;
+
+	/* a wildcard posted first wins over an exact match posted later */
+	h[0] = tm.append(0x100, 0xff00, 1, tm_sge(1), 0);
+	h[1] = tm.append(0x1ab, TM_SW_FULL_MASK, 2, tm_sge(2), 0);
+	h[2] = tm.append(0x1ab, TM_SW_FULL_MASK, 3, tm_sge(3), 0);
+	ASSERT_GE(h[0], 0);
+	ASSERT_GE(h[1], 0);
+	ASSERT_GE(h[2], 0);
+	ASSERT_EQ(h[0], tm.match(0x1ab));
+	ASSERT_EQ(h[1], tm.match(0x1ab));
+
+	/* an exact match posted first wins over a later wildcard */
+	h[3] = tm.append(0, 0, 4, tm_sge(4), 0);
+	ASSERT_EQ(h[2], tm.match(0x1ab));
+	ASSERT_EQ(4U, tm.posted[tm.match(0x1ab)].wr_id);
+
+	/* cancelled receives never match, the handle is reused */
+	h[0] = tm.append(0x5, TM_SW_FULL_MASK, 5, tm_sge(5), 0);
+	ASSERT_TRUE(tm.remove(h[0]));
+	ASSERT_FALSE(tm.remove(h[0]));
+	ASSERT_EQ(-1, tm.match(0x5));
+
+	/* unexpected messages bump the phase an append must quote */
+	u = tm.arrive(0x7, 7);
+	tm.arrive(0x8, 8);
+	tm.arrive(0x7, 9);
+	ASSERT_EQ(-EAGAIN, tm.append(0x7, TM_SW_FULL_MASK, 7, tm_sge(7), 0));
+	ASSERT_EQ(3, tm.phase);
+	ASSERT_EQ(u, tm.probe(0x7, TM_SW_FULL_MASK));
+	ASSERT_EQ(8U, tm.unexpected[tm.probe(0, 0)].wr_id);
+	ASSERT_EQ(9U, tm.unexpected[tm.probe(0x7, 0xf)].wr_id);
+	ASSERT_EQ(-1, tm.probe(0, 0));
+
+	for (int i = 0; i < 4; i++)
+		ASSERT_GE(tm.append(i, TM_SW_FULL_MASK, i, tm_sge(i), 3), 0);
+	ASSERT_EQ(-ENOSPC, tm.append(4, TM_SW_FULL_MASK, 4, tm_sge(4), 3));
+	ASSERT_EQ(4, tm.num_posted);
+}
+
+/*
+ * Matches per second with depth receives posted: every message takes a
+ * random posted receive which is then posted again with a fresh tag, so
+ * the depth stays put. wild of them are wildcards that never match and
+ * sit in front of every exact match.
+ */
+static double tm_sw_rate(int depth, int wild)
+{
+	struct tm_sw_engine tm(depth + wild);
+	std::vector<uint64_t> tags(depth);
+	uint64_t next = 0;
+	double t;
+
+	for (int i = 0; i < wild; i++)
+		tm.append(1ULL << 63, 1ULL << 63, 0, tm_sge(0), 0);
+	for (int i = 0; i < depth; i++) {
+		tags[i] = next++;
+		tm.append(tags[i], TM_SW_FULL_MASK, tags[i], tm_sge(0), 0);
+	}
+
+	t = lat_now();
+	for (int i = 0; i < TM_SW_OPS; i++) {
+		int k = rand() % depth;
+		int h = tm.match(tags[k]);
+
+		if (h < 0 || tm.posted[h].wr_id != tags[k])
+			return 0;
+		tags[k] = next++;
+		tm.append(tags[k], TM_SW_FULL_MASK, tags[k], tm_sge(0), 0);
+	}
+	return TM_SW_OPS / (lat_now() - t);
+}
+
+/* the same for probes of depth queued unexpected messages */
+static double tm_sw_unexp_rate(int depth)
+{
+	struct tm_sw_engine tm;
+	std::vector<uint64_t> tags(depth);
+	uint64_t next = 0;
+	double t;
+
+	for (int i = 0; i < depth; i++) {
+		tags[i] = next++;
+		tm.arrive(tags[i], tags[i]);
+	}
+
+	t = lat_now();
+	for (int i = 0; i < TM_SW_OPS; i++) {
+		int k = rand() % depth;
+		int u = tm.probe(tags[k], TM_SW_FULL_MASK);
+
+		if (u < 0 || tm.unexpected[u].wr_id != tags[k])
+			return 0;
+		tags[k] = next++;
+		tm.arrive(tags[k], tags[k]);
+	}
+	return TM_SW_OPS / (lat_now() - t);
+}
+
+TEST(tm_sw, t1_rate) {
+	for (int depth = 1; depth <= TM_SW_MAX_DEPTH; depth *= 8) {
+		double exact = tm_sw_rate(depth, 0);
+		double wild = tm_sw_rate(depth, 16);
+		double unexp = tm_sw_unexp_rate(depth);
+
+		ASSERT_GT(exact, 0);
+		ASSERT_GT(wild, 0);
+		ASSERT_GT(unexp, 0);
+		VERBS_NOTICE("tm_sw depth %4d: %.2f Mmatch/s, %.2f with 16 "
+			     "wildcards, %.2f Mprobe/s unexpected\n", depth,
+			     exact, wild, unexp);
+	}
+}
+
+/* ns per append and match of a message for it */
+static double tm_sw_add_match(struct tm_sw_srq &srq)
+{
+	double t = lat_now();
+
+	for (int i = 0; i < TM_SW_OPS; i++) {
+		srq.add(1, 1, 0);
+		srq.poll();
+		if (srq.deliver(1) < 0)
+			return 0;
+	}
+	return (lat_now() - t) * 1e3 / TM_SW_OPS;
+}
+
+/*
+ * The b0_ops workload against the TM SRQ model: tag operations pipelined
+ * up to TM_MAX_OPS with the list near full, match cost against list
+ * occupancy and the failed append plus retry an unexpected message costs.
+ */
+TEST(tm_sw, t2_ops) {
+	struct tm_sw_srq srq;
+	int occ[] = { 1, 8, 32, TM_MAX_TAGS - TM_MAX_OPS };
+	std::deque<int> live;
+	uint64_t tag = 0x1000;
+	long phase_cnt = 0;
+	double t;
+	int h, n;
+
+	for (size_t o = 0; o < sizeof(occ) / sizeof(occ[0]); o++) {
+		struct tm_sw_srq wild;
+		double exact, masked;
+
+		while ((int)live.size() < occ[o] - 1) {
+			ASSERT_EQ(0, srq.add(tag++, 0, phase_cnt));
+			ASSERT_GE(h = srq.poll(), 0);
+			live.push_back(h);
+		}
+		/* wildcards posted ahead of the receive a message is for */
+		for (int i = 0; i < occ[o] - 1; i++)
+			wild.engine.append(1ULL << 63, 1ULL << 63, 0, tm_sge(0), 0);
+
+		exact = tm_sw_add_match(srq);
+		masked = tm_sw_add_match(wild);
+		ASSERT_GT(exact, 0);
+		ASSERT_GT(masked, 0);
+		VERBS_NOTICE("tm_sw %2d posted: add+match %.0f ns, %.0f ns behind "
+			     "wildcards\n", occ[o], exact, masked);
+	}
+
+	ASSERT_EQ(0, srq.add(tag++, 0, phase_cnt));
+	ASSERT_GE(h = srq.poll(), 0);
+	live.push_back(h);
+
+	for (size_t depth = 1; depth <= srq.max_ops; depth++) {
+		t = lat_now();
+		for (n = 0; n < TM_SW_OPS; n += depth) {
+			for (size_t k = 0; k < depth; k++) {
+				if ((n + k) & 1) {
+					ASSERT_EQ(0, srq.add(tag++, 0, phase_cnt));
+				} else {
+					ASSERT_EQ(0, srq.del(live.front()));
+					live.pop_front();
+				}
+			}
+			if (depth == srq.max_ops) {
+				ASSERT_EQ(-EBUSY, srq.add(0, 0, phase_cnt));
+			}
+			for (size_t k = 0; k < depth; k++) {
+				bool add = srq.ops.front().add;
+
+				ASSERT_GE(h = srq.poll(), 0);
+				if (add)
+					live.push_back(h);
+			}
+		}
+		t = lat_now() - t;
+		if (depth == 1 || depth == srq.max_ops)
+			VERBS_NOTICE("tm_sw %zu ops in flight: %.2f Mops/s\n",
+				     depth, n / t);
+	}
+	ASSERT_LE(srq.engine.num_posted, TM_MAX_TAGS - TM_MAX_OPS);
+
+	/* an unexpected message fails the append in flight, resync and retry */
+	t = lat_now();
+	for (n = 0; n < TM_SW_OPS; n++) {
+		ASSERT_EQ(-1, srq.deliver(2));
+		ASSERT_EQ(0, srq.add(2, 2, phase_cnt));
+		ASSERT_EQ(-EAGAIN, srq.poll());
+		phase_cnt = srq.engine.phase;
+		ASSERT_EQ(0, srq.add(2, 2, phase_cnt));
+		ASSERT_GE(srq.poll(), 0);
+		ASSERT_GE(srq.deliver(2), 0);
+	}
+	VERBS_NOTICE("tm_sw unexpected message and resync %.0f ns\n",
+		     (lat_now() - t) * 1e3 / n);
+}
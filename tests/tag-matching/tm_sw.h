@@ -0,0 +1,322 @@
+/**
+ * Copyright (C) 2016      Mellanox Technologies Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __TM_SW_H_
+#define __TM_SW_H_
+
+#include <errno.h>
+#include <stdint.h>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+/*
+ * Software tag matching with the semantics of a TM SRQ.
+ *
+ * Posted receives with a full mask sit in per-tag FIFO buckets, the others
+ * in a wildcard list in posting order. A message takes the oldest posted
+ * receive it matches: the front of its bucket, unless a wildcard receive
+ * posted earlier matches too, so the wildcard list is scanned only up to
+ * the posting sequence of that front. Every receive is reachable by its
+ * handle, so a cancel is an unlink.
+ *
+ * Messages that match nothing are unexpected. They bump the phase count
+ * an append must quote, like tm.unexpected_cnt of IBV_WR_TAG_ADD, and are
+ * kept in arrival order, per tag and overall, for the consumer to probe.
+ */
+
+#define TM_SW_FULL_MASK 0xffffffffffffffffULL
+
+/* the tm_cap the tests create their TM SRQs with */
+#define TM_MAX_OPS 10
+#define TM_MAX_TAGS 63
+
+struct tm_sw_engine {
+	struct entry {
+		uint64_t tag;
+		uint64_t mask;
+		uint64_t seq;
+		uint64_t wr_id;
+		struct ibv_sge sge;
+		bool used;
+		std::list<int>::iterator pos;
+	};
+
+	struct unexp {
+		uint64_t tag;
+		uint64_t wr_id;
+		bool used;
+		std::list<int>::iterator by_tag;
+		std::list<int>::iterator all;
+	};
+
+	int max_tags;
+	uint64_t seq;
+	long phase;
+
+	std::vector<struct entry> posted;
+	std::vector<int> free_posted;
+	std::unordered_map<uint64_t, std::list<int> > buckets;
+	std::list<int> wild;
+	int num_posted;
+
+	std::vector<struct unexp> unexpected;
+	std::vector<int> free_unexp;
+	std::unordered_map<uint64_t, std::list<int> > unexp_buckets;
+	std::list<int> unexp_all;
+
+	long matches;
+	long wild_steps;
+
+	tm_sw_engine(int max = 64) : max_tags(max), seq(0), phase(0),
+		num_posted(0), matches(0), wild_steps(0) {}
+
+	static bool hit(uint64_t tag, uint64_t mask, uint64_t msg) {
+		return !((tag ^ msg) & mask);
+	}
+
+	/*
+	 * Posts a receive, returns its handle, -EAGAIN when phase_cnt is
+	 * behind the unexpected messages seen so far or -ENOSPC when the
+	 * list is full.
+	 */
+	int append(uint64_t tag, uint64_t mask, uint64_t wr_id,
+		   struct ibv_sge sge, long phase_cnt) {
+		int h;
+
+		if (phase_cnt != phase)
+			return -EAGAIN;
+		if (num_posted == max_tags)
+			return -ENOSPC;
+		if (free_posted.empty()) {
+			free_posted.push_back(posted.size());
+			posted.push_back(entry());
+		}
+		h = free_posted.back();
+		free_posted.pop_back();
+
+		struct entry &e = posted[h];
+
+		e.tag = tag & mask;
+		e.mask = mask;
+		e.seq = seq++;
+		e.wr_id = wr_id;
+		e.sge = sge;
+		e.used = true;
+		if (mask == TM_SW_FULL_MASK) {
+			std::list<int> &b = buckets[tag];
+
+			e.pos = b.insert(b.end(), h);
+		} else {
+			e.pos = wild.insert(wild.end(), h);
+		}
+		num_posted++;
+		return h;
+	}
+
+	bool remove(int h) {
+		if (h < 0 || h >= (int)posted.size() || !posted[h].used)
+			return false;
+
+		struct entry &e = posted[h];
+
+		if (e.mask == TM_SW_FULL_MASK) {
+			std::unordered_map<uint64_t, std::list<int> >::iterator b =
+				buckets.find(e.tag);
+
+			b->second.erase(e.pos);
+			if (b->second.empty())
+				buckets.erase(b);
+		} else {
+			wild.erase(e.pos);
+		}
+		e.used = false;
+		free_posted.push_back(h);
+		num_posted--;
+		return true;
+	}
+
+	/* takes the receive a message with tag lands in, -1 if unexpected */
+	int match(uint64_t tag) {
+		std::unordered_map<uint64_t, std::list<int> >::iterator b =
+			buckets.find(tag);
+		uint64_t limit = b == buckets.end() ? UINT64_MAX :
+			posted[b->second.front()].seq;
+		int h = b == buckets.end() ? -1 : b->second.front();
+
+		for (std::list<int>::iterator w = wild.begin(); w != wild.end(); w++) {
+			struct entry &e = posted[*w];
+
+			wild_steps++;
+			if (e.seq > limit)
+				break;
+			if (hit(e.tag, e.mask, tag)) {
+				h = *w;
+				break;
+			}
+		}
+		if (h >= 0) {
+			matches++;
+			remove(h);
+		}
+		return h;
+	}
+
+	/* a message no receive matched, delivered elsewhere */
+	void miss() { phase++; }
+
+	/* queues a message no receive matched, returns its id */
+	int arrive(uint64_t tag, uint64_t wr_id) {
+		int u;
+
+		if (free_unexp.empty()) {
+			free_unexp.push_back(unexpected.size());
+			unexpected.push_back(unexp());
+		}
+		u = free_unexp.back();
+		free_unexp.pop_back();
+
+		struct unexp &m = unexpected[u];
+		std::list<int> &b = unexp_buckets[tag];
+
+		m.tag = tag;
+		m.wr_id = wr_id;
+		m.used = true;
+		m.by_tag = b.insert(b.end(), u);
+		m.all = unexp_all.insert(unexp_all.end(), u);
+		miss();
+		return u;
+	}
+
+	/* takes the oldest unexpected message matching tag/mask, -1 if none */
+	int probe(uint64_t tag, uint64_t mask) {
+		int u = -1;
+
+		if (mask == TM_SW_FULL_MASK) {
+			std::unordered_map<uint64_t, std::list<int> >::iterator b =
+				unexp_buckets.find(tag);
+
+			if (b != unexp_buckets.end())
+				u = b->second.front();
+		} else {
+			for (std::list<int>::iterator m = unexp_all.begin();
+			     m != unexp_all.end(); m++) {
+				wild_steps++;
+				if (hit(tag, mask, unexpected[*m].tag)) {
+					u = *m;
+					break;
+				}
+			}
+		}
+		if (u < 0)
+			return -1;
+
+		struct unexp &m = unexpected[u];
+		std::unordered_map<uint64_t, std::list<int> >::iterator b =
+			unexp_buckets.find(m.tag);
+
+		b->second.erase(m.by_tag);
+		if (b->second.empty())
+			unexp_buckets.erase(b);
+		unexp_all.erase(m.all);
+		m.used = false;
+		free_unexp.push_back(u);
+		return u;
+	}
+
+	size_t num_unexpected() { return unexp_all.size(); }
+};
+
+/*
+ * The TM SRQ as its user sees it: tag operations are queued, at most
+ * max_ops of them outstanding, and take effect when their completion is
+ * polled, a stale phase count included.
+ */
+struct tm_sw_srq {
+	struct op {
+		bool add;
+		uint64_t tag;
+		uint64_t wr_id;
+		long phase_cnt;
+		int handle;
+	};
+
+	tm_sw_engine engine;
+	size_t max_ops;
+	std::deque<struct op> ops;
+
+	tm_sw_srq(int max_tags = TM_MAX_TAGS, int max = TM_MAX_OPS) :
+		engine(max_tags), max_ops(max) {}
+
+	int add(uint64_t tag, uint64_t wr_id, long phase_cnt) {
+		struct op o = { true, tag, wr_id, phase_cnt, -1 };
+
+		if (ops.size() == max_ops)
+			return -EBUSY;
+		ops.push_back(o);
+		return 0;
+	}
+
+	int del(int handle) {
+		struct op o = { false, 0, 0, 0, handle };
+
+		if (ops.size() == max_ops)
+			return -EBUSY;
+		ops.push_back(o);
+		return 0;
+	}
+
+	/* completes the oldest operation, returns its handle or -errno */
+	int poll() {
+		struct ibv_sge sge = {};
+		struct op o;
+
+		if (ops.empty())
+			return -ENOENT;
+		o = ops.front();
+		ops.pop_front();
+		if (o.add)
+			return engine.append(o.tag, TM_SW_FULL_MASK, o.wr_id,
+					     sge, o.phase_cnt);
+		return engine.remove(o.handle) ? o.handle : -ENOENT;
+	}
+
+	/* a message arrives, returns the receive it took or -1 */
+	int deliver(uint64_t tag) {
+		int h = engine.match(tag);
+
+		if (h < 0)
+			engine.miss();
+		return h;
+	}
+};
+
+#endif
@@ -42,6 +42,8 @@
 #include <unistd.h>
 #include <infiniband/verbs.h>
 #include "env.h"
+#include "flow.h"
+#include "raw_qp.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -109,10 +111,33 @@ enum {
 #define TYP_SMLE 1
 #define TYP_BIGE 2
 
-/* Macro for allocating. */
-#define ALLOCATE(var,type,size)                                     \
-{ if((var = (type*)malloc(sizeof(type)*(size))) == NULL)        \
-        { fprintf(stderr," Cannot Allocate\n"); exit(1);}}
+#define VXLAN_VNI 0x15
+#define PPS_PACKETS (1 << 16)
+
+#define VXLAN_FRAME 128
+#define VXLAN_PAYLOAD (VXLAN_FRAME - FLOW_VXLAN_OVERHEAD - FLOW_UDP_HDRS)
+#define VXLAN_PACKETS (1 << 14)
+#define VXLAN_BATCH 16
+#define VXLAN_MISS 8
+#define VXLAN_MISS_VNI 0x8000	/* offset of a VNI no sweep point installs */
+
+static const uint8_t vxlan_dst_mac[6] = {
+	MY_DEST_MAC0, MY_DEST_MAC1, MY_DEST_MAC2,
+	MY_DEST_MAC3, MY_DEST_MAC4, MY_DEST_MAC5
+};
+static const uint8_t vxlan_src_mac[6] = {
+	MY_DEST_MAC7, MY_DEST_MAC8, MY_DEST_MAC9,
+	MY_DEST_MAC3, MY_DEST_MAC4, MY_DEST_MAC6
+};
+
+#ifdef HAVE_VXLAN
+typedef ibvt_flow<flow_eth, flow_ipv4, flow_udp, flow_tunnel,
+		  flow_inner<flow_eth>, flow_inner<flow_ipv4>,
+		  flow_inner<flow_udp> > vxlan_rule;
+typedef ibvt_flow<flow_eth, flow_ipv4, flow_udp, flow_tunnel,
+		  flow_inner<flow_eth>, flow_inner<flow_ipv4>,
+		  flow_inner<flow_udp>, flow_tag> vxlan_tag_rule;
+#endif
 
 unsigned short csum(unsigned short *buf, int nwords)
 {
@@ -158,236 +183,70 @@ uint16_t udp_checksum(const void *buff, size_t len)
         return ( (uint16_t)(~sum)  );
 }
 
-int calc_flow_rules_size()
-{
-        int tot_size = sizeof(struct ibv_flow_attr);
-        tot_size += sizeof(struct ibv_flow_spec_eth);
-                tot_size += sizeof(struct ibv_flow_spec_ipv4);
-                tot_size += sizeof(struct ibv_flow_spec_tcp_udp);
-
-        return tot_size;
-}
-
-struct ibvt_ctx_eth : public ibvt_ctx {
-	ibvt_ctx_eth(ibvt_env& e) : ibvt_ctx(e) { }
-
-	virtual bool check_port(struct ibv_device *dev, struct ibv_port_attr &port_attr ) {
-		if ((port_attr.state == IBV_PORT_ACTIVE) &&  (port_attr.link_layer == IBV_LINK_LAYER_ETHERNET) )
-			return true;
-		return false;
-	}
-
-};
-
-struct ibvt_raw_qp : public ibvt_qp {
-	 ibvt_raw_qp(ibvt_env &e, ibvt_pd &p, ibvt_cq &c) : ibvt_qp(e, p, c) {}
-
-	uintptr_t start;
-	size_t length;
-        struct ibv_flow	*flow_create_result;
-
-	virtual void init() { 
-	
-		EXEC(pd.init());
-                EXEC(cq.init());
-		struct ibv_qp_init_attr_ex attr;
-		memset(&attr, 0, sizeof(attr));
-                init_attr(attr);
-                attr.sq_sig_all = 1;
-                attr.cap.max_send_wr = 50;
-                attr.cap.max_recv_wr = 50;
-                attr.cap.max_send_sge = 1;
-                attr.cap.max_recv_sge = 1;
-                attr.send_cq = cq.cq;
-                attr.recv_cq = cq.cq;
-                attr.pd = pd.pd;
-                attr.comp_mask = IBV_QP_INIT_ATTR_PD;
-		attr.qp_type = IBV_QPT_RAW_PACKET;
-		SET(qp, ibv_create_qp_ex(pd.ctx.ctx , &attr)); 
+template <typename T>
+struct vxlan_test : public testing::Test, public ibvt_env {
+	typename T::CTX ctx_recv;
+	typename T::CTX ctx_send;
+	typename T::PD pd_recv;
+	typename T::PD pd_send;
+	typename T::CQ cq_recv;
+	typename T::CQ cq_send;
+	typename T::QP qp_recv;
+	typename T::QP qp_send;
+	typename T::MR mr_recv;
+	typename T::MR mr_send;
+	long rx_done;
 
-	}
+#ifdef HAVE_VXLAN
+	vxlan_rule flow_rules;
+#endif
 
-	virtual void connect(struct ibvt_qp *r) {
-		struct ibv_qp_attr attr;
-		int flags;
-
-		memset(&attr, 0, sizeof(attr));
-		attr.qp_state = IBV_QPS_INIT;
-		attr.port_num = pd.ctx.port_num;
-		attr.pkey_index = 0;
-		attr.qkey            = 0x11111111;
-		attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-		flags = IBV_QP_STATE | IBV_QP_PORT ;
-		DO(ibv_modify_qp(qp, &attr, flags));
-
-		memset(&attr, 0, sizeof(attr));
-		attr.qp_state = IBV_QPS_RTR;
-		flags = IBV_QP_STATE ;
-		DO(ibv_modify_qp(qp, &attr, flags));
-
-		memset(&attr, 0, sizeof(attr));
-		attr.qp_state = IBV_QPS_RTS;
-		attr.timeout = 14;
-		attr.retry_cnt = 7;
-		attr.rnr_retry = 7;
-		attr.sq_psn = 0;
-		attr.max_rd_atomic = 1;
-		flags = IBV_QP_STATE ;
-
-		DO(ibv_modify_qp(qp, &attr, flags));
-	}
+	vxlan_test() :
+		ctx_recv(*this),
+		ctx_send(*this),
+		pd_recv(*this, ctx_recv),
+		pd_send(*this, ctx_send),
+		cq_recv(*this, ctx_recv),
+		cq_send(*this, ctx_send),
+		qp_recv(*this, pd_recv, cq_recv),
+		qp_send(*this, pd_send, cq_send),
+		mr_recv(*this, pd_recv, VXLAN_FRAME * RAW_QP_DEPTH),
+		mr_send(*this, pd_send, VXLAN_FRAME * VXLAN_BATCH),
+		rx_done(0)
+	{ }
 
-	void vxlan_create_rules( struct ibv_qp  *qp,
-                struct ibv_flow_attr *flow_rules) {
+	virtual void SetUp() {
 
-                SET(flow_create_result,ibv_create_flow(qp, flow_rules));
-	}
+#ifdef HAVE_VXLAN
 
-	void vxlan_destroy_rules() {
+		INIT(ctx_recv.init());
+		INIT(ctx_send.init());
+		INIT(qp_send.init());
+		INIT(qp_recv.init());
+		INIT(mr_recv.init());
+		INIT(mr_send.init());
+		raw_capture(qp_send, cq_recv);
+#else 
+		skip = 1;
+#endif
 
-		DO(ibv_destroy_flow(flow_create_result)); 
 	}
 
-	void set_up_flow_rules(
-                struct ibv_flow_attr **flow_rules) {
 #ifdef HAVE_VXLAN
-        struct ibv_flow_spec* spec_info;
-        struct ibv_flow_attr* attr_info;
-
-        void* header_buff;
-        int flow_rules_size;
-        int is_vxlan = 1;
-
-        flow_rules_size = calc_flow_rules_size();
-        if (is_vxlan) {
-		flow_rules_size += sizeof(struct ibv_flow_spec_tunnel);
-		flow_rules_size += sizeof(struct ibv_flow_spec_eth);
-		flow_rules_size += sizeof(struct ibv_flow_spec_ipv4);
-		flow_rules_size += sizeof(struct ibv_flow_spec_tcp_udp);
+	void set_up_flow_rules() {
+		flow_set_eth(flow_rules.spec<0>(), vxlan_dst_mac, vxlan_src_mac,
+			     ETH_P_IP);
+		flow_set_ipv4(flow_rules.spec<1>(), IP_SRC, IP_DEST);
+		flow_set_udp(flow_rules.spec<2>(), UDP_SRC_PORT, UDP_DEST_PORT);
+		flow_rules.spec<3>().val.tunnel_id = htonl(VXLAN_VNI);
+		flow_rules.spec<3>().mask.tunnel_id = htonl(0xffffff);
+		flow_set_eth(flow_rules.spec<4>(), vxlan_dst_mac, vxlan_src_mac,
+			     ETH_P_IP);
+		flow_set_ipv4(flow_rules.spec<5>(), IP_SRC, IP_DEST);
+		flow_set_udp(flow_rules.spec<6>(), UDP_SRC_PORT, UDP_DEST_PORT);
 	}
+#endif
 
-        ALLOCATE(header_buff, uint8_t, flow_rules_size);
-        memset(header_buff, 0, flow_rules_size);
-        *flow_rules = (struct ibv_flow_attr*)header_buff;
-        attr_info = (struct ibv_flow_attr*)header_buff;
-
-        attr_info->size = flow_rules_size;
-        attr_info->priority = 0;
-        attr_info->num_of_specs = 3;
-        if (is_vxlan)
-                attr_info->num_of_specs += 4;
-
-        attr_info->flags = 0;
-
-        attr_info->type = IBV_FLOW_ATTR_NORMAL;
-        header_buff = (char*)header_buff + sizeof(struct ibv_flow_attr);
-        spec_info = (struct ibv_flow_spec*)header_buff;
-        spec_info->eth.type = IBV_FLOW_SPEC_ETH;
-        spec_info->eth.size = sizeof(struct ibv_flow_spec_eth);
-        spec_info->eth.val.ether_type = 0;
-
-        spec_info->eth.val.dst_mac[0] = MY_DEST_MAC0;
-        spec_info->eth.val.dst_mac[1] = MY_DEST_MAC1;
-        spec_info->eth.val.dst_mac[2] = MY_DEST_MAC2;
-        spec_info->eth.val.dst_mac[3] = MY_DEST_MAC3; 
-        spec_info->eth.val.dst_mac[4] = MY_DEST_MAC4; 
-        spec_info->eth.val.dst_mac[5] = MY_DEST_MAC5; 
-        memset(spec_info->eth.mask.dst_mac, 0xFF,sizeof(spec_info->eth.mask.dst_mac));
-        spec_info->eth.val.src_mac[0] = MY_DEST_MAC7; 
-        spec_info->eth.val.src_mac[1] = MY_DEST_MAC8; 
-        spec_info->eth.val.src_mac[2] = MY_DEST_MAC9; 
-        spec_info->eth.val.src_mac[3] = MY_DEST_MAC3; 
-        spec_info->eth.val.src_mac[4] = MY_DEST_MAC4; 
-        spec_info->eth.val.src_mac[5] = MY_DEST_MAC6; 
-        memset(spec_info->eth.mask.src_mac, 0xFF,sizeof(spec_info->eth.mask.src_mac));
-
-        spec_info->eth.val.ether_type = htons(0x0800);
-        spec_info->eth.mask.ether_type = 0xffff;
-        memset((void*)&spec_info->eth.mask.ether_type, 0xFF,sizeof(spec_info->eth.mask.ether_type));
-        memset(spec_info->eth.mask.dst_mac, 0xFF,sizeof(spec_info->eth.mask.src_mac));
-
-	header_buff = (char*)header_buff + sizeof(struct ibv_flow_spec_eth);
-	spec_info = (struct ibv_flow_spec*)header_buff;
-	spec_info->ipv4.type = IBV_FLOW_SPEC_IPV4;
-	spec_info->ipv4.size = sizeof(struct ibv_flow_spec_ipv4);
-
-        memset((void*)&spec_info->ipv4.mask.dst_ip, 0xFF,sizeof(spec_info->ipv4.mask.dst_ip));
-        memset((void*)&spec_info->ipv4.mask.src_ip, 0xFF,sizeof(spec_info->ipv4.mask.src_ip));
-        spec_info->ipv4.val.dst_ip = htonl(IP_DEST);
-        spec_info->ipv4.val.src_ip = htonl(IP_SRC);
-        memset((void*)&spec_info->ipv4.mask.dst_ip, 0xFF,sizeof(spec_info->ipv4.mask.dst_ip));
-        memset((void*)&spec_info->ipv4.mask.src_ip, 0xFF,sizeof(spec_info->ipv4.mask.src_ip));
-
-        header_buff = (char*)header_buff + sizeof(struct ibv_flow_spec_ipv4);
-        spec_info = (struct ibv_flow_spec*)header_buff;
-        spec_info->tcp_udp.type = IBV_FLOW_SPEC_UDP;
-        spec_info->tcp_udp.size = sizeof(struct ibv_flow_spec_tcp_udp);
-
-
-        memset((void*)&spec_info->tcp_udp.mask.dst_port, 0xFF,sizeof(spec_info->ipv4.mask.dst_ip));
-        memset((void*)&spec_info->tcp_udp.mask.src_port, 0xFF,sizeof(spec_info->ipv4.mask.src_ip));
-        spec_info->tcp_udp.val.dst_port = htons(UDP_DEST_PORT);
-        spec_info->tcp_udp.val.src_port = htons(UDP_SRC_PORT);
-        memset((void*)&spec_info->tcp_udp.mask.dst_port, 0xFF,sizeof(spec_info->ipv4.mask.dst_ip));
-        memset((void*)&spec_info->tcp_udp.mask.src_port, 0xFF,sizeof(spec_info->ipv4.mask.src_ip));
-	if (is_vxlan) {
-		header_buff = (char*)header_buff + sizeof(struct ibv_flow_spec_tcp_udp);
-		spec_info = (struct ibv_flow_spec*)header_buff;
-		spec_info->tunnel.type = IBV_FLOW_SPEC_VXLAN_TUNNEL;
-		spec_info->tunnel.size = sizeof(struct ibv_flow_spec_tunnel);
-
-		spec_info->tunnel.val.tunnel_id = htonl(0x15);
-		spec_info->tunnel.mask.tunnel_id = htonl(0xffffff);
-
-		header_buff = (char*)header_buff + sizeof(struct ibv_flow_spec_tunnel);
-		spec_info = (struct ibv_flow_spec*)header_buff;
-		spec_info->eth.type = (ibv_flow_spec_type)(IBV_FLOW_SPEC_ETH | IBV_FLOW_SPEC_INNER);
-		spec_info->eth.size = sizeof(struct ibv_flow_spec_eth);
-
-
-		spec_info->eth.val.dst_mac[0] = MY_DEST_MAC0;
-		spec_info->eth.val.dst_mac[1] = MY_DEST_MAC1;
-		spec_info->eth.val.dst_mac[2] = MY_DEST_MAC2;
-		spec_info->eth.val.dst_mac[3] = MY_DEST_MAC3; 
-		spec_info->eth.val.dst_mac[4] = MY_DEST_MAC4; 
-		spec_info->eth.val.dst_mac[5] = MY_DEST_MAC5; 
-		memset(spec_info->eth.mask.dst_mac, 0xFF,sizeof(spec_info->eth.mask.dst_mac));
-		spec_info->eth.val.src_mac[0] = MY_DEST_MAC7; 
-		spec_info->eth.val.src_mac[1] = MY_DEST_MAC8; 
-		spec_info->eth.val.src_mac[2] = MY_DEST_MAC9; 
-		spec_info->eth.val.src_mac[3] = MY_DEST_MAC3; 
-		spec_info->eth.val.src_mac[4] = MY_DEST_MAC4; 
-		spec_info->eth.val.src_mac[5] = MY_DEST_MAC6; 
-		memset(spec_info->eth.mask.src_mac, 0xFF,sizeof(spec_info->eth.mask.src_mac));
-
-		spec_info->eth.val.ether_type = htons(0x0800);
-		spec_info->eth.mask.ether_type = 0xffff;
-		memset((void*)&spec_info->eth.mask.ether_type, 0xFF,sizeof(spec_info->eth.mask.ether_type));
-
-		header_buff = (char*)header_buff + sizeof(struct ibv_flow_spec_eth);
-		spec_info = (struct ibv_flow_spec*)header_buff;
-		spec_info->ipv4.type = (ibv_flow_spec_type)(IBV_FLOW_SPEC_IPV4 | IBV_FLOW_SPEC_INNER);
-		spec_info->ipv4.size = sizeof(struct ibv_flow_spec_ipv4);
-
-		spec_info->ipv4.val.dst_ip = htonl(IP_DEST);
-		spec_info->ipv4.val.src_ip = htonl(IP_SRC);
-		memset((void*)&spec_info->ipv4.mask.dst_ip, 0xFF,sizeof(spec_info->ipv4.mask.dst_ip));
-		memset((void*)&spec_info->ipv4.mask.src_ip, 0xFF,sizeof(spec_info->ipv4.mask.src_ip));
-
-		header_buff = (char*)header_buff + sizeof(struct ibv_flow_spec_ipv4);
-		spec_info = (struct ibv_flow_spec*)header_buff;
-		spec_info->tcp_udp.type = (ibv_flow_spec_type)(IBV_FLOW_SPEC_UDP | IBV_FLOW_SPEC_INNER);
-		spec_info->tcp_udp.size = sizeof(struct ibv_flow_spec_tcp_udp);
-
-		spec_info->tcp_udp.val.dst_port = htons(UDP_DEST_PORT);
-		spec_info->tcp_udp.val.src_port = htons(UDP_SRC_PORT);
-		memset((void*)&spec_info->tcp_udp.mask.dst_port, 0xFF,sizeof(spec_info->ipv4.mask.dst_ip));
-		memset((void*)&spec_info->tcp_udp.mask.src_port, 0xFF,sizeof(spec_info->ipv4.mask.src_ip));
-
-	}
-#endif	
-}
-	
 	void send_raw_packet(void* buf,int match)
 	{
         	int tx_len = 0;
@@ -509,132 +368,451 @@ struct ibvt_raw_qp : public ibvt_qp {
         	/* Send packet */
         	memcpy(buf,sendbuf,tx_len);
 	}
-	
 
-};
+	void poll_send(int n) {
+		struct ibv_wc wc[n];
+		long retries = POLL_RETRIES;
 
-struct vxlan_test : public testing::Test, public ibvt_env {
-	struct ibvt_ctx_eth ctx_recv;
-	struct ibvt_ctx_eth ctx_send;
+		while (n && --retries) {
+			int k = cq_send.poll_wc(wc, n);
 
-	struct ibvt_pd pd_recv;
-	struct ibvt_pd pd_send;
-	struct ibvt_cq cq_recv;
-	struct ibvt_cq cq_send;
-	struct ibvt_raw_qp qp_recv; 
-	struct ibvt_raw_qp qp_send;
-	struct ibvt_mr mr_recv;
-	struct ibvt_mr mr_send;
-	
+			ASSERT_GE(k, 0);
+			for (int i = 0; i < k; i++)
+				ASSERT_FALSE(wc[i].status) << ibv_wc_status_str(wc[i].status);
+			n -= k;
+		}
+		ASSERT_GT(retries, 0);
+	}
 
-	uintptr_t start;
-	size_t length;
+	void post_recv_window(int size = BUF_SIZ) {
+		for (int i = 0; i < RAW_QP_DEPTH; i++)
+			EXEC(qp_recv.recv(mr_recv.sge(i * size, size)));
+	}
 
-        struct ibv_flow	*flow_create_result ;
-        struct ibv_flow_attr	*flow_rules ;
+	/* count frames in batches of batch sends, receive window kept full */
+	void pps(int batch, int count) {
+		struct ibv_sge sge[batch];
+		struct ibv_wc wc[RAW_QP_DEPTH];
+		int sent = 0, recvd = 0;
+		double start, idle, usec;
+
+		for (int i = 0; i < batch; i++)
+			sge[i] = mr_send.sge(0, BUF_SIZ);
+
+		start = idle = sys_gettime();
+		while (recvd < count) {
+			/* no EXEC on the fast path, failures are checked once per round */
+			if (sent < count && sent - recvd + batch <= RAW_QP_DEPTH) {
+				qp_send.post_send_batch(sge, batch);
+				poll_send(batch);
+				sent += batch;
+			}
+
+			int n = cq_recv.poll_wc(wc, RAW_QP_DEPTH);
+			ASSERT_GE(n, 0);
+			for (int i = 0; i < n; i++) {
+				ASSERT_FALSE(wc[i].status) << ibv_wc_status_str(wc[i].status);
+				ASSERT_EQ((uint32_t)BUF_SIZ, wc[i].byte_len);
+				qp_recv.recv(mr_recv.sge((rx_done++ % RAW_QP_DEPTH) * BUF_SIZ, BUF_SIZ));
+			}
+			recvd += n;
+			if (HasFatalFailure())
+				return;
+
+			if (n)
+				idle = sys_gettime();
+			else if (sys_gettime() - idle > 1000000)
+				break;
+		}
+		usec = sys_gettime() - start;
+
+		VERBS_NOTICE("batch %3d: %d/%d packets in %.0f usec, %.3f Mpps\n",
+			     batch, recvd, sent, usec, recvd / usec);
+		ASSERT_EQ(sent, recvd);
+	}
 
-	vxlan_test() :
-		ctx_recv(*this),
-		ctx_send(*this),
-		pd_recv(*this, ctx_recv),
-		pd_send(*this, ctx_send),
-		cq_recv(*this, ctx_recv),
-		cq_send(*this, ctx_send),
-		qp_recv(*this, pd_recv, cq_recv),
-		qp_send(*this, pd_send, cq_send),
-		mr_recv(*this, pd_recv, SZ),
-		mr_send(*this, pd_send, SZ)
-	{ }
+#ifdef HAVE_VXLAN
+	/* inner 5-tuple t, the same set is used under every VNI */
+	struct flow_tuple vxlan_inner(int t) {
+		struct flow_tuple f = { (uint32_t)IP_SRC + t, IP_DEST,
+					(uint16_t)(UDP_SRC_PORT + t), UDP_DEST_PORT };
+		return f;
+	}
 
-	virtual void SetUp() {
+	/* tag of the rule for tuple t of VNI v */
+	int vxlan_tag(int v, int t, int tuples) {
+		return 1 + v * tuples + t;
+	}
 
-#ifdef HAVE_VXLAN
+	size_t vxlan_frame(uint8_t *buf, int v, int t) {
+		struct flow_tuple outer = { IP_SRC, IP_DEST, 0, 0 };
+		size_t len;
 
-		INIT(ctx_recv.init());
-		INIT(ctx_send.init());
-		INIT(qp_send.init());
-		INIT(qp_recv.init());
-		INIT(mr_recv.init());
-		INIT(mr_send.init());
-#else 
-		skip = 1;
-#endif
+		len = flow_build_udp(buf + FLOW_VXLAN_OVERHEAD, vxlan_dst_mac,
+				     vxlan_src_mac, vxlan_inner(t), VXLAN_PAYLOAD);
+		/* outer source port carries the inner flow entropy (RFC 7348) */
+		outer.src_port = 0xc000 | ((v * 31 + t) & 0x3fff);
+		return flow_vxlan_encap(buf, vxlan_dst_mac, vxlan_src_mac, outer,
+					VXLAN_VNI + v, len);
+	}
+
+	/* tag the received frame should have been steered with */
+	int vxlan_expected(const uint8_t *buf, size_t len, int tuples) {
+		struct flow_pkt p;
+
+		memset(&p, 0, sizeof(p));
+		flow_parse_l2(p, 0, buf, len);
+		if (!p.vxlan || !p.udp[1])
+			return -1;
+		return vxlan_tag((p.vxlan[4] << 16 | p.vxlan[5] << 8 |
+				  p.vxlan[6]) - VXLAN_VNI,
+				 ntohs(p.udp[1]->source) - UDP_SRC_PORT, tuples);
+	}
+
+	void add_vxlan_rules(std::vector<struct ibv_flow *> &flows,
+			     int vnis, int tuples) {
+		vxlan_tag_rule r;
+		struct ibv_flow *f;
+
+		flow_set_eth(r.spec<0>(), vxlan_dst_mac, vxlan_src_mac, ETH_P_IP);
+		flow_set_ipv4(r.spec<1>(), IP_SRC, IP_DEST);
+		r.spec<2>().val.dst_port = htons(FLOW_VXLAN_PORT);
+		r.spec<2>().mask.dst_port = 0xffff;
+		r.spec<3>().mask.tunnel_id = htonl(0xffffff);
+		flow_set_eth(r.spec<4>(), vxlan_dst_mac, vxlan_src_mac, ETH_P_IP);
+
+		for (int v = 0; v < vnis; v++) {
+			for (int t = 0; t < tuples; t++) {
+				struct flow_tuple in = vxlan_inner(t);
+
+				r.spec<3>().val.tunnel_id = htonl(VXLAN_VNI + v);
+				flow_set_ipv4(r.spec<5>(), in.src_ip, in.dst_ip);
+				flow_set_udp(r.spec<6>(), in.src_port, in.dst_port);
+				r.spec<7>().tag_id = vxlan_tag(v, t, tuples);
+				SET(f, qp_recv.add_flow(r.attr()));
+				flows.push_back(f);
+			}
+		}
+	}
 
+	/*
+	 * Encapsulated frames round robin over vnis x tuples inner flows, every
+	 * VXLAN_MISS-th one to a VNI without a rule. Each received frame is
+	 * parsed back and its flow tag checked against the rule it belongs to.
+	 */
+	void encap(int vnis, int tuples) {
+		std::vector<struct ibv_flow *> flows;
+		struct ibv_sge sge[VXLAN_BATCH];
+		struct ibv_wc wc[RAW_QP_DEPTH];
+		uint32_t tag[RAW_QP_DEPTH];
+		uint8_t *send = (uint8_t *)mr_send.buff;
+		uint8_t *recv = (uint8_t *)mr_recv.buff;
+		int rules = vnis * tuples;
+		long sent = 0, flow = 0, expect = 0, recvd = 0;
+		long wrong = 0, leaked = 0;
+		double cost, start, idle, usec;
+
+		EXEC(add_vxlan_rules(flows, vnis, tuples));
+
+		cost = sys_gettime();
+		for (int i = 0; i < VXLAN_PACKETS; i++)
+			vxlan_frame(send + i % VXLAN_BATCH * VXLAN_FRAME,
+				    i % vnis, i / vnis % tuples);
+		cost = sys_gettime() - cost;
+
+		start = idle = sys_gettime();
+		while (sent < VXLAN_PACKETS || recvd < expect) {
+			/* no EXEC on the fast path, failures are checked once per round */
+			if (sent < VXLAN_PACKETS &&
+			    expect - recvd + VXLAN_BATCH <= RAW_QP_DEPTH) {
+				for (int i = 0; i < VXLAN_BATCH; i++, sent++) {
+					uint8_t *buf = send + i * VXLAN_FRAME;
+					size_t len;
+
+					if (sent % VXLAN_MISS == VXLAN_MISS - 1) {
+						len = vxlan_frame(buf, VXLAN_MISS_VNI, 0);
+					} else {
+						len = vxlan_frame(buf, flow % vnis,
+								  flow / vnis % tuples);
+						flow++;
+						expect++;
+					}
+					sge[i] = mr_send.sge(i * VXLAN_FRAME, len);
+				}
+				qp_send.post_send_batch(sge, VXLAN_BATCH);
+				poll_send(VXLAN_BATCH);
+			}
+
+			int n = cq_recv.poll_tag(wc, tag, RAW_QP_DEPTH);
+			ASSERT_GE(n, 0);
+			for (int i = 0; i < n; i++) {
+				uint8_t *buf = (uint8_t *)wc[i].wr_id;
+				int e;
+
+				ASSERT_FALSE(wc[i].status) << ibv_wc_status_str(wc[i].status);
+				e = vxlan_expected(buf, wc[i].byte_len, tuples);
+				if (e > rules)
+					leaked++;
+				else if (e != (int)tag[i])
+					wrong++;
+				qp_recv.recv(mr_recv.sge(buf - recv, VXLAN_FRAME));
+			}
+			recvd += n;
+			if (HasFatalFailure())
+				return;
+
+			if (n)
+				idle = sys_gettime();
+			else if (sys_gettime() - idle > 1000000)
+				break;
+		}
+		usec = sys_gettime() - start;
+
+		for (size_t i = 0; i < flows.size(); i++)
+			DO(qp_recv.del_flow(flows[i]));
+
+		VERBS_NOTICE("%3d VNIs x %2d tuples: encap %.1f ns/frame, "
+			     "%ld/%ld steered, %ld wrong, %ld leaked, %.3f Mpps\n",
+			     vnis, tuples, cost * 1000 / VXLAN_PACKETS,
+			     recvd, expect, wrong, leaked, recvd / usec);
+		ASSERT_EQ(expect, recvd);
+		ASSERT_EQ(0, wrong);
+		ASSERT_EQ(0, leaked);
 	}
+#endif
 
 	virtual void TearDown() {
 		ASSERT_FALSE(HasFailure());
 	}
 };
 
-TEST_F(vxlan_test, t0) {
+TYPED_TEST_CASE(vxlan_test, raw_backends);
+
+TYPED_TEST(vxlan_test, t0) {
 
 	int len = BUF_SIZ ;
 	CHK_SUT(Vxlan);
 #ifdef HAVE_VXLAN
-	EXEC(qp_recv.set_up_flow_rules(&flow_rules));
+	EXEC(set_up_flow_rules());
 #endif
-	EXEC(qp_recv.recv(mr_recv.sge(0, len)));
+	EXEC(qp_recv.recv(this->mr_recv.sge(0, len)));
 	EXEC(qp_recv.connect(NULL));
 	EXEC(qp_send.connect(NULL));
 #ifdef HAVE_VXLAN
-	EXEC(qp_recv.vxlan_create_rules(qp_recv.qp, flow_rules));
-	EXEC(qp_send.send_raw_packet(this->mr_send.buff, 1));
+	EXEC(qp_recv.create_flow(this->flow_rules.attr()));
+	EXEC(send_raw_packet(this->mr_send.buff, 1));
 #endif
 	EXEC(qp_send.post_send(this->mr_send.sge(0, len),IBV_WR_SEND));
 
 	EXEC(cq_send.poll(1));
 	EXEC(cq_recv.poll(1));
-	EXEC(qp_recv.vxlan_destroy_rules());
+	EXEC(qp_recv.destroy_flow());
 
 }
 
-TEST_F(vxlan_test, t1) {
+TYPED_TEST(vxlan_test, t1) {
 
 	int len = BUF_SIZ ;
 	CHK_SUT(Vxlan);
 #ifdef HAVE_VXLAN
-	EXEC(qp_recv.set_up_flow_rules(&flow_rules));
+	EXEC(set_up_flow_rules());
 #endif
-	EXEC(qp_recv.recv(mr_recv.sge(0, len)));
+	EXEC(qp_recv.recv(this->mr_recv.sge(0, len)));
 	EXEC(qp_recv.connect(NULL));
 	EXEC(qp_send.connect(NULL));
 #ifdef HAVE_VXLAN
-	EXEC(qp_recv.vxlan_create_rules(qp_recv.qp, flow_rules));
-	EXEC(qp_send.send_raw_packet(this->mr_send.buff, 0));
+	EXEC(qp_recv.create_flow(this->flow_rules.attr()));
+	EXEC(send_raw_packet(this->mr_send.buff, 0));
 #endif
 	EXEC(qp_send.post_send(this->mr_send.sge(0, len),IBV_WR_SEND));
 
 	EXEC(cq_send.poll(1));
 	EXEC(cq_recv.poll_arrive(1));
-	EXEC(qp_recv.vxlan_destroy_rules());
+	EXEC(qp_recv.destroy_flow());
 
 }
 
-TEST_F(vxlan_test, t2) {
+TYPED_TEST(vxlan_test, t2) {
 
 	int len = BUF_SIZ ;
 	CHK_SUT(Vxlan);
 #ifdef HAVE_VXLAN
-	EXEC(qp_recv.set_up_flow_rules(&flow_rules));
+	EXEC(set_up_flow_rules());
 #endif
-	EXEC(qp_recv.recv(mr_recv.sge(0, len)));
+	EXEC(qp_recv.recv(this->mr_recv.sge(0, len)));
 	EXEC(qp_recv.connect(NULL));
 	EXEC(qp_send.connect(NULL));
 #ifdef HAVE_VXLAN
-	EXEC(qp_recv.vxlan_create_rules(qp_recv.qp, flow_rules));
-	EXEC(qp_send.send_raw_packet(this->mr_send.buff, 1));
+	EXEC(qp_recv.create_flow(this->flow_rules.attr()));
+	EXEC(send_raw_packet(this->mr_send.buff, 1));
 #endif
 	EXEC(qp_send.post_send(this->mr_send.sge(0, len),IBV_WR_SEND));
 
 	EXEC(cq_send.poll(1));
 	EXEC(cq_recv.poll(1));
 #ifdef HAVE_VXLAN
-	EXEC(qp_recv.vxlan_destroy_rules());
-	EXEC(qp_send.send_raw_packet(this->mr_send.buff, 0));
+	EXEC(qp_recv.destroy_flow());
+	EXEC(send_raw_packet(this->mr_send.buff, 0));
 #endif
 	EXEC(qp_send.post_send(this->mr_send.sge(0, len),IBV_WR_SEND));
 	EXEC(cq_send.poll(1));
 	EXEC(cq_recv.poll_arrive(1));
 
 }
+
+TYPED_TEST(vxlan_test, t3_pps) {
+
+	CHK_SUT(Vxlan);
+#ifdef HAVE_VXLAN
+	EXEC(set_up_flow_rules());
+	EXEC(post_recv_window());
+	EXEC(qp_recv.connect(NULL));
+	EXEC(qp_send.connect(NULL));
+	EXEC(qp_recv.create_flow(this->flow_rules.attr()));
+	EXEC(send_raw_packet(this->mr_send.buff, 1));
+	for (int batch = 1; batch <= 64; batch *= 4)
+		EXEC(pps(batch, PPS_PACKETS));
+	EXEC(qp_recv.destroy_flow());
+#endif
+}
+
+TYPED_TEST(vxlan_test, t4_encap) {
+
+	CHK_SUT(Vxlan);
+#ifdef HAVE_VXLAN
+	if (!this->cq_recv.tagged) {
+		VERBS_NOTICE("no flow tags in completions - skipping\n");
+		return;
+	}
+	EXEC(post_recv_window(VXLAN_FRAME));
+	EXEC(qp_recv.connect(NULL));
+	EXEC(qp_send.connect(NULL));
+	for (int vnis = 1; vnis <= 256; vnis *= 16)
+		for (int tuples = 1; tuples <= 4; tuples *= 4)
+			EXEC(encap(vnis, tuples));
+#endif
+}
+
+#ifdef HAVE_VXLAN
+TEST(vxlan_encap, frame) {
+	static const uint8_t mac[6] = { 2, 0, 0, 0, 0, 1 };
+	struct flow_tuple in = { IP_SRC, IP_DEST, UDP_SRC_PORT, UDP_DEST_PORT };
+	struct flow_tuple out = { IP_SRC, IP_DEST, 0xc000, 0 };
+	uint8_t buf[VXLAN_FRAME];
+	vxlan_tag_rule r;
+	struct flow_pkt p;
+	uint32_t tag;
+	size_t len;
+
+	len = flow_build_udp(buf + FLOW_VXLAN_OVERHEAD, mac, mac, in,
+			     VXLAN_PAYLOAD);
+	len = flow_vxlan_encap(buf, vxlan_dst_mac, vxlan_src_mac, out,
+			       VXLAN_VNI, len);
+	ASSERT_EQ((size_t)VXLAN_FRAME, len);
+
+	memset(&p, 0, sizeof(p));
+	flow_parse_l2(p, 0, buf, len);
+	ASSERT_TRUE(p.vxlan && p.udp[1]);
+	ASSERT_EQ(0, flow_ip_csum(p.ip[0]));
+	ASSERT_EQ(0, flow_ip_csum(p.ip[1]));
+	ASSERT_EQ(len - sizeof(struct ether_header), ntohs(p.ip[0]->tot_len));
+	ASSERT_EQ(htons(FLOW_VXLAN_PORT), p.udp[0]->dest);
+
+	flow_set_eth(r.spec<0>(), vxlan_dst_mac, vxlan_src_mac, ETH_P_IP);
+	flow_set_ipv4(r.spec<1>(), IP_SRC, IP_DEST);
+	r.spec<2>().val.dst_port = htons(FLOW_VXLAN_PORT);
+	r.spec<2>().mask.dst_port = 0xffff;
+	r.spec<3>().val.tunnel_id = htonl(VXLAN_VNI);
+	r.spec<3>().mask.tunnel_id = htonl(0xffffff);
+	flow_set_eth(r.spec<4>(), mac, mac, ETH_P_IP);
+	flow_set_ipv4(r.spec<5>(), in.src_ip, in.dst_ip);
+	flow_set_udp(r.spec<6>(), in.src_port, in.dst_port);
+	r.spec<7>().tag_id = FLOW_VXLAN_PORT;
+	ASSERT_TRUE(flow_match(r.attr(), buf, len, &tag));
+	ASSERT_EQ((uint32_t)FLOW_VXLAN_PORT, tag);
+
+	r.spec<3>().val.tunnel_id = htonl(VXLAN_VNI + 1);
+	ASSERT_FALSE(flow_match(r.attr(), buf, len, &tag));
+}
+#endif
+
+#define CAP_FRAMES 1000
+#define CAP_OVERHEAD (1 << 20)
+
+TEST(raw_capture, pcapng) {
+	char path[] = "/tmp/ibvt_capXXXXXX";
+	uint8_t frame[CAP_SNAPLEN];
+	uint32_t blk[2];
+	int fd = mkstemp(path);
+	int epb = 0, shb = 0, idb = 0;
+
+	ASSERT_GE(fd, 0);
+	close(fd);
+	memset(frame, 0x5a, sizeof(frame));
+	{
+		struct ibvt_capture cap(path);
+
+		ASSERT_TRUE(cap.f);
+		for (int i = 0; i < CAP_FRAMES; i++)
+			cap.put(i & 1 ? CAP_RX : CAP_TX, frame,
+				i % 2 ? 96 : 1500);
+		cap.flush();
+		ASSERT_EQ(cap.drops, 0U);
+	}
+
+	FILE *f = fopen(path, "r");
+
+	ASSERT_TRUE(f);
+	while (fread(blk, sizeof(blk), 1, f) == 1) {
+		uint32_t tail;
+
+		ASSERT_EQ(blk[1] % 4, 0U);
+		ASSERT_GE(blk[1], 12U);
+		fseek(f, blk[1] - 12, SEEK_CUR);
+		ASSERT_EQ(fread(&tail, sizeof(tail), 1, f), 1U);
+		ASSERT_EQ(tail, blk[1]);
+		if (blk[0] == 0x0a0d0d0a)
+			shb++;
+		else if (blk[0] == 1)
+			idb++;
+		else if (blk[0] == 6)
+			epb++;
+	}
+	fclose(f);
+	unlink(path);
+	ASSERT_EQ(shb, 1);
+	ASSERT_EQ(idb, 1);
+	ASSERT_EQ(epb, CAP_FRAMES);
+}
+
+TEST(raw_capture, overhead) {
+	char path[] = "/tmp/ibvt_capXXXXXX";
+	uint8_t frame[96];
+	int fd = mkstemp(path);
+	double t;
+
+	ASSERT_GE(fd, 0);
+	close(fd);
+	memset(frame, 0x5a, sizeof(frame));
+	{
+		struct ibvt_capture cap(path);
+
+		ASSERT_TRUE(cap.f);
+		t = 0;
+		/* half a ring per burst, the writer catches up in between */
+		for (int i = 0; i < CAP_OVERHEAD; i += CAP_SLOTS / 2) {
+			double t0 = sys_gettime();
+
+			for (int j = 0; j < CAP_SLOTS / 2; j++)
+				cap.put(CAP_TX, frame, sizeof(frame));
+			t += sys_gettime() - t0;
+			cap.flush();
+		}
+		VERBS_NOTICE("capture put %.1f ns/frame, %" PRIu64
+			     " written, %" PRIu64 " dropped\n",
+			     t * 1000 / CAP_OVERHEAD, cap.written, cap.drops);
+		ASSERT_EQ(cap.written, (uint64_t)CAP_OVERHEAD);
+		ASSERT_EQ(cap.drops, 0U);
+	}
+	unlink(path);
+}